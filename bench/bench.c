@@ -0,0 +1,286 @@
+/* bench.c - rule engine microbenchmark
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ *
+ * Runs rewrite_as_into() on synthetic path corpora against generated
+ * configurations, and prints one tab-separated line per measurement.
+ * Each configuration is loaded in its own process, the engine having
+ * global state.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "../rewrite.h"
+
+#define CORPUS_SIZE 4096
+#define MAX_LOOKUPS 100000
+#define MIN_LOOKUPS 100
+
+/* Allocations are counted by interposing the allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread unsigned long allocs;
+
+void *malloc(size_t size) {
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+static const char *variants[] = { "plain", "contexts", "global" };
+static const char *corpora[] = { "dotfiles", "deep", "nomatch" };
+
+static int rule_counts[16] = { 10, 100, 1000, 10000 };
+static int nrule_counts = 4;
+static int thread_counts[16] = { 1, 2, 4, 8 };
+static int nthread_counts = 4;
+static int cache_size = 0;
+static long duration_ms = 200;
+
+struct run {
+    char **corpus;
+    long lookups;
+    long *latencies;
+    unsigned long allocs;
+};
+
+static void write_config(FILE *fd, const char *variant, int nrules) {
+    int i = 0;
+
+    if(!strcmp(variant, "contexts")) {
+        /* Half of the rules belong to a context that never matches */
+        fprintf(fd, "- /^no-such-program/\n");
+        for(; i < nrules / 2; i++)
+            fprintf(fd, "m:^\\.app%d(?=/|$): .config/app%d\n", i, i);
+        fprintf(fd, "- /./\n");
+    }
+
+    for(; i < nrules; i++) {
+        if(!strcmp(variant, "global"))
+            fprintf(fd, "m:\\.app%d\\b:g .config/app%d\n", i, i);
+        else
+            fprintf(fd, "m:^\\.app%d(?=/|$): .config/app%d\n", i, i);
+    }
+}
+
+static char **make_corpus(const char *name, int nrules) {
+    char **corpus = malloc(CORPUS_SIZE * sizeof(char *));
+    unsigned int seed = 42;
+    int k;
+
+    for(int i = 0; i < CORPUS_SIZE; i++) {
+        k = rand_r(&seed) % nrules;
+        if(!strcmp(name, "dotfiles")) {
+            if(i % 4 == 3)
+                asprintf(&corpus[i], "/.bashrc%d", k);
+            else if(i % 2)
+                asprintf(&corpus[i], "/.app%d/config", k);
+            else
+                asprintf(&corpus[i], "/.app%d", k);
+        } else if(!strcmp(name, "deep")) {
+            asprintf(&corpus[i], "/home/user/src/project%d/a/b/c/d/e/f/file%d.c", k % 50, k);
+        } else {
+            asprintf(&corpus[i], "/data/dir%d/file%d", k % 100, k);
+        }
+    }
+
+    return corpus;
+}
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void *run_thread(void *arg) {
+    struct run *run = arg;
+    struct rewrite_caller caller = { getpid(), getuid(), getgid(), 022 };
+    struct rewrite_buf buf;
+    unsigned long start_allocs;
+    long deadline;
+    const char *res;
+
+    /* Warm up the per-thread state, and JIT-compile the rules */
+    for(int i = 0; i < CORPUS_SIZE; i++) {
+        if(rewrite_as_into(run->corpus[i], &caller, &buf))
+            rewrite_buf_free(&buf);
+    }
+
+    deadline = now_ns() + duration_ms * 1000000L;
+    start_allocs = allocs;
+    for(run->lookups = 0; run->lookups < MAX_LOOKUPS; run->lookups++) {
+        long t = now_ns();
+        res = rewrite_as_into(run->corpus[run->lookups % CORPUS_SIZE], &caller, &buf);
+        run->latencies[run->lookups] = now_ns() - t;
+        if(res == NULL) {
+            fprintf(stderr, "rewrite failed\n");
+            exit(1);
+        }
+        rewrite_buf_free(&buf);
+        if(run->lookups >= MIN_LOOKUPS && t > deadline)
+            break;
+    }
+    run->allocs = allocs - start_allocs;
+
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void measure(int nrules, const char *variant, const char *corpus_name, int nthreads) {
+    char **corpus = make_corpus(corpus_name, nrules);
+    struct run *runs = calloc(nthreads, sizeof(struct run));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    long *all, total = 0, sum = 0;
+    unsigned long nallocs = 0;
+
+    for(int i = 0; i < nthreads; i++) {
+        runs[i].corpus = corpus;
+        runs[i].latencies = malloc(MAX_LOOKUPS * sizeof(long));
+        pthread_create(&threads[i], NULL, run_thread, &runs[i]);
+    }
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += runs[i].lookups;
+        nallocs += runs[i].allocs;
+    }
+
+    all = malloc(total * sizeof(long));
+    total = 0;
+    for(int i = 0; i < nthreads; i++) {
+        for(long j = 0; j < runs[i].lookups; j++) {
+            all[total++] = runs[i].latencies[j];
+            sum += runs[i].latencies[j];
+        }
+        free(runs[i].latencies);
+    }
+    qsort(all, total, sizeof(long), compare_long);
+
+    printf("%d\t%s\t%s\t%d\t%ld\t%ld\t%ld\t%.2f\n", nrules, variant, corpus_name, nthreads,
+           total, sum / total, all[total * 99 / 100], (double)nallocs / total);
+    fflush(stdout);
+
+    free(all);
+    free(runs);
+    free(threads);
+    for(int i = 0; i < CORPUS_SIZE; i++)
+        free(corpus[i]);
+    free(corpus);
+}
+
+/* Load the configuration and run every measurement on it */
+static void bench_config(int nrules, const char *variant) {
+    char config_file[] = "/tmp/rewritefs-bench-XXXXXX";
+    char *opts;
+    int fd = mkstemp(config_file);
+    FILE *f;
+
+    if(fd == -1 || (f = fdopen(fd, "w")) == NULL) {
+        perror("creating configuration");
+        exit(1);
+    }
+    write_config(f, variant, nrules);
+    fclose(f);
+
+    asprintf(&opts, "config=%s,cache_size=%d", config_file, cache_size);
+    char *argv[] = { "rewritefs-bench", "-o", opts, "/", "/nonexistent", NULL };
+    struct fuse_args args = FUSE_ARGS_INIT(5, argv);
+    parse_args(5, argv, &args);
+    unlink(config_file);
+
+    for(int c = 0; c < 3; c++) {
+        for(int t = 0; t < nthread_counts; t++)
+            measure(nrules, variant, corpora[c], thread_counts[t]);
+    }
+
+    rewrite_cleanup();
+    fuse_opt_free_args(&args);
+    free(opts);
+}
+
+static int parse_list(char *arg, int *list) {
+    int n = 0;
+    for(char *tok = strtok(arg, ","); tok && n < 16; tok = strtok(NULL, ","))
+        list[n++] = atoi(tok);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    int opt, status;
+
+    while((opt = getopt(argc, argv, "hr:t:c:d:")) != -1) {
+        switch(opt) {
+        case 'r':
+            nrule_counts = parse_list(optarg, rule_counts);
+            break;
+        case 't':
+            nthread_counts = parse_list(optarg, thread_counts);
+            break;
+        case 'c':
+            cache_size = atoi(optarg);
+            break;
+        case 'd':
+            duration_ms = atol(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-r RULES,...] [-t THREADS,...] [-c CACHE_SIZE] [-d MILLISECONDS]\n"
+                    "\n"
+                    "    -r  number of rules of the generated configurations (default: 10,100,1000,10000)\n"
+                    "    -t  number of concurrent threads (default: 1,2,4,8)\n"
+                    "    -c  size of the rewrite cache (default: 0)\n"
+                    "    -d  duration of each measurement (default: 200)\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    printf("rules\tvariant\tcorpus\tthreads\tlookups\tns_per_lookup\tp99_ns\tallocs_per_lookup\n");
+    fflush(stdout);
+
+    for(int r = 0; r < nrule_counts; r++) {
+        for(int v = 0; v < 3; v++) {
+            pid_t pid = fork();
+            if(pid == -1) {
+                perror("fork");
+                return 1;
+            }
+            if(pid == 0) {
+                bench_config(rule_counts[r], variants[v]);
+                exit(0);
+            }
+            if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,233 @@
+/* io.c - system call backend benchmark
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ *
+ * Runs the operations rewritefs makes on the source directory, with the
+ * synchronous system calls and through io_uring, from concurrent threads,
+ * and prints one tab-separated line per measurement.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../uring.h"
+
+#define NFILES 256
+#define FILE_SIZE (1 << 20)
+#define BLOCK_SIZE 4096
+#define MAX_OPS 1000000
+
+static const char *ops[] = { "stat", "open", "read", "write" };
+
+static int thread_counts[16] = { 1, 4, 16, 64 };
+static int nthread_counts = 4;
+static long duration_ms = 200;
+static const char *dir = NULL;
+static char tmp_dir[] = "/tmp/rewritefs-bench-XXXXXX";
+static int dir_fd;
+static int file_fds[NFILES];
+
+struct run {
+    const char *op;
+    unsigned int seed;
+    long count;
+    long *latencies;
+};
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void file_name(char *name, int i) {
+    sprintf(name, "file%d", i);
+}
+
+static void do_op(struct run *run, char *buf) {
+    int i = rand_r(&run->seed) % NFILES;
+    off_t offset = (off_t)(rand_r(&run->seed) % (FILE_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+    char name[32];
+    struct stat st;
+    int fd, res = 0;
+
+    if(!strcmp(run->op, "stat")) {
+        file_name(name, i);
+        res = uring_fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW);
+    } else if(!strcmp(run->op, "open")) {
+        file_name(name, i);
+        res = fd = uring_openat(dir_fd, name, O_RDONLY);
+        if(fd != -1)
+            close(fd);
+    } else if(!strcmp(run->op, "read")) {
+        res = uring_pread(file_fds[i], buf, BLOCK_SIZE, offset);
+    } else {
+        res = uring_pwrite(file_fds[i], buf, BLOCK_SIZE, offset);
+    }
+
+    if(res == -1) {
+        perror(run->op);
+        exit(1);
+    }
+}
+
+static void *run_thread(void *arg) {
+    struct run *run = arg;
+    char buf[BLOCK_SIZE];
+    long deadline = now_ns() + duration_ms * 1000000L;
+
+    memset(buf, 'x', sizeof(buf));
+    for(run->count = 0; run->count < MAX_OPS; run->count++) {
+        long t = now_ns();
+        do_op(run, buf);
+        run->latencies[run->count] = now_ns() - t;
+        if(t > deadline)
+            break;
+    }
+
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void measure(const char *backend, const char *op, int nthreads) {
+    struct run *runs = calloc(nthreads, sizeof(struct run));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    long *all, total = 0, start, elapsed;
+
+    start = now_ns();
+    for(int i = 0; i < nthreads; i++) {
+        runs[i].op = op;
+        runs[i].seed = i + 1;
+        runs[i].latencies = malloc(MAX_OPS * sizeof(long));
+        pthread_create(&threads[i], NULL, run_thread, &runs[i]);
+    }
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += runs[i].count;
+    }
+    elapsed = now_ns() - start;
+
+    all = malloc(total * sizeof(long));
+    total = 0;
+    for(int i = 0; i < nthreads; i++) {
+        memcpy(all + total, runs[i].latencies, runs[i].count * sizeof(long));
+        total += runs[i].count;
+        free(runs[i].latencies);
+    }
+    qsort(all, total, sizeof(long), compare_long);
+
+    printf("%s\t%s\t%d\t%ld\t%.0f\t%ld\t%ld\n", backend, op, nthreads, total,
+           total * 1e9 / elapsed, all[total / 2], all[total * 99 / 100]);
+    fflush(stdout);
+
+    free(all);
+    free(runs);
+    free(threads);
+}
+
+static void setup_files() {
+    char name[32], *buf = calloc(1, FILE_SIZE);
+
+    if(dir == NULL) {
+        dir = mkdtemp(tmp_dir);
+        if(dir == NULL) {
+            perror("creating directory");
+            exit(1);
+        }
+    }
+    dir_fd = open(dir, O_PATH);
+    if(dir_fd == -1) {
+        perror(dir);
+        exit(1);
+    }
+
+    for(int i = 0; i < NFILES; i++) {
+        file_name(name, i);
+        file_fds[i] = openat(dir_fd, name, O_RDWR | O_CREAT, 0600);
+        if(file_fds[i] == -1 || pwrite(file_fds[i], buf, FILE_SIZE, 0) != FILE_SIZE) {
+            perror(name);
+            exit(1);
+        }
+    }
+    free(buf);
+}
+
+static void cleanup_files() {
+    char name[32];
+
+    for(int i = 0; i < NFILES; i++) {
+        file_name(name, i);
+        close(file_fds[i]);
+        unlinkat(dir_fd, name, 0);
+    }
+    close(dir_fd);
+    if(dir == tmp_dir)
+        rmdir(dir);
+}
+
+static int parse_list(char *arg, int *list) {
+    int n = 0;
+    for(char *tok = strtok(arg, ","); tok && n < 16; tok = strtok(NULL, ","))
+        list[n++] = atoi(tok);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while((opt = getopt(argc, argv, "ht:d:D:")) != -1) {
+        switch(opt) {
+        case 't':
+            nthread_counts = parse_list(optarg, thread_counts);
+            break;
+        case 'd':
+            duration_ms = atol(optarg);
+            break;
+        case 'D':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-t THREADS,...] [-d MILLISECONDS] [-D DIRECTORY]\n"
+                    "\n"
+                    "    -t  number of concurrent threads (default: 1,4,16,64)\n"
+                    "    -d  duration of each measurement (default: 200)\n"
+                    "    -D  directory of the test files (default: a new one in /tmp)\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    setup_files();
+    printf("backend\top\tthreads\tops\tops_per_s\tp50_ns\tp99_ns\n");
+    fflush(stdout);
+
+    for(int b = 0; b < 2; b++) {
+        if(b == 1 && uring_start() == -1) {
+            fprintf(stderr, "io_uring not available: %s\n", strerror(errno));
+            break;
+        }
+        for(int o = 0; o < 4; o++) {
+            for(int t = 0; t < nthread_counts; t++)
+                measure(b ? "io_uring" : "sync", ops[o], thread_counts[t]);
+        }
+    }
+    uring_stop();
+
+    cleanup_files();
+    return 0;
+}
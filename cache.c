@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+#define CACHE_SHARDS 16
+
+struct cache_entry {
+    struct cache_entry *hnext;
+    struct cache_entry *prev, *next; /* LRU list, most recent first */
+    uint64_t hash;
+    void *value;
+    size_t keylen;
+    char key[];
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry **buckets;
+    size_t nbuckets; /* power of 2 */
+    size_t size, capacity;
+    struct cache_entry *head, *tail;
+    unsigned long hits, misses;
+} __attribute__((aligned(64)));
+
+struct cache {
+    struct cache_shard shards[CACHE_SHARDS];
+    void (*free_value)(void *value);
+};
+
+static void *cache_alloc(size_t sz) {
+    void *res = calloc(1, sz);
+    if(res == NULL) {
+        perror("calloc");
+        abort();
+    }
+    return res;
+}
+
+/* FNV-1a */
+static uint64_t cache_hash(const void *key, size_t keylen) {
+    const unsigned char *p = key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while(keylen--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+struct cache *cache_new(size_t capacity, void (*free_value)(void *value)) {
+    struct cache *cache = cache_alloc(sizeof(struct cache));
+    size_t per_shard = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+
+    if(per_shard == 0)
+        per_shard = 1;
+
+    cache->free_value = free_value;
+    for(int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = per_shard;
+        for(shard->nbuckets = 1; shard->nbuckets < per_shard; shard->nbuckets *= 2);
+        shard->buckets = cache_alloc(shard->nbuckets * sizeof(struct cache_entry *));
+    }
+
+    return cache;
+}
+
+static void lru_unlink(struct cache_shard *shard, struct cache_entry *e) {
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        shard->head = e->next;
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        shard->tail = e->prev;
+}
+
+static void lru_push(struct cache_shard *shard, struct cache_entry *e) {
+    e->prev = NULL;
+    e->next = shard->head;
+    if(shard->head)
+        shard->head->prev = e;
+    else
+        shard->tail = e;
+    shard->head = e;
+}
+
+static void entry_remove(struct cache *cache, struct cache_shard *shard, struct cache_entry *e) {
+    struct cache_entry **pe = &shard->buckets[e->hash & (shard->nbuckets - 1)];
+    while(*pe != e)
+        pe = &(*pe)->hnext;
+    *pe = e->hnext;
+
+    lru_unlink(shard, e);
+    shard->size--;
+    if(cache->free_value)
+        cache->free_value(e->value);
+    free(e);
+}
+
+static struct cache_shard *get_shard(struct cache *cache, uint64_t hash) {
+    return &cache->shards[hash >> 60];
+}
+
+static struct cache_entry *shard_find(struct cache_shard *shard, uint64_t hash, const void *key, size_t keylen) {
+    struct cache_entry *e;
+    for(e = shard->buckets[hash & (shard->nbuckets - 1)]; e != NULL; e = e->hnext) {
+        if(e->hash == hash && e->keylen == keylen && !memcmp(e->key, key, keylen))
+            return e;
+    }
+    return NULL;
+}
+
+int cache_get(struct cache *cache, const void *key, size_t keylen, cache_visit_t visit, void *arg) {
+    uint64_t hash = cache_hash(key, keylen);
+    struct cache_shard *shard = get_shard(cache, hash);
+    struct cache_entry *e;
+    int found = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    e = shard_find(shard, hash, key, keylen);
+    if(e != NULL) {
+        if(visit == NULL || visit(e->value, arg) == 0) {
+            lru_unlink(shard, e);
+            lru_push(shard, e);
+            found = 1;
+        } else {
+            entry_remove(cache, shard, e);
+        }
+    }
+    if(found)
+        shard->hits++;
+    else
+        shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+void cache_put(struct cache *cache, const void *key, size_t keylen, void *value) {
+    uint64_t hash = cache_hash(key, keylen);
+    struct cache_shard *shard = get_shard(cache, hash);
+    struct cache_entry *e = malloc(sizeof(struct cache_entry) + keylen);
+
+    if(e == NULL) {
+        if(cache->free_value)
+            cache->free_value(value);
+        return;
+    }
+    e->hash = hash;
+    e->value = value;
+    e->keylen = keylen;
+    memcpy(e->key, key, keylen);
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry *old = shard_find(shard, hash, key, keylen);
+    if(old != NULL)
+        entry_remove(cache, shard, old);
+    else if(shard->size == shard->capacity)
+        entry_remove(cache, shard, shard->tail);
+
+    struct cache_entry **bucket = &shard->buckets[hash & (shard->nbuckets - 1)];
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push(shard, e);
+    shard->size++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_flush(struct cache *cache) {
+    for(int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while(shard->head)
+            entry_remove(cache, shard, shard->head);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cache_free(struct cache *cache) {
+    if(cache == NULL)
+        return;
+
+    cache_flush(cache);
+    for(int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&cache->shards[i].lock);
+        free(cache->shards[i].buckets);
+    }
+    free(cache);
+}
+
+void cache_stats(struct cache *cache, unsigned long *hits, unsigned long *misses) {
+    *hits = *misses = 0;
+    if(cache == NULL)
+        return;
+
+    for(int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        *hits += shard->hits;
+        *misses += shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,23 @@
+#include <stddef.h>
+
+/*
+ * Bounded, thread-safe key -> value cache.
+ *
+ * Entries are spread over several independently locked shards, each one
+ * evicting its least recently used entry when full.
+ */
+struct cache;
+
+/* Called with the shard locked. Return 0 to accept the entry, anything
+ * else to drop it (the lookup is then counted as a miss). */
+typedef int (*cache_visit_t)(void *value, void *arg);
+
+struct cache *cache_new(size_t capacity, void (*free_value)(void *value));
+void cache_free(struct cache *cache);
+
+/* Return 1 and call visit (if not NULL) on the value if key is found, 0 otherwise */
+int cache_get(struct cache *cache, const void *key, size_t keylen, cache_visit_t visit, void *arg);
+/* Insert or replace key. The cache takes ownership of value. */
+void cache_put(struct cache *cache, const void *key, size_t keylen, void *value);
+void cache_flush(struct cache *cache);
+void cache_stats(struct cache *cache, unsigned long *hits, unsigned long *misses);
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "cache.h"
+#include "dircache.h"
+
+/* Shared by the cache and the callers using it, closed by the last one */
+struct dir_handle {
+    int fd;
+    int refs;
+};
+
+static int root_fd = -1;
+static struct cache *dirs;
+/* Incremented before every flush */
+static unsigned long generation;
+
+static int sys_openat2(int dirfd, const char *path, struct open_how *how) {
+    return syscall(SYS_openat2, dirfd, path, how, sizeof(struct open_how));
+}
+
+/* Open path as a directory, beneath root and without following symlinks */
+static int open_dir(const char *path) {
+    struct open_how how;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+    return sys_openat2(root_fd, path, &how);
+}
+
+/* Keeps errno, callers release their handle right after their system call */
+static void put_handle(struct dir_handle *handle) {
+    int saved_errno = errno;
+
+    if(__atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(handle->fd);
+        free(handle);
+    }
+    errno = saved_errno;
+}
+
+static void free_handle(void *value) {
+    put_handle(value);
+}
+
+static int take_handle(void *value, void *arg) {
+    struct dir_handle *handle = value;
+
+    __atomic_add_fetch(&handle->refs, 1, __ATOMIC_RELAXED);
+    *(struct dir_handle **)arg = handle;
+    return 0;
+}
+
+int dircache_start(int root, int size) {
+    struct rlimit limit;
+    int fd;
+
+    root_fd = root;
+    if(size <= 0)
+        return 0;
+
+    fd = open_dir(".");
+    if(fd == -1)
+        return -1;
+    close(fd);
+
+    /* Leave most file descriptors to the open files */
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+       (rlim_t)size > limit.rlim_cur / 4) {
+        size = limit.rlim_cur / 4;
+        fprintf(stderr, "Warning: dir_cache limited to %d by the open file limit\n", size);
+    }
+    dirs = cache_new(size, free_handle);
+    return 0;
+}
+
+void dircache_stop() {
+    if(dirs)
+        cache_free(dirs);
+    dirs = NULL;
+}
+
+void dircache_get(const char *rpath, struct dir_ref *ref) {
+    struct dir_handle *handle = NULL;
+    char parent[PATH_MAX];
+    const char *slash;
+    unsigned long gen;
+    size_t len;
+    int fd;
+
+    ref->fd = root_fd;
+    ref->name = rpath;
+    ref->handle = NULL;
+
+    if(dirs == NULL || (slash = strrchr(rpath, '/')) == NULL)
+        return;
+    /* The last component must be a name in the parent directory */
+    if(!strcmp(slash + 1, "") || !strcmp(slash + 1, ".") || !strcmp(slash + 1, ".."))
+        return;
+    len = slash - rpath;
+    if(len == 0 || len >= sizeof(parent))
+        return;
+
+    if(!cache_get(dirs, rpath, len, take_handle, &handle)) {
+        gen = __atomic_load_n(&generation, __ATOMIC_SEQ_CST);
+        memcpy(parent, rpath, len);
+        parent[len] = '\0';
+        fd = open_dir(parent);
+        if(fd == -1)
+            return;
+        handle = malloc(sizeof(struct dir_handle));
+        if(handle == NULL) {
+            close(fd);
+            return;
+        }
+        handle->fd = fd;
+        handle->refs = 2;
+        cache_put(dirs, rpath, len, handle);
+        /* A directory may have been renamed after parent was opened, and the
+         * cache flushed before it was added */
+        if(__atomic_load_n(&generation, __ATOMIC_SEQ_CST) != gen)
+            cache_flush(dirs);
+    }
+
+    ref->fd = handle->fd;
+    ref->name = slash + 1;
+    ref->handle = handle;
+}
+
+void dircache_release(struct dir_ref *ref) {
+    if(ref->handle)
+        put_handle(ref->handle);
+    ref->handle = NULL;
+}
+
+static void flush() {
+    __atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+    cache_flush(dirs);
+}
+
+void dircache_forget() {
+    if(dirs)
+        flush();
+}
+
+void dircache_renamed(struct dir_ref *ref) {
+    struct stat st;
+
+    /* The directories under a renamed one are no longer at their path */
+    if(dirs && fstatat(ref->fd, ref->name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+        flush();
+}
@@ -0,0 +1,38 @@
+/*
+ * Open directories of the source directory.
+ *
+ * Every system call on a rewritten path walks all of its components from the
+ * source directory. The parent directories of recently used paths are kept
+ * open (O_PATH), so that only the last component has to be resolved. Only
+ * directories reached beneath the source directory without following any
+ * symlink are kept: a symlink can be replaced without renaming a directory.
+ *
+ * Directories renamed or removed through rewritefs are dropped. Those renamed
+ * or removed directly in the source directory keep being used until they are
+ * evicted.
+ */
+
+struct dir_handle;
+
+/* Directory to resolve name from, fd being the source directory when handle
+ * is NULL */
+struct dir_ref {
+    int fd;
+    const char *name;
+    struct dir_handle *handle;
+};
+
+/* Keep up to size directories open under root (none if size is 0). Return
+ * -1 and set errno if the kernel can't resolve paths beneath a directory. */
+int dircache_start(int root, int size);
+void dircache_stop();
+
+/* Parent directory of rpath, a path relative to root, and its last component
+ * (pointing into rpath). Without cached directory, the source directory and
+ * rpath itself. Valid until dircache_release(). */
+void dircache_get(const char *rpath, struct dir_ref *ref);
+void dircache_release(struct dir_ref *ref);
+/* A directory was removed */
+void dircache_forget();
+/* Something was renamed to ref */
+void dircache_renamed(struct dir_ref *ref);
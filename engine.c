@@ -0,0 +1,2258 @@
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <pthread.h>
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include "librewritefs.h"
+#include "user.h"
+#include "cache.h"
+#include "index.h"
+#include "stats.h"
+#include "epoch.h"
+#include "trace.h"
+
+#define DEBUG(lvl, x...) if(verbose >= lvl) fprintf(stderr, x)
+
+/* Cache keys up to this size are built on the stack */
+#define KEY_BUF_SIZE 512
+/* Context selections up to this size too, for 512 cmdline contexts */
+#define SELECTION_BUF_SIZE 64
+
+/* Rule programs kept by ruleset, callers selecting more combinations of
+ * contexts walk them */
+#define MAX_PROGRAMS 64
+
+/*
+ * Type definiton 
+ */
+/* How the pattern of a rule is matched */
+enum match_kind {
+    MATCH_REGEXP,
+    MATCH_EXACT, /* the whole path */
+    MATCH_PREFIX, /* the path or a path under it */
+    MATCH_GLOB, /* fnmatch() on as many components as the pattern has */
+    MATCH_KINDS
+};
+
+struct regexp {
+    enum match_kind kind;
+    pcre2_code *regexp; /* NULL for the other kinds, matched on raw */
+    pcre2_code *jit; /* JIT-compiled copy, on first use */
+    int jit_state;
+    uint32_t flags;
+    uint32_t captures;
+    int replace_all;
+    char *raw;
+    /* Profile of rule and context selection, only with the stats option */
+    unsigned long evals;
+    unsigned long matches;
+    unsigned long match_ns;
+};
+
+struct replacement_part {
+    int group;
+    char *data;
+    int len;
+};
+
+struct replacement_template {
+    int nparts;
+    int max_group; /* highest group used, -1 if none */
+    char *raw;
+    struct replacement_part *parts;
+};
+
+struct rewrite_rule {
+    struct regexp *filename_regexp;
+    struct replacement_template *rewritten_path; /* NULL for "." */
+    struct rewrite_rule *next;
+};
+
+struct rewrite_context {
+    struct regexp *cmdline; /* NULL for all contexts */
+    int id; /* bit in the context selection, only for cmdline contexts */
+    struct rewrite_rule *rules;
+    /* Rules by position, for the dispatch index */
+    struct rewrite_rule **rule_array;
+    int nrules;
+    struct rule_index *index;
+    struct rewrite_context *next;
+};
+
+/* Rules of the contexts a caller selects, flattened in the order of the
+ * configuration file, with a single index */
+struct rule_program {
+    struct rewrite_rule **rule_array;
+    int nrules;
+    struct rule_index *index;
+    int shared; /* rule_array and index belong to the only selected context */
+    unsigned char selection[];
+};
+
+/* Everything built from the configuration file, replaced as a whole when it
+ * is reloaded */
+struct ruleset {
+    struct rewrite_context *contexts;
+    int ncmdline;
+    /* By context selection, the first one without cmdline context */
+    struct rule_program *programs[MAX_PROGRAMS];
+    int nprograms;
+    pthread_mutex_t programs_lock;
+    struct cache *cache;
+    struct cache *callers;
+    const char *source; /* "config" or "compiled" */
+    long load_ns;
+    long compile_ns;
+};
+
+struct rewrite_engine {
+    char *config_file;
+    char *compiled_config;
+    int cache_size;
+    int cmdline_cache_size;
+    struct ruleset *rules; /* read in an epoch, see current_rules() */
+};
+
+enum type {
+    CMDLINE,
+    RULE,
+    END
+};
+
+/* Per-thread matching state, reused across requests */
+struct match_state {
+    pcre2_match_data *match_data;
+    uint32_t ovector_size;
+    pcre2_match_context *match_context;
+    pcre2_jit_stack *jit_stack;
+    struct candidates candidates;
+    size_t match_end; /* of the last match without regexp */
+    PCRE2_SIZE *spans; /* group offsets of every match, for regexp_replace() */
+    size_t spans_cap;
+};
+
+/*
+ * Global variables
+ */
+/* Shared by every engine */
+static int verbose;
+static uint32_t max_captures; /* of every ruleset loaded so far */
+static pthread_once_t match_state_once = PTHREAD_ONCE_INIT;
+static pthread_key_t match_state_key;
+static __thread struct match_state *match_state;
+
+/* Of the load in progress in the current thread */
+static __thread jmp_buf *parse_abort;
+static __thread long compile_ns; /* spent compiling regexps */
+
+static void free_caller(void *data);
+static void free_contexts(struct rewrite_context *contexts);
+
+/*
+ * Per-thread regexp matching
+ */
+static void free_match_state(void *data) {
+    struct match_state *state = data;
+    pcre2_match_data_free(state->match_data);
+    pcre2_match_context_free(state->match_context);
+    pcre2_jit_stack_free(state->jit_stack);
+    candidates_free(&state->candidates);
+    free(state->spans);
+    free(state);
+}
+
+/* Get the match data of the current thread, large enough for any regexp of
+ * the rules in use. It may be recreated when a reload raises max_captures, so
+ * it is got once before a lookup and passed down, never between a match and
+ * the use of its ovector. */
+static struct match_state *get_match_state() {
+    struct match_state *state = match_state;
+
+    uint32_t captures = __atomic_load_n(&max_captures, __ATOMIC_RELAXED);
+
+    if(state != NULL && state->ovector_size > captures)
+        return state;
+
+    if(state == NULL) {
+        state = calloc(1, sizeof(struct match_state));
+        if(state == NULL)
+            return NULL;
+        state->match_context = pcre2_match_context_create(NULL);
+        state->jit_stack = pcre2_jit_stack_create(32 * 1024, 512 * 1024, NULL);
+        if(state->match_context == NULL || state->jit_stack == NULL) {
+            free_match_state(state);
+            return NULL;
+        }
+        pcre2_jit_stack_assign(state->match_context, NULL, state->jit_stack);
+        match_state = state;
+        pthread_setspecific(match_state_key, state);
+    }
+
+    pcre2_match_data_free(state->match_data);
+    state->ovector_size = captures + 1;
+    state->match_data = pcre2_match_data_create(state->ovector_size, NULL);
+    if(state->match_data == NULL) {
+        state->ovector_size = 0;
+        return NULL;
+    }
+
+    return state;
+}
+
+/* Regexps are JIT-compiled the first time they are used, so that large
+ * configurations load quickly. The compilation is done on a copy, since
+ * other threads may be matching the original. */
+static pcre2_code *match_code(struct regexp *re) {
+    pcre2_code *code = __atomic_load_n(&re->jit, __ATOMIC_ACQUIRE);
+    PCRE2_UCHAR error_msg[256];
+    int expected = 0, error;
+
+    if(code != NULL)
+        return code;
+    if(!__atomic_compare_exchange_n(&re->jit_state, &expected, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return re->regexp;
+
+    code = pcre2_code_copy(re->regexp);
+    if(code == NULL)
+        return re->regexp;
+    /* Not fatal: without JIT support, pcre2_match() falls back to the interpreter */
+    error = pcre2_jit_compile(code, PCRE2_JIT_COMPLETE);
+    if(error < 0) {
+        pcre2_get_error_message(error, error_msg, sizeof(error_msg));
+        DEBUG(1, "Can't JIT-compile regular expression \"%s\": %s\n", re->raw, error_msg);
+        pcre2_code_free(code);
+        return re->regexp;
+    }
+    __atomic_store_n(&re->jit, code, __ATOMIC_RELEASE);
+    return code;
+}
+
+/* pcre2_match() with the per-thread match data */
+static int regexp_match(struct regexp *re, const char *subject, size_t len, struct match_state *state) {
+    return pcre2_match(match_code(re), (PCRE2_SPTR)subject, len, 0, 0,
+                       state->match_data, state->match_context);
+}
+
+/* fnmatch() of pattern on the leading components of subject, as many as the
+ * pattern has since wildcards don't match '/'. The length of the matched part
+ * is stored in end. */
+static int glob_match(const char *pattern, const char *subject, size_t len, size_t *end) {
+    const char *p = subject, *slash;
+    char component[PATH_MAX];
+
+    for(const char *q = pattern; (q = strchr(q, '/')) != NULL; q++) {
+        if((p = memchr(p, '/', subject + len - p)) == NULL)
+            return 0;
+        p++;
+    }
+    slash = memchr(p, '/', subject + len - p);
+    *end = slash ? (size_t)(slash - subject) : len;
+
+    if(*end == len)
+        return !fnmatch(pattern, subject, FNM_PATHNAME);
+    if(*end >= sizeof(component))
+        return 0;
+    memcpy(component, subject, *end);
+    component[*end] = '\0';
+    return !fnmatch(pattern, component, FNM_PATHNAME);
+}
+
+/* Match of a rule without regexp, like regexp_match(). The matched part of
+ * subject is always at its start, its length is kept in the state. */
+static int literal_match(struct regexp *re, const char *subject, size_t len, struct match_state *state) {
+    size_t raw_len = strlen(re->raw), end = raw_len;
+    int res;
+
+    switch(re->kind) {
+    case MATCH_EXACT:
+        res = len == raw_len && !memcmp(subject, re->raw, len);
+        break;
+    case MATCH_PREFIX:
+        res = len >= raw_len && !memcmp(subject, re->raw, raw_len) &&
+              (subject[raw_len] == '/' || subject[raw_len] == '\0');
+        break;
+    default:
+        res = glob_match(re->raw, subject, len, &end);
+        break;
+    }
+
+    state->match_end = end;
+    return res ? 1 : PCRE2_ERROR_NOMATCH;
+}
+
+static int pattern_match(struct regexp *re, const char *subject, size_t len, struct match_state *state) {
+    if(re->kind == MATCH_REGEXP)
+        return regexp_match(re, subject, len, state);
+    return literal_match(re, subject, len, state);
+}
+
+/* Match when selecting a context or a rule, profiled */
+static int selection_match(struct regexp *re, const char *subject, size_t len, struct match_state *state) {
+    long start;
+    int res;
+
+    if(!stats_enabled())
+        return pattern_match(re, subject, len, state);
+
+    start = stats_now();
+    res = pattern_match(re, subject, len, state);
+    __atomic_fetch_add(&re->match_ns, stats_now() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&re->evals, 1, __ATOMIC_RELAXED);
+    if(res >= 0)
+        __atomic_fetch_add(&re->matches, 1, __ATOMIC_RELAXED);
+
+    return res;
+}
+
+/*
+ * Config-file parsing
+ */
+
+/* Give up on a syntax error: the load fails, and the engine keeps its current
+ * rules. What was parsed so far is leaked. */
+static void parse_fail() {
+    longjmp(*parse_abort, 1);
+}
+
+static void *abmalloc(size_t sz) {
+    void *res = malloc(sz);
+    if(res == NULL) {
+        perror("malloc");
+        abort();
+    }
+    return res;
+}
+
+static char *abstrdup(const char *s) {
+    char *res = strdup(s);
+    if(res == NULL) {
+        perror("strdup");
+        abort();
+    }
+    return res;
+}
+
+/* Consume all blanks (according to isspace) */
+static void parse_blanks(FILE *fd) {
+    int c;
+    do {
+        c = getc_unlocked(fd);
+    } while(isspace(c) && c != EOF);
+    ungetc(c, fd);
+}
+
+/* Consume all characters until reaching EOL */
+static void parse_comment(FILE *fd) {
+    int c;
+    do {
+        c = getc_unlocked(fd);
+    } while(c != '\n' && c != EOF);
+}
+
+static char *string_new(int *string_cap, int *string_size) {
+    *string_cap = 255;
+    *string_size = 0;
+    char *s = abmalloc(*string_cap);
+    s[0] = '\0';
+    return s;
+}
+
+/* append c to string, extending it if necessary */
+static void string_append(char **string, char c, int *string_cap, int *string_size) {
+    if(*string_cap == *string_size + 1) {
+        *string_cap *= 2;
+        *string = realloc(*string, *string_cap);
+        if(*string == NULL) {
+            perror("realloc");
+            abort();
+        }
+    }
+    
+    (*string)[(*string_size)++] = c;
+    (*string)[*string_size] = 0;
+}
+
+/* Consume the string until reaching sep */
+static void parse_string(FILE *fd, char **string, char sep) {
+    int string_cap, string_size;
+    int escaped = 0;
+    int c;
+    
+    *string = string_new(&string_cap, &string_size);
+    for(;;) {
+        c = getc_unlocked(fd);
+        if(c == EOF) {
+            fprintf(stderr, "Unexpected EOF\n");
+            parse_fail();
+        }
+
+        if(escaped) {
+            /* \\ -> \
+             * \(sep) -> (sep)
+             * \(other) -> \(other)
+             */
+            escaped = 0;
+            if(c != '\\' && c != (int)sep) {
+                string_append(string, '\\', &string_cap, &string_size);
+            }
+            string_append(string, c, &string_cap, &string_size);
+        } else {
+            if(c == '\\') {
+                escaped = 1;
+            } else if(c == (int)sep) {
+                break;
+            } else {
+                string_append(string, c, &string_cap, &string_size);
+            }
+        }
+    }
+}
+
+/* Consume the regexp (until reaching end-of-flags) and put it in regexp */
+static void parse_regexp(FILE *fd, struct regexp **regexp, char sep) {
+    char *regexp_body;
+    uint32_t regexp_flags = 0;
+    int replace_all = 0;
+    int error;
+    PCRE2_SIZE offset;
+    PCRE2_UCHAR error_msg[256];
+    long start;
+    int c;
+    
+    /* Determine separator */
+    if(sep == 0) {
+        sep = getc_unlocked(fd);
+        if(sep == 'm') {
+            sep = getc_unlocked(fd);
+        } else if(sep != '/') {
+            fprintf(stderr, "Unexpected character \"%c\"\n", (char)sep);
+            parse_fail();
+        }
+    }
+    
+    if(sep == EOF) {
+        fprintf(stderr, "Unexpected EOF\n");
+        parse_fail();
+    }
+    
+    /* Get body */
+    parse_string(fd, &regexp_body, sep);
+    
+    /* Get flags */
+    while(!isspace(c = getc_unlocked(fd))) {
+        switch(c) {
+        case 'i':
+            regexp_flags |= PCRE2_CASELESS;
+            break;
+        case 'x':
+            regexp_flags |= PCRE2_EXTENDED;
+            break;
+        case 'u':
+            regexp_flags |= PCRE2_UCP | PCRE2_UTF;
+            break;
+        case 'g':
+            replace_all = 1;
+            break;
+        case EOF:
+            fprintf(stderr, "Unexpected EOF\n");
+            parse_fail();
+        default:
+            fprintf(stderr, "Unknown flag %c\n", (char)c);
+            parse_fail();
+        }
+    }
+    
+    /* Compilation */
+    *regexp = abmalloc(sizeof(struct regexp));
+
+    (*regexp)->kind = MATCH_REGEXP;
+    (*regexp)->replace_all = replace_all;
+    (*regexp)->flags = regexp_flags;
+    (*regexp)->evals = (*regexp)->matches = (*regexp)->match_ns = 0;
+    (*regexp)->jit = NULL;
+    (*regexp)->jit_state = 0;
+    
+    start = stats_now();
+    (*regexp)->regexp = pcre2_compile((PCRE2_SPTR)regexp_body, PCRE2_ZERO_TERMINATED, regexp_flags, &error, &offset, NULL);
+    compile_ns += stats_now() - start;
+    if((*regexp)->regexp == NULL) {
+        pcre2_get_error_message(error, error_msg, sizeof(error_msg));
+        fprintf(stderr, "Invalid regular expression: %s\n. Regular expression was :\n  %s\n", error_msg, regexp_body);
+        parse_fail();
+    }
+    
+    pcre2_pattern_info((*regexp)->regexp, PCRE2_INFO_CAPTURECOUNT, &(*regexp)->captures);
+    (*regexp)->raw = regexp_body;
+}
+
+/* Consume a pattern matched without regexp, delimited by any character */
+static void parse_pattern(FILE *fd, struct regexp **regexp, enum match_kind kind) {
+    char *body;
+    size_t len;
+    int sep, c;
+
+    sep = getc_unlocked(fd);
+    if(sep == EOF) {
+        fprintf(stderr, "Unexpected EOF\n");
+        parse_fail();
+    }
+    parse_string(fd, &body, sep);
+
+    c = getc_unlocked(fd);
+    if(c == EOF) {
+        fprintf(stderr, "Unexpected EOF\n");
+        parse_fail();
+    } else if(!isspace(c)) {
+        fprintf(stderr, "Unknown flag %c\n", (char)c);
+        parse_fail();
+    }
+
+    /* Paths never end with '/' */
+    len = strlen(body);
+    while(kind != MATCH_GLOB && len > 0 && body[len - 1] == '/')
+        body[--len] = '\0';
+    if(len == 0) {
+        fprintf(stderr, "Empty pattern\n");
+        parse_fail();
+    }
+
+    *regexp = abmalloc(sizeof(struct regexp));
+    memset(*regexp, 0, sizeof(struct regexp));
+    (*regexp)->kind = kind;
+    (*regexp)->raw = body;
+}
+
+/* Get a CMDLINE or RULE definition */
+static void parse_item(FILE *fd, enum type *type, struct regexp **regexp, char **string) {
+    int c;
+    
+    parse_blanks(fd);
+    switch(c = getc_unlocked(fd)) {
+    case 'e':
+    case 'p':
+    case 'g':
+        *type = RULE;
+        parse_pattern(fd, regexp, c == 'e' ? MATCH_EXACT : c == 'p' ? MATCH_PREFIX : MATCH_GLOB);
+        parse_blanks(fd);
+        parse_string(fd, string, '\n');
+        return;
+    case '-':
+        *type = CMDLINE;
+        parse_blanks(fd);
+        parse_regexp(fd, regexp, 0);
+        return;
+    case 'm':
+        c = getc_unlocked(fd);
+        /* continue */
+    case '/':
+        *type = RULE;
+        parse_regexp(fd, regexp, (char)c);
+        parse_blanks(fd);
+        parse_string(fd, string, '\n');
+        return;
+    case '#':
+        parse_comment(fd);
+        parse_item(fd, type, regexp, string);
+        return;
+    case EOF:
+        *type = END;
+        return;
+    default:
+        fprintf(stderr, "Unexpected character \"%c\"\n", (char)c);
+        parse_fail();
+    }
+}
+
+static struct replacement_part *alloc_part(struct replacement_part **parts, int *nparts) {
+    *parts = reallocarray(*parts, ++(*nparts), sizeof(struct replacement_part));
+    if(*parts == NULL) {
+        perror("reallocarray");
+        abort();
+    }
+    return (*parts) + (*nparts - 1);
+}
+
+/* Number of the group named by the len characters of ref, a number or the
+ * name of a group of re */
+static int parse_group(const char *ref, size_t len, struct regexp *re, const char *tpl) {
+    char name[256];
+    int group = -1;
+
+    if(len > 0 && len < sizeof(name)) {
+        memcpy(name, ref, len);
+        name[len] = '\0';
+        if(strspn(name, "0123456789") == len)
+            group = len < 6 ? atoi(name) : -1;
+        else if(re->regexp)
+            group = pcre2_substring_number_from_name(re->regexp, (PCRE2_SPTR)name);
+    }
+    if(group < 0 || group > (int)re->captures) {
+        fprintf(stderr, "Unknown group \"%.*s\" in \"%s\"\n", (int)len, ref, tpl);
+        parse_fail();
+    }
+    return group;
+}
+
+/* Literal parts and groups of tpl, \0 to \9 or \g{N} and \g{NAME} */
+static struct replacement_template *parse_replacement_template(char *tpl, struct regexp *re) {
+    int buf_cap, buf_size;
+    char *buf = string_new(&buf_cap, &buf_size);
+
+    int nparts = 0, max_group = -1;
+    struct replacement_part *parts = NULL;
+    struct replacement_part *cur_part;
+    const char *end;
+    int group;
+
+    int escaped = 0;
+    for(int i = 0; tpl[i] != '\0'; i++) {
+        if(escaped) {
+            group = -1;
+            if(tpl[i] >= '0' && tpl[i] <= '9') {
+                group = parse_group(tpl + i, 1, re, tpl);
+            } else if(tpl[i] == 'g' && tpl[i + 1] == '{') {
+                if((end = strchr(tpl + i + 2, '}')) == NULL) {
+                    fprintf(stderr, "Unterminated group in \"%s\"\n", tpl);
+                    parse_fail();
+                }
+                group = parse_group(tpl + i + 2, end - (tpl + i + 2), re, tpl);
+                i = end - tpl;
+            } else {
+                string_append(&buf, tpl[i], &buf_cap, &buf_size);
+            }
+
+            if(group != -1) {
+                if(buf_size > 0) {
+                    cur_part = alloc_part(&parts, &nparts);
+                    cur_part->data = buf;
+                    cur_part->len = buf_size;
+                    buf = string_new(&buf_cap, &buf_size);
+                }
+
+                cur_part = alloc_part(&parts, &nparts);
+                cur_part->data = NULL;
+                cur_part->group = group;
+                if(group > max_group)
+                    max_group = group;
+            }
+            escaped = 0;
+        } else {
+            if(tpl[i] == '\\') {
+                escaped = 1;
+            } else {
+                string_append(&buf, tpl[i], &buf_cap, &buf_size);
+            }
+        }
+    }
+
+    if(nparts == 0 || buf_size > 0) {
+        cur_part = alloc_part(&parts, &nparts);
+        cur_part->data = buf;
+        cur_part->len = buf_size;
+    } else {
+        free(buf);
+    }
+
+    struct replacement_template *res = abmalloc(sizeof(struct replacement_template));
+    res->parts = parts;
+    res->nparts = nparts;
+    res->max_group = max_group;
+    res->raw = tpl;
+
+    return res;
+}
+
+/*
+ * Dispatch index
+ */
+#define MAX_PREFIXES 16
+#define MAX_PREFIX_LEN 256
+
+struct prefixes {
+    char str[MAX_PREFIXES][MAX_PREFIX_LEN];
+    int len[MAX_PREFIXES];
+    int n;
+};
+
+/* If p starts with a literal character, store it in c and return its length in the pattern */
+static int literal_char(const char *p, char *c) {
+    if(p[0] == '\\') {
+        /* Escaped non-alphanumeric characters are always literal */
+        if(p[1] != '\0' && !isalnum((unsigned char)p[1]) && !((unsigned char)p[1] & 0x80)) {
+            *c = p[1];
+            return 2;
+        }
+        return 0;
+    }
+    /* Multi-byte UTF-8 characters could be quantified as a whole */
+    if(p[0] == '\0' || ((unsigned char)p[0] & 0x80) || strchr(".[]()|*+?{}^$", p[0]))
+        return 0;
+    *c = p[0];
+    return 1;
+}
+
+static int is_quantifier(char c) {
+    return c == '*' || c == '?' || c == '{';
+}
+
+/* Return 1 if re has an alternation outside of any group, or can't be analyzed */
+static int has_toplevel_alternation(const char *re) {
+    int depth = 0;
+
+    for(const char *p = re; *p; p++) {
+        if(p[0] == '\\') {
+            if(p[1] == 'Q' || p[1] == '\0')
+                return 1;
+            p++;
+        } else if(p[0] == '[') {
+            /* Skip the character class, where | and parentheses are literal */
+            p++;
+            if(*p == '^')
+                p++;
+            if(*p == ']')
+                p++;
+            while(*p != ']') {
+                if(*p == '\0') {
+                    return 1;
+                } else if(p[0] == '\\' && p[1] != '\0') {
+                    p += 2;
+                } else if(p[0] == '[' && p[1] == ':') {
+                    const char *end = strstr(p + 2, ":]");
+                    if(end == NULL)
+                        return 1;
+                    p = end + 2;
+                } else {
+                    p++;
+                }
+            }
+        } else if(p[0] == '(') {
+            if(p[1] == '?' && p[2] == '#')
+                return 1;
+            depth++;
+        } else if(p[0] == ')') {
+            depth--;
+        } else if(p[0] == '|' && depth == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int append_prefix(struct prefixes *prefixes, const char *s, int len) {
+    for(int i = 0; i < prefixes->n; i++) {
+        if(prefixes->len[i] + len >= MAX_PREFIX_LEN)
+            return -1;
+    }
+    for(int i = 0; i < prefixes->n; i++) {
+        memcpy(prefixes->str[i] + prefixes->len[i], s, len);
+        prefixes->len[i] += len;
+    }
+    return 0;
+}
+
+/* Parse a group of literal alternatives starting at p, and multiply
+ * prefixes by them. Return the length of the group in the pattern, 0 if it
+ * can't be used. */
+static int expand_group(struct prefixes *prefixes, const char *p) {
+    struct prefixes res;
+    char alts[MAX_PREFIXES][MAX_PREFIX_LEN];
+    int alts_len[MAX_PREFIXES];
+    int nalts = 1, i = 1, l;
+    char c;
+
+    if(p[1] == '?' && (p[2] == ':' || p[2] == '='))
+        i = 3;
+    else if(p[1] == '?' || p[1] == '*')
+        return 0;
+
+    alts_len[0] = 0;
+    for(;;) {
+        if(p[i] == ')') {
+            i++;
+            break;
+        } else if(p[i] == '|') {
+            if(nalts == MAX_PREFIXES)
+                return 0;
+            alts_len[nalts++] = 0;
+            i++;
+        } else if((l = literal_char(p + i, &c)) > 0 && !is_quantifier(p[i + l]) && p[i + l] != '+') {
+            if(alts_len[nalts - 1] == MAX_PREFIX_LEN - 1)
+                return 0;
+            alts[nalts - 1][alts_len[nalts - 1]++] = c;
+            i += l;
+        } else {
+            return 0;
+        }
+    }
+
+    if(is_quantifier(p[i]) || prefixes->n * nalts > MAX_PREFIXES)
+        return 0;
+
+    res.n = 0;
+    for(int j = 0; j < prefixes->n; j++) {
+        for(int k = 0; k < nalts; k++) {
+            if(prefixes->len[j] + alts_len[k] >= MAX_PREFIX_LEN)
+                return 0;
+            memcpy(res.str[res.n], prefixes->str[j], prefixes->len[j]);
+            memcpy(res.str[res.n] + prefixes->len[j], alts[k], alts_len[k]);
+            res.len[res.n++] = prefixes->len[j] + alts_len[k];
+        }
+    }
+    *prefixes = res;
+
+    return i;
+}
+
+/* Find the literal prefixes one of which any subject matching re starts with.
+ * prefixes->n is 0 if there is none. */
+static void literal_prefixes(struct regexp *re, struct prefixes *prefixes) {
+    const char *p = re->raw;
+    uint32_t options;
+    int l;
+    char c;
+
+    prefixes->n = 0;
+
+    if(re->kind == MATCH_PREFIX || re->kind == MATCH_GLOB) {
+        /* Up to the first wildcard of a glob */
+        l = re->kind == MATCH_PREFIX ? strlen(p) : strcspn(p, "*?[\\");
+        if(l >= MAX_PREFIX_LEN)
+            l = MAX_PREFIX_LEN - 1;
+        if(l > 0) {
+            memcpy(prefixes->str[0], p, l);
+            prefixes->len[0] = l;
+            prefixes->n = 1;
+        }
+        return;
+    }
+
+    /* Case-insensitive and extended patterns are not worth the trouble */
+    if(re->flags & (PCRE2_CASELESS | PCRE2_EXTENDED))
+        return;
+    pcre2_pattern_info(re->regexp, PCRE2_INFO_ALLOPTIONS, &options);
+    if(!(options & PCRE2_ANCHORED) || has_toplevel_alternation(p))
+        return;
+
+    if(p[0] == '^')
+        p++;
+    else if(p[0] == '\\' && p[1] == 'A')
+        p += 2;
+    else
+        return;
+
+    prefixes->n = 1;
+    prefixes->len[0] = 0;
+
+    for(;;) {
+        if((l = literal_char(p, &c)) > 0) {
+            if(is_quantifier(p[l]))
+                break;
+            if(append_prefix(prefixes, &c, 1) == -1)
+                break;
+            if(p[l] == '+')
+                break;
+            p += l;
+        } else if(p[0] == '(') {
+            int lookahead = (p[1] == '?' && p[2] == '=');
+            if((l = expand_group(prefixes, p)) == 0)
+                break;
+            /* Nothing can be appended after a lookahead, which doesn't
+             * consume anything, or after a repeated group */
+            if(lookahead || p[l] == '+')
+                break;
+            p += l;
+        } else {
+            break;
+        }
+    }
+
+    for(int i = 0; i < prefixes->n; i++) {
+        if(prefixes->len[i] == 0) {
+            prefixes->n = 0;
+            return;
+        }
+    }
+}
+
+static void build_index(struct rewrite_context *ctx) {
+    struct rewrite_rule *rule;
+    struct prefixes prefixes;
+    int i;
+
+    ctx->nrules = 0;
+    for(rule = ctx->rules; rule != NULL; rule = rule->next)
+        ctx->nrules++;
+    ctx->rule_array = abmalloc((ctx->nrules + 1) * sizeof(struct rewrite_rule *));
+    ctx->index = rule_index_new();
+
+    for(rule = ctx->rules, i = 0; rule != NULL; rule = rule->next, i++) {
+        ctx->rule_array[i] = rule;
+        if(rule->filename_regexp->kind == MATCH_EXACT) {
+            rule_index_add_exact(ctx->index, i, rule->filename_regexp->raw, strlen(rule->filename_regexp->raw));
+            continue;
+        }
+        literal_prefixes(rule->filename_regexp, &prefixes);
+        if(prefixes.n == 0) {
+            rule_index_add_any(ctx->index, i);
+            DEBUG(2, "  index: \"%s\" -> any\n", rule->filename_regexp->raw);
+        }
+        for(int j = 0; j < prefixes.n; j++) {
+            rule_index_add(ctx->index, i, prefixes.str[j], prefixes.len[j]);
+            DEBUG(2, "  index: \"%s\" -> \"%.*s\"\n", rule->filename_regexp->raw, prefixes.len[j], prefixes.str[j]);
+        }
+    }
+}
+
+/* Appends contexts and rules to a ruleset, in the order of the file */
+struct builder {
+    struct ruleset *rs;
+    struct rewrite_context *context;
+    struct rewrite_rule *last_rule;
+    uint32_t *max_captures;
+};
+
+static void builder_init(struct builder *b, struct ruleset *rs, uint32_t *max_captures) {
+    b->rs = rs;
+    b->context = abmalloc(sizeof(struct rewrite_context));
+    memset(b->context, 0, sizeof(struct rewrite_context));
+    b->context->id = -1;
+    b->last_rule = NULL;
+    b->max_captures = max_captures;
+    rs->contexts = b->context;
+}
+
+/* cmdline is NULL for all processes */
+static void add_context(struct builder *b, struct regexp *cmdline) {
+    struct rewrite_context *ctx = abmalloc(sizeof(struct rewrite_context));
+
+    memset(ctx, 0, sizeof(struct rewrite_context));
+    ctx->cmdline = cmdline;
+    ctx->id = cmdline ? b->rs->ncmdline++ : -1;
+    if(cmdline && cmdline->captures > *b->max_captures)
+        *b->max_captures = cmdline->captures;
+    b->context->next = ctx;
+    b->context = ctx;
+    b->last_rule = NULL;
+}
+
+/* tpl is NULL for "." */
+static void add_rule(struct builder *b, struct regexp *regexp, struct replacement_template *tpl) {
+    struct rewrite_rule *rule = abmalloc(sizeof(struct rewrite_rule));
+
+    rule->filename_regexp = regexp;
+    rule->rewritten_path = tpl;
+    rule->next = NULL;
+    if(regexp->captures > *b->max_captures)
+        *b->max_captures = regexp->captures;
+    if(b->last_rule)
+        b->last_rule->next = rule;
+    else
+        b->context->rules = rule;
+    b->last_rule = rule;
+}
+
+static int context_selected(struct rewrite_context *ctx, const unsigned char *selection) {
+    if(ctx->cmdline == NULL)
+        return 1;
+    return selection != NULL && (selection[ctx->id / 8] & (1 << (ctx->id % 8)));
+}
+
+/* Flatten the rules of the contexts in selection (NULL for none) */
+static struct rule_program *build_program(struct ruleset *rs, const unsigned char *selection) {
+    size_t sel_len = (rs->ncmdline + 7) / 8;
+    struct rule_program *prog = abmalloc(sizeof(struct rule_program) + sel_len);
+    struct rewrite_context *ctx, *only = NULL;
+    int ncontexts = 0;
+
+    memset(prog, 0, sizeof(struct rule_program));
+    if(selection)
+        memcpy(prog->selection, selection, sel_len);
+    else
+        memset(prog->selection, 0, sel_len);
+
+    /* Contexts not selected, or without rules, can't match */
+    for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+        if(context_selected(ctx, selection) && ctx->nrules > 0) {
+            prog->nrules += ctx->nrules;
+            only = ctx;
+            ncontexts++;
+        }
+    }
+
+    if(ncontexts <= 1) {
+        prog->rule_array = only ? only->rule_array : NULL;
+        prog->index = only ? only->index : NULL;
+        prog->shared = 1;
+        return prog;
+    }
+
+    prog->rule_array = abmalloc(prog->nrules * sizeof(struct rewrite_rule *));
+    prog->index = rule_index_new();
+    prog->nrules = 0;
+    for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+        if(context_selected(ctx, selection) && ctx->nrules > 0) {
+            memcpy(prog->rule_array + prog->nrules, ctx->rule_array, ctx->nrules * sizeof(struct rewrite_rule *));
+            rule_index_merge(prog->index, ctx->index, prog->nrules);
+            prog->nrules += ctx->nrules;
+        }
+    }
+    return prog;
+}
+
+static void free_program(struct rule_program *prog) {
+    if(!prog->shared) {
+        rule_index_free(prog->index);
+        free(prog->rule_array);
+    }
+    free(prog);
+}
+
+/* Program for selection, built on first use. NULL when too many
+ * combinations of contexts were seen. */
+static struct rule_program *get_program(struct ruleset *rs, const unsigned char *selection) {
+    size_t sel_len = (rs->ncmdline + 7) / 8;
+    struct rule_program *prog = NULL;
+
+    pthread_mutex_lock(&rs->programs_lock);
+    for(int i = 0; i < rs->nprograms; i++) {
+        if(!memcmp(rs->programs[i]->selection, selection, sel_len)) {
+            prog = rs->programs[i];
+            break;
+        }
+    }
+    if(prog == NULL && rs->nprograms < MAX_PROGRAMS) {
+        prog = build_program(rs, selection);
+        rs->programs[rs->nprograms++] = prog;
+        DEBUG(2, "Program %d: %d rules\n", rs->nprograms - 1, prog->nrules);
+    }
+    pthread_mutex_unlock(&rs->programs_lock);
+    return prog;
+}
+
+static void builder_finish(struct builder *b) {
+    struct rewrite_context *ctx;
+
+    for(ctx = b->rs->contexts; ctx != NULL; ctx = ctx->next)
+        build_index(ctx);
+}
+
+static void parse_config(FILE *fd, struct builder *b) {
+    enum type type;
+    struct regexp *regexp;
+    char *string;
+    
+    do {
+        parse_item(fd, &type, &regexp, &string);
+        if(type == CMDLINE) {
+            add_context(b, !strcmp(regexp->raw, "") ? NULL : regexp);
+        } else if(type == RULE) {
+            add_rule(b, regexp, (!strcmp(string, ".")) ? (free(string), NULL) : parse_replacement_template(string, regexp));
+        }
+    } while(type != END);
+}
+
+/*
+ * Compiled configuration: the rules of a configuration file with their
+ * regexps serialized by PCRE2, so that large configurations don't have to be
+ * parsed and compiled again. It is only valid for the same content of the
+ * configuration file, and for the same machine (native byte order, same
+ * PCRE2 build), which is checked on loading.
+ */
+#define COMPILED_MAGIC "RWFSCFG2"
+
+struct compiled_header {
+    char magic[8];
+    uint64_t config_hash;
+    uint64_t config_size;
+    uint64_t codes_size;
+    uint32_t ncodes;
+    uint32_t nitems;
+};
+
+/* Followed by the raw regexp, then for rules with a template its raw text
+ * and its parts */
+struct compiled_item {
+    uint8_t type; /* CMDLINE or RULE */
+    uint8_t has_code; /* 0 for "- //" and non-regexp rules, the codes are in the order of the items */
+    uint8_t has_template;
+    uint8_t replace_all;
+    uint8_t kind; /* of the rule, only regexps have a code */
+    uint32_t flags;
+    uint32_t raw_len;
+    uint32_t tpl_len;
+    uint32_t nparts;
+};
+
+/* Followed by len bytes of data if group is -1 */
+struct compiled_part {
+    int32_t group;
+    uint32_t len;
+};
+
+static uint64_t hash_config(const char *buf, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for(size_t i = 0; i < size; i++)
+        h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+    return h;
+}
+
+struct cursor {
+    const char *p, *end;
+};
+
+/* Next n bytes of the compiled configuration, NULL if truncated */
+static const void *take(struct cursor *cur, size_t n) {
+    const char *p = cur->p;
+
+    if((size_t)(cur->end - p) < n)
+        return NULL;
+    cur->p += n;
+    return p;
+}
+
+static char *take_string(struct cursor *cur, size_t len) {
+    const char *p = take(cur, len);
+    return p ? strndup(p, len) : NULL;
+}
+
+/* Template of the rule of re, NULL if truncated or if it refers to a group
+ * that re doesn't have */
+static struct replacement_template *load_template(struct cursor *cur, const struct compiled_item *item,
+                                                  struct regexp *re) {
+    struct replacement_template *tpl;
+    const struct compiled_part *part;
+
+    if(item->nparts > (size_t)(cur->end - cur->p) / sizeof(struct compiled_part))
+        return NULL;
+    tpl = abmalloc(sizeof(struct replacement_template));
+    tpl->nparts = 0;
+    tpl->max_group = -1;
+    tpl->parts = calloc(item->nparts, sizeof(struct replacement_part));
+    tpl->raw = take_string(cur, item->tpl_len);
+    if(tpl->raw == NULL || (item->nparts && tpl->parts == NULL))
+        goto fail;
+    for(; tpl->nparts < item->nparts; tpl->nparts++) {
+        if((part = take(cur, sizeof(struct compiled_part))) == NULL)
+            goto fail;
+        if(part->group < -1 || part->group > (int64_t)re->captures)
+            goto fail;
+        tpl->parts[tpl->nparts].group = part->group;
+        tpl->parts[tpl->nparts].len = part->len;
+        if(part->group == -1 && (tpl->parts[tpl->nparts].data = take_string(cur, part->len)) == NULL)
+            goto fail;
+        if(part->group > tpl->max_group)
+            tpl->max_group = part->group;
+    }
+    return tpl;
+
+fail:
+    for(int i = 0; i < tpl->nparts; i++)
+        free(tpl->parts[i].data);
+    free(tpl->parts);
+    free(tpl->raw);
+    free(tpl);
+    return NULL;
+}
+
+static void free_contexts(struct rewrite_context *contexts);
+
+/* Load the compiled configuration into rs if it matches the configuration
+ * file. Return 0 if it is missing, stale or invalid. */
+static int load_compiled(const char *file, struct ruleset *rs, uint64_t hash, size_t config_size,
+                         uint32_t *max_captures) {
+    const struct compiled_header *header;
+    const struct compiled_item *item;
+    struct cursor cur;
+    struct builder b;
+    struct regexp *re;
+    struct replacement_template *tpl;
+    pcre2_code **codes = NULL;
+    int32_t ncodes = 0, used = 0;
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd, ok = 0;
+    long start;
+
+    AS_USER(getuid(), getgid(), fd = open(file, O_RDONLY | O_CLOEXEC));
+    if(fd == -1)
+        return 0;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct compiled_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return 0;
+
+    cur.p = map;
+    cur.end = cur.p + st.st_size;
+    header = take(&cur, sizeof(struct compiled_header));
+    if(memcmp(header->magic, COMPILED_MAGIC, 8) || header->config_hash != hash ||
+       header->config_size != config_size || header->codes_size > (uint64_t)(cur.end - cur.p))
+        goto out;
+
+    codes = calloc(header->ncodes ? header->ncodes : 1, sizeof(pcre2_code *));
+    if(codes == NULL)
+        goto out;
+    start = stats_now();
+    ncodes = header->ncodes ? pcre2_serialize_decode(codes, header->ncodes, take(&cur, header->codes_size), NULL) : 0;
+    compile_ns += stats_now() - start;
+    if(ncodes < 0 || ncodes != (int32_t)header->ncodes) {
+        DEBUG(1, "Can't decode compiled configuration %s\n", file);
+        ncodes = 0;
+        goto out;
+    }
+
+    builder_init(&b, rs, max_captures);
+    for(uint32_t i = 0; i < header->nitems; i++) {
+        if((item = take(&cur, sizeof(struct compiled_item))) == NULL)
+            goto out;
+        if((item->has_code && used == ncodes) || item->kind >= MATCH_KINDS)
+            goto out;
+
+        re = abmalloc(sizeof(struct regexp));
+        memset(re, 0, sizeof(struct regexp));
+        re->raw = take_string(&cur, item->raw_len);
+        if(item->has_code)
+            re->regexp = codes[used++];
+        re->kind = item->kind;
+        re->flags = item->flags;
+        re->replace_all = item->replace_all;
+        if(re->regexp)
+            pcre2_pattern_info(re->regexp, PCRE2_INFO_CAPTURECOUNT, &re->captures);
+        if(re->raw == NULL || (item->type == RULE && (re->regexp == NULL) != (re->kind != MATCH_REGEXP))) {
+            if(re->regexp)
+                pcre2_code_free(re->regexp);
+            free(re->raw);
+            free(re);
+            goto out;
+        }
+
+        if(item->type == CMDLINE) {
+            if(re->regexp == NULL) {
+                free(re->raw);
+                free(re);
+                re = NULL;
+            }
+            add_context(&b, re);
+        } else {
+            tpl = item->has_template ? load_template(&cur, item, re) : NULL;
+            add_rule(&b, re, tpl);
+            if(item->has_template && tpl == NULL)
+                goto out;
+        }
+    }
+    builder_finish(&b);
+    ok = used == ncodes;
+
+out:
+    /* Codes not attached to a rule */
+    for(int32_t i = used; i < ncodes; i++)
+        pcre2_code_free(codes[i]);
+    free(codes);
+    munmap(map, st.st_size);
+    if(!ok) {
+        free_contexts(rs->contexts);
+        memset(rs, 0, sizeof(struct ruleset));
+    }
+    return ok;
+}
+
+static void write_regexp(FILE *out, uint8_t type, struct regexp *re, struct replacement_template *tpl) {
+    struct compiled_item item;
+    struct compiled_part part;
+
+    memset(&item, 0, sizeof(item));
+    item.type = type;
+    item.has_code = re && re->regexp;
+    item.has_template = tpl != NULL;
+    item.replace_all = re ? re->replace_all : 0;
+    item.kind = re ? re->kind : MATCH_REGEXP;
+    item.flags = re ? re->flags : 0;
+    item.raw_len = re ? strlen(re->raw) : 0;
+    item.tpl_len = tpl ? strlen(tpl->raw) : 0;
+    item.nparts = tpl ? tpl->nparts : 0;
+    fwrite(&item, sizeof(item), 1, out);
+    if(re)
+        fwrite(re->raw, 1, item.raw_len, out);
+    if(tpl == NULL)
+        return;
+    fwrite(tpl->raw, 1, item.tpl_len, out);
+    for(int i = 0; i < tpl->nparts; i++) {
+        part.group = tpl->parts[i].data ? -1 : tpl->parts[i].group;
+        part.len = tpl->parts[i].data ? tpl->parts[i].len : 0;
+        fwrite(&part, sizeof(part), 1, out);
+        if(tpl->parts[i].data)
+            fwrite(tpl->parts[i].data, 1, part.len, out);
+    }
+}
+
+/* Write the compiled configuration, atomically. Not fatal. */
+static void save_compiled(const char *file, struct ruleset *rs, uint64_t hash, size_t config_size) {
+    struct compiled_header header;
+    struct rewrite_context *ctx;
+    struct rewrite_rule *rule;
+    const pcre2_code **codes;
+    uint8_t *bytes = NULL;
+    PCRE2_SIZE size = 0;
+    char *tmp = NULL;
+    int32_t n = 0;
+    FILE *out;
+    int fd = -1, res = -1;
+
+    memset(&header, 0, sizeof(header));
+    for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+        header.nitems += ctx != rs->contexts;
+        header.ncodes += ctx->cmdline != NULL;
+        for(rule = ctx->rules; rule != NULL; rule = rule->next) {
+            header.nitems++;
+            header.ncodes += rule->filename_regexp->regexp != NULL;
+        }
+    }
+
+    codes = calloc(header.ncodes ? header.ncodes : 1, sizeof(pcre2_code *));
+    if(codes == NULL)
+        goto out;
+    for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+        if(ctx->cmdline)
+            codes[n++] = ctx->cmdline->regexp;
+        for(rule = ctx->rules; rule != NULL; rule = rule->next) {
+            if(rule->filename_regexp->regexp)
+                codes[n++] = rule->filename_regexp->regexp;
+        }
+    }
+    if(n > 0 && pcre2_serialize_encode(codes, n, &bytes, &size, NULL) < 0)
+        goto out;
+
+    memcpy(header.magic, COMPILED_MAGIC, 8);
+    header.config_hash = hash;
+    header.config_size = config_size;
+    header.codes_size = size;
+
+    if(asprintf(&tmp, "%s.%d", file, getpid()) == -1) {
+        tmp = NULL;
+        goto out;
+    }
+    /* rewritefs may be setuid: only write where the user could */
+    AS_USER(getuid(), getgid(), fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+    if(fd == -1 || (out = fdopen(fd, "w")) == NULL)
+        goto out;
+    fd = -1;
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(bytes, 1, size, out);
+    for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+        if(ctx != rs->contexts)
+            write_regexp(out, CMDLINE, ctx->cmdline, NULL);
+        for(rule = ctx->rules; rule != NULL; rule = rule->next)
+            write_regexp(out, RULE, rule->filename_regexp, rule->rewritten_path);
+    }
+    res = ferror(out) ? -1 : 0;
+    if(fclose(out) != 0)
+        res = -1;
+    if(res == 0)
+        AS_USER(getuid(), getgid(), res = rename(tmp, file));
+
+out:
+    if(res == -1) {
+        fprintf(stderr, "Warning: cannot write compiled configuration %s\n", file);
+        if(tmp)
+            AS_USER(getuid(), getgid(), unlink(tmp));
+    }
+    if(fd != -1)
+        close(fd);
+    free(tmp);
+    pcre2_serialize_free(bytes);
+    free(codes);
+}
+
+/* Content of the configuration file */
+static char *read_config(const char *file, size_t *size) {
+    size_t cap = 4096;
+    char *buf = abmalloc(cap);
+    ssize_t n;
+    int fd;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        free(buf);
+        return NULL;
+    }
+    *size = 0;
+    while((n = read(fd, buf + *size, cap - *size)) > 0) {
+        *size += n;
+        if(*size == cap) {
+            buf = realloc(buf, cap *= 2);
+            if(buf == NULL) {
+                perror("realloc");
+                abort();
+            }
+        }
+    }
+    close(fd);
+    if(n == -1) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Parse the configuration file of engine into a new ruleset. On syntax error,
+ * longjmp() to parse_abort. */
+static struct ruleset *load_rules(struct rewrite_engine *engine, uint32_t *max_captures) {
+    struct ruleset *rs = abmalloc(sizeof(struct ruleset));
+    struct rewrite_context *ctx;
+    struct rewrite_rule *rule;
+    struct builder b;
+    uint64_t hash;
+    size_t size;
+    long start = stats_now();
+    char *buf;
+    FILE *fd;
+
+    memset(rs, 0, sizeof(struct ruleset));
+    compile_ns = 0;
+    if(engine->config_file) {
+        buf = read_config(engine->config_file, &size);
+        if(buf == NULL) {
+            perror("opening config file");
+            parse_fail();
+        }
+        hash = hash_config(buf, size);
+
+        if(engine->compiled_config && load_compiled(engine->compiled_config, rs, hash, size, max_captures)) {
+            rs->source = "compiled";
+        } else {
+            /* fmemopen() refuses empty buffers, a blank line parses the same */
+            if(size == 0)
+                buf[size++] = '\n';
+            fd = fmemopen(buf, size, "r");
+            if(fd == NULL) {
+                perror("fmemopen");
+                abort();
+            }
+            builder_init(&b, rs, max_captures);
+            parse_config(fd, &b);
+            builder_finish(&b);
+            fclose(fd);
+            rs->source = "config";
+            if(engine->compiled_config)
+                save_compiled(engine->compiled_config, rs, hash, size);
+        }
+        free(buf);
+
+        for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+            DEBUG(1, "CTX \"%s\":\n", ctx->cmdline ? ctx->cmdline->raw : "default");
+            for(rule = ctx->rules; rule != NULL; rule = rule->next)
+                DEBUG(1, "  \"%s\" -> \"%s\"\n", rule->filename_regexp->raw, rule->rewritten_path ? rule->rewritten_path->raw : "(don't rewrite)");
+        }
+        rs->load_ns = stats_now() - start;
+        rs->compile_ns = compile_ns;
+        DEBUG(1, "Loaded %s (%s) in %ld us, %ld us compiling\n", engine->config_file,
+              rs->source, rs->load_ns / 1000, rs->compile_ns / 1000);
+        DEBUG(1, "\n");
+    }
+
+    pthread_mutex_init(&rs->programs_lock, NULL);
+    rs->programs[rs->nprograms++] = build_program(rs, NULL);
+
+    if(engine->cache_size > 0)
+        rs->cache = cache_new(engine->cache_size, free);
+    if(rs->ncmdline > 0 && engine->cmdline_cache_size > 0)
+        rs->callers = cache_new(engine->cmdline_cache_size, free_caller);
+
+    return rs;
+}
+
+static void free_regexp(struct regexp *re) {
+    pcre2_code_free(re->regexp);
+    pcre2_code_free(re->jit);
+    free(re->raw);
+    free(re);
+}
+
+static void free_contexts(struct rewrite_context *contexts) {
+    struct rewrite_context *ctx, *next_ctx;
+    struct rewrite_rule *rule, *next_rule;
+
+    for(ctx = contexts; ctx != NULL; ctx = next_ctx) {
+        next_ctx = ctx->next;
+        for(rule = ctx->rules; rule != NULL; rule = next_rule) {
+            next_rule = rule->next;
+            free_regexp(rule->filename_regexp);
+            if(rule->rewritten_path) {
+                for(int i = 0; i < rule->rewritten_path->nparts; i++)
+                    free(rule->rewritten_path->parts[i].data);
+                free(rule->rewritten_path->parts);
+                free(rule->rewritten_path->raw);
+                free(rule->rewritten_path);
+            }
+            free(rule);
+        }
+        if(ctx->cmdline)
+            free_regexp(ctx->cmdline);
+        rule_index_free(ctx->index);
+        free(ctx->rule_array);
+        free(ctx);
+    }
+}
+
+static void free_rules(struct ruleset *rs) {
+    for(int i = 0; i < rs->nprograms; i++)
+        free_program(rs->programs[i]);
+    pthread_mutex_destroy(&rs->programs_lock);
+    free_contexts(rs->contexts);
+    if(rs->cache)
+        cache_free(rs->cache);
+    if(rs->callers)
+        cache_free(rs->callers);
+    free(rs);
+}
+
+/*
+ * Rewrite stuff
+ */
+#define CMDLINE_BUF_SIZE 4096
+
+/* Cached caller, by pid. It is checked out of the lock of the cache, which
+ * holds a reference to it like every lookup using it. */
+struct caller {
+    int refs;
+    int fd; /* /proc/(pid)/cmdline, stays bound to the process */
+    size_t len;
+    char *cmdline; /* raw content, with null characters */
+    struct rule_program *program; /* NULL to walk the contexts */
+    unsigned char selection[];
+};
+
+/* Drop a reference to a caller */
+static void free_caller(void *data) {
+    struct caller *caller = data;
+    if(__atomic_sub_fetch(&caller->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    close(caller->fd);
+    free(caller->cmdline);
+    free(caller);
+}
+
+static char *get_caller_cmdline(pid_t pid) {
+    char path[PATH_MAX];
+    FILE *fd;
+    int size = 0, cap = 255, c;
+    char *ret = malloc(cap);
+    
+    if(ret == NULL) {
+        return NULL;
+    } else {
+        *ret = 0;
+    }
+    
+    snprintf(path, PATH_MAX, "/proc/%d/cmdline", pid);
+    fd = fopen(path, "r");
+    if(fd == NULL)
+        return ret;
+    
+    while((c = getc(fd)) != EOF) {
+        if(c == 0)
+            c = ' ';
+        string_append(&ret, c, &cap, &size);
+    }
+    
+    fclose(fd);
+    
+    return ret;
+}
+
+/* Rewritten path being written, in buf->data until it overflows to the heap */
+struct writer {
+    struct rewrite_buf *buf;
+    char *data;
+    size_t len, cap;
+};
+
+static void writer_init(struct writer *w, struct rewrite_buf *buf) {
+    w->buf = buf;
+    w->data = buf->data;
+    w->data[0] = '\0';
+    w->len = 0;
+    w->cap = sizeof(buf->data);
+}
+
+/* Make room for len more characters, exactly */
+static int writer_reserve(struct writer *w, size_t len) {
+    size_t cap = w->len + len + 1;
+    char *data;
+
+    if(cap <= w->cap)
+        return 0;
+    data = w->data == w->buf->data ? malloc(cap) : realloc(w->data, cap);
+    if(data == NULL)
+        return -1;
+    if(w->data == w->buf->data)
+        memcpy(data, w->data, w->len + 1);
+    w->data = w->buf->heap = data;
+    w->cap = cap;
+    return 0;
+}
+
+static int writer_append(struct writer *w, const char *s, size_t len) {
+    if(w->len + len >= w->cap) {
+        size_t cap = (w->len + len + 1) * 2;
+        char *data = w->data == w->buf->data ? malloc(cap) : realloc(w->data, cap);
+
+        if(data == NULL)
+            return -1;
+        if(w->data == w->buf->data)
+            memcpy(data, w->data, w->len);
+        w->data = w->buf->heap = data;
+        w->cap = cap;
+    }
+    memcpy(w->data + w->len, s, len);
+    w->len += len;
+    w->data[w->len] = '\0';
+    return 0;
+}
+
+/* Offsets of the groups of tpl in every match of re on subject (only the
+ * first without the g flag), stride pairs by match. scount is the result of
+ * matching re on subject, whose match data is still in the state of the
+ * thread. Return the number of matches, -1 on allocation failure. */
+static long find_matches(struct regexp *re, const char *subject, size_t len, int scount,
+                         size_t stride, struct match_state *state) {
+    PCRE2_SIZE *ovector, *spans;
+    size_t base = 0, next;
+    long nmatches = 0;
+
+    for(;;) {
+        if(scount == PCRE2_ERROR_NOMEMORY)
+            return -1;
+        if(scount < 0) {
+            if(scount != PCRE2_ERROR_NOMATCH)
+                fprintf(stderr, "WARNING: pcre2_match returned %d\n", scount);
+            return nmatches;
+        }
+        ovector = pcre2_get_ovector_pointer(state->match_data);
+
+        if((nmatches + 1) * stride > state->spans_cap) {
+            size_t cap = (nmatches + 1) * stride * 2;
+            spans = reallocarray(state->spans, cap, sizeof(PCRE2_SIZE));
+            if(spans == NULL)
+                return -1;
+            state->spans = spans;
+            state->spans_cap = cap;
+        }
+        spans = state->spans + nmatches * stride;
+        for(size_t i = 0; i < stride; i++) {
+            if(i / 2 < (size_t)scount && ovector[i & ~1] != PCRE2_UNSET)
+                spans[i] = base + ovector[i];
+            else
+                spans[i] = PCRE2_UNSET;
+        }
+        nmatches++;
+        DEBUG(4, "  match = %.*s\n", (int)(spans[1] - spans[0]), subject + spans[0]);
+
+        /* The rest is matched as a new subject, until a match reaches the
+         * end. An empty match would be found again at the same place, so it
+         * moves on by a character, and the end is still tried. */
+        next = ovector[1];
+        if(!re->replace_all || base + next == len)
+            return nmatches;
+        if(next == ovector[0])
+            next++;
+        base += next;
+
+        scount = regexp_match(re, subject + base, len - base, state);
+    }
+}
+
+/* Write subject to w, with the match of re replaced by tpl (every match with
+ * the g flag). The matches are found first, so that the result is sized and
+ * written once. */
+static int regexp_replace(struct regexp *re, const char *subject, int scount,
+                          struct replacement_template *tpl, struct match_state *state,
+                          struct writer *w) {
+    size_t len = strlen(subject), stride, size, pos = 0;
+    const PCRE2_SIZE *spans;
+    long nmatches;
+    int group;
+
+    /* Group 0 is needed for the position of the match */
+    stride = (tpl->max_group > 0 ? tpl->max_group + 1 : 1) * 2;
+    nmatches = find_matches(re, subject, len, scount, stride, state);
+    if(nmatches == -1)
+        return -1;
+
+    size = len;
+    for(long m = 0; m < nmatches; m++) {
+        spans = state->spans + m * stride;
+        size -= spans[1] - spans[0];
+        for(int i = 0; i < tpl->nparts; i++) {
+            group = tpl->parts[i].group;
+            if(tpl->parts[i].data)
+                size += tpl->parts[i].len;
+            else if(spans[group * 2] != PCRE2_UNSET)
+                size += spans[group * 2 + 1] - spans[group * 2];
+        }
+    }
+    if(writer_reserve(w, size) == -1)
+        return -1;
+
+    for(long m = 0; m < nmatches; m++) {
+        spans = state->spans + m * stride;
+        writer_append(w, subject + pos, spans[0] - pos);
+        for(int i = 0; i < tpl->nparts; i++) {
+            group = tpl->parts[i].group;
+            if(tpl->parts[i].data)
+                writer_append(w, tpl->parts[i].data, tpl->parts[i].len);
+            else if(spans[group * 2] != PCRE2_UNSET)
+                writer_append(w, subject + spans[group * 2], spans[group * 2 + 1] - spans[group * 2]);
+        }
+        pos = spans[1];
+    }
+    return writer_append(w, subject + pos, len - pos);
+}
+
+/* Write subject to w, with its first end characters, matched by a rule
+ * without regexp, replaced by tpl. There is no group but the whole match. */
+static int literal_replace(const char *subject, size_t end, struct replacement_template *tpl,
+                           struct writer *w) {
+    for(int i = 0; i < tpl->nparts; i++) {
+        if(tpl->parts[i].data == NULL) {
+            if(tpl->parts[i].group == 0 && writer_append(w, subject, end) == -1)
+                return -1;
+        } else if(writer_append(w, tpl->parts[i].data, tpl->parts[i].len) == -1) {
+            return -1;
+        }
+    }
+    return writer_append(w, subject + end, strlen(subject + end));
+}
+
+/* Rewritten path of path by rule, which matched it with the result nmatch,
+ * its match data still in state. A path that is not rewritten is returned as
+ * is, without its leading '/'. */
+static const char *apply_rule(const char *path, struct rewrite_rule *rule, int nmatch,
+                              struct match_state *state, struct rewrite_buf *buf) {
+    struct writer w;
+
+    if(rule == NULL || rule->rewritten_path == NULL) {
+        DEBUG(2, "  (ignored) %s -> %s\n", path, path + 1);
+        DEBUG(3, "\n");
+        return path[1] == '\0' ? "." : path + 1;
+    }
+
+    writer_init(&w, buf);
+    if(rule->filename_regexp->kind != MATCH_REGEXP) {
+        if(literal_replace(path + 1, state->match_end, rule->rewritten_path, &w) == -1)
+            return NULL;
+    } else if(regexp_replace(rule->filename_regexp, path + 1, nmatch, rule->rewritten_path, state, &w) == -1) {
+        return NULL;
+    }
+
+    DEBUG(1, "  %s -> %s\n", path, w.data);
+    DEBUG(3, "\n");
+
+    return w.data;
+}
+
+/* Set the bit of every cmdline context matching caller in selection */
+static void match_contexts(struct ruleset *rs, const char *caller, unsigned char *selection) {
+    struct rewrite_context *ctx;
+    struct match_state *state = get_match_state();
+    int res;
+
+    if(caller == NULL) {
+        fprintf(stderr, "WARNING: cannot obtain caller command line\n");
+        return;
+    }
+    if(state == NULL)
+        return;
+
+    for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+        if(!ctx->cmdline)
+            continue;
+
+        res = selection_match(ctx->cmdline, caller, strlen(caller), state);
+        if(res < 0) {
+            if(res != PCRE2_ERROR_NOMATCH)
+                fprintf(stderr, "WARNING: pcre2_match returned %d\n", res);
+            DEBUG(3, "  CTX NOMATCH \"%s\"\n", ctx->cmdline->raw);
+            continue;
+        }
+        DEBUG(3, "  CTX OK \"%s\"\n", ctx->cmdline->raw);
+        selection[ctx->id / 8] |= 1 << (ctx->id % 8);
+    }
+}
+
+/* Take a reference to a cached caller. Reading its command line may block
+ * on the process, so it is done once the cache is unlocked. */
+static int ref_caller(void *value, void *arg) {
+    struct caller *caller = value;
+
+    __atomic_add_fetch(&caller->refs, 1, __ATOMIC_RELAXED);
+    *(struct caller **)arg = caller;
+    return 0;
+}
+
+/* Set the bit of every cmdline context matching the caller in selection, and
+ * return the rules of these contexts (NULL to walk them) */
+static struct rule_program *select_contexts(struct ruleset *rs, unsigned char *selection, pid_t pid) {
+    size_t sel_len = (rs->ncmdline + 7) / 8;
+    struct rule_program *program;
+    struct caller *caller;
+    char buf[CMDLINE_BUF_SIZE];
+    char path[PATH_MAX];
+    char *cmdline;
+    ssize_t len;
+    int fd = -1;
+
+    if(rs->ncmdline == 0)
+        return rs->programs[0];
+
+    if(rs->callers == NULL) {
+        cmdline = get_caller_cmdline(pid);
+        match_contexts(rs, cmdline, selection);
+        free(cmdline);
+        return get_program(rs, selection);
+    }
+
+    if(cache_get(rs->callers, &pid, sizeof(pid), ref_caller, &caller)) {
+        /* Check that the caller neither exited nor called exec() */
+        len = pread(caller->fd, buf, sizeof(buf), 0);
+        if(len == (ssize_t)caller->len && !memcmp(buf, caller->cmdline, len)) {
+            DEBUG(3, "  CTX CACHED %d\n", pid);
+            memcpy(selection, caller->selection, sel_len);
+            program = caller->program;
+            free_caller(caller);
+            return program;
+        }
+        /* After exec(), the file descriptor is still good. After exit, the
+         * pid may now belong to another process. */
+        if(len > 0)
+            fd = dup(caller->fd);
+        free_caller(caller);
+    }
+
+    if(fd == -1) {
+        snprintf(path, PATH_MAX, "/proc/%d/cmdline", pid);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        len = fd == -1 ? 0 : pread(fd, buf, sizeof(buf), 0);
+    }
+
+    if(len <= 0 || len == sizeof(buf)) {
+        /* Unreadable (kernel thread, zombie) or too long to be cached */
+        if(fd != -1)
+            close(fd);
+        cmdline = len <= 0 ? strdup("") : get_caller_cmdline(pid);
+        match_contexts(rs, cmdline, selection);
+        free(cmdline);
+        return get_program(rs, selection);
+    }
+
+    caller = malloc(sizeof(struct caller) + sel_len);
+    if(caller == NULL || (caller->cmdline = malloc(len)) == NULL) {
+        free(caller);
+        close(fd);
+        caller = NULL;
+    } else {
+        caller->refs = 1;
+        caller->fd = fd;
+        caller->len = len;
+        memcpy(caller->cmdline, buf, len);
+    }
+
+    for(ssize_t i = 0; i < len; i++) {
+        if(buf[i] == '\0')
+            buf[i] = ' ';
+    }
+    buf[len] = '\0';
+    match_contexts(rs, buf, selection);
+
+    program = get_program(rs, selection);
+    if(caller != NULL) {
+        memcpy(caller->selection, selection, sel_len);
+        caller->program = program;
+        cache_put(rs->callers, &pid, sizeof(pid), caller);
+    }
+    return program;
+}
+
+/* Store the first of the rules of index matching path in rule. Return 1 if
+ * one does, 0 if none, -1 on allocation failure. */
+static int match_rules(struct rewrite_rule **rule_array, struct rule_index *index, const char *path,
+                       struct match_state *state, struct rewrite_rule **rule, int *nmatch) {
+    int i, res;
+
+    /* Only try the rules whose literal prefix matches */
+    if(rule_index_lookup(index, path + 1, &state->candidates) == -1)
+        return -1;
+    while((i = candidates_next(&state->candidates)) != -1) {
+        *rule = rule_array[i];
+        res = selection_match((*rule)->filename_regexp, path + 1, strlen(path) - 1, state);
+        if(res < 0) {
+            if(res != PCRE2_ERROR_NOMATCH)
+                fprintf(stderr, "WARNING: pcre2_match returned %d\n", res);
+            DEBUG(3, "    RULE NOMATCH \"%s\"\n", (*rule)->filename_regexp->raw);
+        } else {
+            DEBUG(3, "    RULE OK \"%s\" \"%s\"\n", (*rule)->filename_regexp->raw, (*rule)->rewritten_path ? (*rule)->rewritten_path->raw : "(don't rewrite)");
+            *nmatch = res;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Store the first rule matching path in rule (NULL if none), from program or
+ * else from the contexts in selection, its match data in state. Return -1 on
+ * allocation failure. */
+static int find_rule(struct ruleset *rs, const char *path, const unsigned char *selection,
+                     struct rule_program *program, struct match_state *state,
+                     struct rewrite_rule **rule, int *nmatch) {
+    struct rewrite_context *ctx;
+    int res = 0;
+
+    if(program) {
+        DEBUG(3, "  PROGRAM %d rules\n", program->nrules);
+        if(program->nrules > 0)
+            res = match_rules(program->rule_array, program->index, path, state, rule, nmatch);
+    } else {
+        for(ctx = rs->contexts; ctx != NULL && res == 0; ctx = ctx->next) {
+            if(!context_selected(ctx, selection))
+                continue;
+            if(!ctx->cmdline)
+                DEBUG(3, "  CTX DEFAULT\n");
+            res = match_rules(ctx->rule_array, ctx->index, path, state, rule, nmatch);
+        }
+    }
+
+    if(res == -1)
+        return -1;
+    if(res == 0)
+        *rule = NULL;
+    return 0;
+}
+
+static int copy_cached(void *value, void *arg) {
+    struct rewrite_buf *buf = arg;
+    size_t len = strlen(value);
+
+    if(len < sizeof(buf->data)) {
+        memcpy(buf->data, value, len + 1);
+        return 0;
+    }
+    buf->heap = strdup(value);
+    return buf->heap == NULL;
+}
+
+/* Select the contexts matching caller in selection, and return their rules.
+ * Without caller, no context is selected. */
+static struct rule_program *select_caller(struct ruleset *rs, unsigned char *selection,
+                                          const struct rewrite_caller *caller) {
+    if(caller == NULL || rs->ncmdline == 0)
+        return rs->programs[0];
+    if(caller->cmdline) {
+        match_contexts(rs, caller->cmdline, selection);
+        return get_program(rs, selection);
+    }
+    return select_contexts(rs, selection, caller->pid);
+}
+
+/* Rewrite path into buf with program, the rules of the contexts in selection
+ * (sel_len bytes). The result is cached if cache is set. */
+static const char *rewrite_selected(struct ruleset *rs, const char *path, const unsigned char *selection,
+                                    size_t sel_len, struct rule_program *program, int cache,
+                                    struct rewrite_buf *buf) {
+    size_t path_len = strlen(path);
+    struct rewrite_rule *rule;
+    struct match_state *state;
+    char key_buf[KEY_BUF_SIZE], *key = key_buf;
+    const char *res;
+    int nmatch;
+
+    DEBUG(3, "%s:\n", path);
+    buf->heap = NULL;
+
+    /* Cache key is the context selection followed by the path */
+    if(sel_len + path_len > sizeof(key_buf)) {
+        key = malloc(sel_len + path_len);
+        if(key == NULL)
+            return NULL;
+    }
+    memcpy(key, selection, sel_len);
+    memcpy(key + sel_len, path, path_len);
+
+    if(rs->cache && cache_get(rs->cache, key, sel_len + path_len, copy_cached, buf)) {
+        res = buf->heap ? buf->heap : buf->data;
+        DEBUG(1, "  %s -> %s (cached)\n", path, res);
+        DEBUG(3, "\n");
+        goto end;
+    }
+
+    /* The same match data from the match to the replacement */
+    res = NULL;
+    state = get_match_state();
+    if(state == NULL || find_rule(rs, path, selection, program, state, &rule, &nmatch) == -1)
+        goto end;
+    res = apply_rule(path, rule, nmatch, state, buf);
+    if(res == NULL) {
+        free(buf->heap);
+        buf->heap = NULL;
+    }
+
+    if(rs->cache && cache && res != NULL) {
+        char *cached = strdup(res);
+        if(cached)
+            cache_put(rs->cache, key, sel_len + path_len, cached);
+    }
+
+end:
+    if(key != key_buf)
+        free(key);
+    return res;
+}
+
+/* Rewrite path with the rules of rs into buf. Without caller, contexts don't
+ * match and the result is not cached. */
+static const char *do_rewrite(struct ruleset *rs, const char *path, const struct rewrite_caller *caller,
+                              struct rewrite_buf *buf) {
+    size_t sel_len = (rs->ncmdline + 7) / 8;
+    unsigned char sel_buf[SELECTION_BUF_SIZE], *selection = sel_buf;
+    struct rule_program *program;
+    const char *res;
+
+    buf->heap = NULL;
+    if(sel_len > sizeof(sel_buf) && (selection = malloc(sel_len)) == NULL)
+        return NULL;
+    memset(selection, 0, sel_len);
+    program = select_caller(rs, selection, caller);
+    res = rewrite_selected(rs, path, selection, sel_len, program, caller != NULL, buf);
+
+    if(selection != sel_buf)
+        free(selection);
+    return res;
+}
+
+/* Rules to use until the matching epoch_exit() */
+static struct ruleset *current_rules(struct rewrite_engine *engine) {
+    epoch_enter();
+    return __atomic_load_n(&engine->rules, __ATOMIC_SEQ_CST);
+}
+
+const char *rewrite_engine_into(struct rewrite_engine *engine, const char *path,
+                                const struct rewrite_caller *caller, struct rewrite_buf *buf) {
+    struct ruleset *rs = current_rules(engine);
+    const char *res;
+    long start;
+
+    if(!stats_enabled()) {
+        res = do_rewrite(rs, path, caller, buf);
+    } else {
+        start = stats_now();
+        res = do_rewrite(rs, path, caller, buf);
+        stats_rewrite(stats_now() - start);
+        if(trace_enabled())
+            trace_rewrite(path, caller, rs->ncmdline > 0, res);
+    }
+
+    epoch_exit();
+    return res;
+}
+
+int rewrite_engine_batch(struct rewrite_engine *engine, const struct rewrite_caller *caller,
+                         const char *const *paths, const char **res, struct rewrite_buf *bufs, size_t n) {
+    struct ruleset *rs = current_rules(engine);
+    size_t sel_len = (rs->ncmdline + 7) / 8, i = 0;
+    unsigned char sel_buf[SELECTION_BUF_SIZE], *selection = sel_buf;
+    struct rule_program *program;
+    long start = stats_enabled() ? stats_now() : 0;
+
+    if(sel_len > sizeof(sel_buf) && (selection = malloc(sel_len)) == NULL)
+        goto end;
+    memset(selection, 0, sel_len);
+
+    /* The caller is looked up once for all the paths */
+    program = select_caller(rs, selection, caller);
+    for(; i < n; i++) {
+        res[i] = rewrite_selected(rs, paths[i], selection, sel_len, program, caller != NULL, &bufs[i]);
+        if(res[i] == NULL)
+            break;
+    }
+
+    if(selection != sel_buf)
+        free(selection);
+end:
+    if(start)
+        stats_rewrite(stats_now() - start);
+    epoch_exit();
+
+    if(i == n)
+        return 0;
+    while(i-- > 0)
+        rewrite_buf_free(&bufs[i]);
+    return -1;
+}
+
+void rewrite_buf_free(struct rewrite_buf *buf) {
+    free(buf->heap);
+    buf->heap = NULL;
+}
+
+char *rewrite_engine_dry(struct rewrite_engine *engine, const char *path) {
+    struct ruleset *rs = current_rules(engine);
+    struct rewrite_buf buf;
+    const char *res = do_rewrite(rs, path, NULL, &buf);
+    char *copy = res ? strdup(res) : NULL;
+
+    rewrite_buf_free(&buf);
+    epoch_exit();
+    return copy;
+}
+
+static void print_profile(FILE *out, const char *kind, struct regexp *re) {
+    fprintf(out, "%s evals=%lu matches=%lu match_ns=%lu %s\n", kind,
+            __atomic_load_n(&re->evals, __ATOMIC_RELAXED),
+            __atomic_load_n(&re->matches, __ATOMIC_RELAXED),
+            __atomic_load_n(&re->match_ns, __ATOMIC_RELAXED), re->raw);
+}
+
+void rewrite_engine_print_rules(struct rewrite_engine *engine, FILE *out) {
+    struct ruleset *rs = current_rules(engine);
+    struct rewrite_context *ctx;
+    struct rewrite_rule *rule;
+
+    if(rs->source)
+        fprintf(out, "ruleset source=%s load_ns=%ld compile_ns=%ld\n", rs->source, rs->load_ns, rs->compile_ns);
+    for(ctx = rs->contexts; ctx != NULL; ctx = ctx->next) {
+        if(ctx->cmdline)
+            print_profile(out, "context", ctx->cmdline);
+        for(rule = ctx->rules; rule != NULL; rule = rule->next)
+            print_profile(out, "rule", rule->filename_regexp);
+    }
+    epoch_exit();
+}
+
+int rewrite_engine_has_contexts(struct rewrite_engine *engine) {
+    struct ruleset *rs = current_rules(engine);
+    int res = rs->ncmdline > 0;
+
+    epoch_exit();
+    return res;
+}
+
+/*
+ * Engines
+ */
+static void create_match_state_key() {
+    pthread_key_create(&match_state_key, free_match_state);
+}
+
+/* Rules of the configuration file of engine, NULL if it is invalid */
+static struct ruleset *try_load_rules(struct rewrite_engine *engine, uint32_t *captures) {
+    struct ruleset *rs;
+    jmp_buf env;
+
+    if(setjmp(env)) {
+        parse_abort = NULL;
+        return NULL;
+    }
+    parse_abort = &env;
+    rs = load_rules(engine, captures);
+    parse_abort = NULL;
+    return rs;
+}
+
+/* Threads that see the new rules must allocate large enough match data */
+static void raise_max_captures(uint32_t captures) {
+    uint32_t cur = __atomic_load_n(&max_captures, __ATOMIC_SEQ_CST);
+
+    while(captures > cur &&
+          !__atomic_compare_exchange_n(&max_captures, &cur, captures, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+void rewrite_engine_defaults(struct rewrite_engine_options *opts) {
+    memset(opts, 0, sizeof(struct rewrite_engine_options));
+    opts->cache_size = 4096;
+    opts->cmdline_cache_size = 256;
+}
+
+struct rewrite_engine *rewrite_engine_new(const struct rewrite_engine_options *opts) {
+    struct rewrite_engine *engine = abmalloc(sizeof(struct rewrite_engine));
+    uint32_t captures = __atomic_load_n(&max_captures, __ATOMIC_SEQ_CST);
+
+    pthread_once(&match_state_once, create_match_state_key);
+    verbose = opts->verbose;
+    engine->config_file = opts->config_file ? abstrdup(opts->config_file) : NULL;
+    engine->compiled_config = NULL;
+    /* PCRE2 only decodes code from a trusted source, and the user of a
+     * setuid rewritefs writes the file as well as the configuration */
+    if(opts->compiled_config && geteuid() != getuid())
+        fprintf(stderr, "WARNING: compiled_config ignored, rewritefs runs setuid\n");
+    else if(opts->compiled_config)
+        engine->compiled_config = abstrdup(opts->compiled_config);
+    engine->cache_size = opts->cache_size;
+    engine->cmdline_cache_size = opts->cmdline_cache_size;
+
+    engine->rules = try_load_rules(engine, &captures);
+    if(engine->rules == NULL) {
+        free(engine->config_file);
+        free(engine->compiled_config);
+        free(engine);
+        return NULL;
+    }
+    raise_max_captures(captures);
+    return engine;
+}
+
+int rewrite_engine_reload(struct rewrite_engine *engine, int allow_contexts) {
+    uint32_t captures = __atomic_load_n(&max_captures, __ATOMIC_SEQ_CST);
+    struct ruleset *rs, *old;
+
+    rs = try_load_rules(engine, &captures);
+    if(rs == NULL)
+        return -1;
+    if(rs->ncmdline > 0 && !allow_contexts) {
+        free_rules(rs);
+        return 1;
+    }
+
+    raise_max_captures(captures);
+    old = __atomic_exchange_n(&engine->rules, rs, __ATOMIC_SEQ_CST);
+    epoch_synchronize();
+    free_rules(old);
+    return 0;
+}
+
+void rewrite_engine_free(struct rewrite_engine *engine) {
+    struct ruleset *rs = engine->rules;
+    unsigned long hits, misses;
+
+    if(rs->cache) {
+        cache_stats(rs->cache, &hits, &misses);
+        DEBUG(1, "rewrite cache: %lu hits, %lu misses\n", hits, misses);
+    }
+    if(rs->callers) {
+        cache_stats(rs->callers, &hits, &misses);
+        DEBUG(1, "cmdline cache: %lu hits, %lu misses\n", hits, misses);
+    }
+
+    free_rules(rs);
+    free(engine->config_file);
+    free(engine->compiled_config);
+    free(engine);
+}
@@ -0,0 +1,94 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "epoch.h"
+
+/* Epoch the thread entered at, 0 outside of a read section. When the thread
+ * exits, its record is kept in the list to be reused by another one. */
+struct reader {
+    struct reader *next;
+    unsigned long epoch;
+    int in_use;
+};
+
+static unsigned long global_epoch = 1;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct reader *readers;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static __thread struct reader *reader;
+static __thread int depth;
+
+static void release_reader(void *data) {
+    struct reader *r = data;
+
+    pthread_mutex_lock(&readers_lock);
+    r->in_use = 0;
+    pthread_mutex_unlock(&readers_lock);
+}
+
+static void create_key() {
+    pthread_key_create(&reader_key, release_reader);
+}
+
+static struct reader *get_reader() {
+    struct reader *r;
+
+    if(reader)
+        return reader;
+
+    pthread_once(&key_once, create_key);
+    pthread_mutex_lock(&readers_lock);
+    for(r = readers; r && r->in_use; r = r->next);
+    if(r == NULL) {
+        r = calloc(1, sizeof(struct reader));
+        if(r == NULL) {
+            perror("calloc");
+            abort();
+        }
+        r->next = readers;
+        readers = r;
+    }
+    r->in_use = 1;
+    pthread_mutex_unlock(&readers_lock);
+
+    pthread_setspecific(reader_key, r);
+    reader = r;
+    return r;
+}
+
+void epoch_enter() {
+    struct reader *r = get_reader();
+
+    if(depth++ > 0)
+        return;
+    /* Ordered before the load of the shared pointer: either the writer sees
+     * this epoch, or this thread sees the new version */
+    __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit() {
+    if(--depth > 0)
+        return;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_synchronize() {
+    struct timespec delay = { 0, 1000000 };
+    unsigned long epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    unsigned long e;
+    struct reader *r;
+
+    /* Records are never freed, the list can be walked without the lock once
+     * its head is read */
+    pthread_mutex_lock(&readers_lock);
+    r = readers;
+    pthread_mutex_unlock(&readers_lock);
+
+    for(; r; r = r->next) {
+        while((e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST)) != 0 && e <= epoch)
+            nanosleep(&delay, NULL);
+    }
+}
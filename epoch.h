@@ -0,0 +1,15 @@
+/*
+ * Epoch-based reclamation.
+ *
+ * Readers bracket their accesses to a shared structure with epoch_enter()
+ * and epoch_exit(), which take no lock. A writer publishes a new version of
+ * the structure, then calls epoch_synchronize() to wait for every reader
+ * that may still see the old one before freeing it.
+ */
+
+/* Can be nested. The shared pointer must be loaded after epoch_enter(),
+ * with __ATOMIC_SEQ_CST, and published the same way. */
+void epoch_enter();
+void epoch_exit();
+/* Wait until every reader that entered before the call has exited */
+void epoch_synchronize();
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "index.h"
+
+struct trie_node {
+    /* Children, sorted by key */
+    unsigned char *keys;
+    struct trie_node **children;
+    int nchildren;
+
+    /* Rules whose prefix ends here */
+    int *rules;
+    int nrules;
+};
+
+/* Rules matching a single path, in a chained hash table */
+struct exact_entry {
+    char *path;
+    size_t len;
+    uint64_t hash;
+    int *rules;
+    int nrules;
+    struct exact_entry *next;
+};
+
+struct rule_index {
+    struct trie_node root;
+    /* Rules without prefix */
+    int *any;
+    int nany;
+    struct exact_entry **exact;
+    size_t nexact, exact_cap;
+};
+
+static void *index_realloc(void *ptr, size_t nmemb, size_t size) {
+    void *res = reallocarray(ptr, nmemb, size);
+    if(res == NULL) {
+        perror("reallocarray");
+        abort();
+    }
+    return res;
+}
+
+static void append_rule(int **rules, int *nrules, int rule) {
+    /* A rule can have several prefixes, possibly equal ones */
+    if(*nrules > 0 && (*rules)[*nrules - 1] == rule)
+        return;
+    *rules = index_realloc(*rules, *nrules + 1, sizeof(int));
+    (*rules)[(*nrules)++] = rule;
+}
+
+static int find_child(struct trie_node *node, unsigned char key) {
+    int lo = 0, hi = node->nchildren;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(node->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct trie_node *get_child(struct trie_node *node, unsigned char key) {
+    int i = find_child(node, key);
+    if(i < node->nchildren && node->keys[i] == key)
+        return node->children[i];
+    return NULL;
+}
+
+static struct trie_node *add_child(struct trie_node *node, unsigned char key) {
+    int i = find_child(node, key);
+    if(i < node->nchildren && node->keys[i] == key)
+        return node->children[i];
+
+    node->keys = index_realloc(node->keys, node->nchildren + 1, 1);
+    node->children = index_realloc(node->children, node->nchildren + 1, sizeof(struct trie_node *));
+    memmove(node->keys + i + 1, node->keys + i, node->nchildren - i);
+    memmove(node->children + i + 1, node->children + i, (node->nchildren - i) * sizeof(struct trie_node *));
+    node->keys[i] = key;
+    node->children[i] = calloc(1, sizeof(struct trie_node));
+    if(node->children[i] == NULL) {
+        perror("calloc");
+        abort();
+    }
+    node->nchildren++;
+    return node->children[i];
+}
+
+struct rule_index *rule_index_new() {
+    struct rule_index *index = calloc(1, sizeof(struct rule_index));
+    if(index == NULL) {
+        perror("calloc");
+        abort();
+    }
+    return index;
+}
+
+static void free_node(struct trie_node *node) {
+    for(int i = 0; i < node->nchildren; i++) {
+        free_node(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->keys);
+    free(node->children);
+    free(node->rules);
+}
+
+void rule_index_free(struct rule_index *index) {
+    struct exact_entry *entry, *next;
+
+    if(index == NULL)
+        return;
+    free_node(&index->root);
+    free(index->any);
+    for(size_t i = 0; i < index->exact_cap; i++) {
+        for(entry = index->exact[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->path);
+            free(entry->rules);
+            free(entry);
+        }
+    }
+    free(index->exact);
+    free(index);
+}
+
+void rule_index_add(struct rule_index *index, int rule, const char *prefix, size_t len) {
+    struct trie_node *node = &index->root;
+
+    if(len == 0) {
+        rule_index_add_any(index, rule);
+        return;
+    }
+
+    for(size_t i = 0; i < len; i++)
+        node = add_child(node, (unsigned char)prefix[i]);
+    append_rule(&node->rules, &node->nrules, rule);
+}
+
+void rule_index_add_any(struct rule_index *index, int rule) {
+    append_rule(&index->any, &index->nany, rule);
+}
+
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for(size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+    return h;
+}
+
+static void grow_exact(struct rule_index *index) {
+    size_t cap = index->exact_cap ? index->exact_cap * 2 : 64;
+    struct exact_entry **table = calloc(cap, sizeof(struct exact_entry *));
+    struct exact_entry *entry, *next;
+
+    if(table == NULL) {
+        perror("calloc");
+        abort();
+    }
+    for(size_t i = 0; i < index->exact_cap; i++) {
+        for(entry = index->exact[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            entry->next = table[entry->hash % cap];
+            table[entry->hash % cap] = entry;
+        }
+    }
+    free(index->exact);
+    index->exact = table;
+    index->exact_cap = cap;
+}
+
+static struct exact_entry *find_exact(struct rule_index *index, const char *path, size_t len, uint64_t hash) {
+    struct exact_entry *entry;
+
+    for(entry = index->exact[hash % index->exact_cap]; entry != NULL; entry = entry->next) {
+        if(entry->hash == hash && entry->len == len && !memcmp(entry->path, path, len))
+            return entry;
+    }
+    return NULL;
+}
+
+void rule_index_add_exact(struct rule_index *index, int rule, const char *path, size_t len) {
+    uint64_t hash = hash_path(path, len);
+    struct exact_entry *entry;
+
+    if(index->nexact >= index->exact_cap)
+        grow_exact(index);
+    entry = find_exact(index, path, len, hash);
+    if(entry == NULL) {
+        entry = calloc(1, sizeof(struct exact_entry));
+        if(entry == NULL || (entry->path = strndup(path, len)) == NULL) {
+            perror("calloc");
+            abort();
+        }
+        entry->len = len;
+        entry->hash = hash;
+        entry->next = index->exact[hash % index->exact_cap];
+        index->exact[hash % index->exact_cap] = entry;
+        index->nexact++;
+    }
+    append_rule(&entry->rules, &entry->nrules, rule);
+}
+
+static void merge_node(struct trie_node *node, const struct trie_node *from, int offset) {
+    for(int i = 0; i < from->nrules; i++)
+        append_rule(&node->rules, &node->nrules, from->rules[i] + offset);
+    for(int i = 0; i < from->nchildren; i++)
+        merge_node(add_child(node, from->keys[i]), from->children[i], offset);
+}
+
+void rule_index_merge(struct rule_index *index, const struct rule_index *from, int offset) {
+    struct exact_entry *entry;
+
+    merge_node(&index->root, &from->root, offset);
+    for(int i = 0; i < from->nany; i++)
+        rule_index_add_any(index, from->any[i] + offset);
+    for(size_t i = 0; i < from->exact_cap; i++) {
+        for(entry = from->exact[i]; entry != NULL; entry = entry->next) {
+            for(int j = 0; j < entry->nrules; j++)
+                rule_index_add_exact(index, entry->rules[j] + offset, entry->path, entry->len);
+        }
+    }
+}
+
+static int add_list(struct candidates *candidates, const int *rules, int nrules) {
+    if(nrules == 0)
+        return 0;
+
+    if(candidates->nlists == candidates->cap) {
+        int cap = candidates->cap ? candidates->cap * 2 : 8;
+        struct rule_list *lists = reallocarray(candidates->lists, cap, sizeof(struct rule_list));
+        if(lists == NULL)
+            return -1;
+        candidates->lists = lists;
+        int *pos = reallocarray(candidates->pos, cap, sizeof(int));
+        if(pos == NULL)
+            return -1;
+        candidates->pos = pos;
+        candidates->cap = cap;
+    }
+
+    candidates->lists[candidates->nlists].rules = rules;
+    candidates->lists[candidates->nlists].nrules = nrules;
+    candidates->pos[candidates->nlists] = 0;
+    candidates->nlists++;
+    return 0;
+}
+
+int rule_index_lookup(struct rule_index *index, const char *path, struct candidates *candidates) {
+    struct trie_node *node = &index->root;
+    struct exact_entry *entry;
+    size_t len;
+
+    candidates->nlists = 0;
+    if(add_list(candidates, index->any, index->nany) == -1)
+        return -1;
+
+    if(index->nexact > 0) {
+        len = strlen(path);
+        entry = find_exact(index, path, len, hash_path(path, len));
+        if(entry != NULL && add_list(candidates, entry->rules, entry->nrules) == -1)
+            return -1;
+    }
+
+    for(; *path && (node = get_child(node, (unsigned char)*path)) != NULL; path++) {
+        if(add_list(candidates, node->rules, node->nrules) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int candidates_next(struct candidates *candidates) {
+    int best = -1;
+
+    /* There are only a few lists, a linear scan is enough */
+    for(int i = 0; i < candidates->nlists; i++) {
+        if(candidates->pos[i] < candidates->lists[i].nrules) {
+            int rule = candidates->lists[i].rules[candidates->pos[i]];
+            if(best == -1 || rule < best)
+                best = rule;
+        }
+    }
+
+    for(int i = 0; i < candidates->nlists; i++) {
+        if(candidates->pos[i] < candidates->lists[i].nrules &&
+           candidates->lists[i].rules[candidates->pos[i]] == best)
+            candidates->pos[i]++;
+    }
+
+    return best;
+}
+
+void candidates_free(struct candidates *candidates) {
+    free(candidates->lists);
+    free(candidates->pos);
+    candidates->lists = NULL;
+    candidates->pos = NULL;
+    candidates->nlists = candidates->cap = 0;
+}
@@ -0,0 +1,40 @@
+#include <stddef.h>
+
+/*
+ * Dispatch index for rule selection.
+ *
+ * Rules are identified by their position in their context. Each rule is
+ * registered with the literal prefixes one of which a path must start with
+ * to possibly match it, with the only path it can match, or with no prefix
+ * at all if it may match anything. A lookup gives the candidate rules for a
+ * path, in rule order.
+ */
+struct rule_index;
+
+struct rule_list {
+    const int *rules;
+    int nrules;
+};
+
+/* Candidate rules for a path, as a set of sorted lists to be merged */
+struct candidates {
+    struct rule_list *lists;
+    int *pos;
+    int nlists, cap;
+};
+
+struct rule_index *rule_index_new();
+void rule_index_free(struct rule_index *index);
+/* Rules must be added in increasing order */
+void rule_index_add(struct rule_index *index, int rule, const char *prefix, size_t len);
+void rule_index_add_any(struct rule_index *index, int rule);
+void rule_index_add_exact(struct rule_index *index, int rule, const char *path, size_t len);
+/* Add every rule of from, numbered from offset, which must be greater than
+ * the rules already in index */
+void rule_index_merge(struct rule_index *index, const struct rule_index *from, int offset);
+
+/* Return -1 on allocation failure */
+int rule_index_lookup(struct rule_index *index, const char *path, struct candidates *candidates);
+/* Next candidate in rule order, -1 when exhausted */
+int candidates_next(struct candidates *candidates);
+void candidates_free(struct candidates *candidates);
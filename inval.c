@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "inval.h"
+
+/* Expired virtual paths are swept at most once a second */
+#define SWEEP_INTERVAL 1000000000L
+
+/* Virtual path, with when it was last looked up */
+struct vpath {
+    char *path;
+    long seen;
+};
+
+/* Virtual paths rewritten to a source path. Its identity is recorded too, so
+ * that it can be dropped if the rules change. */
+struct alias {
+    struct alias *hnext;
+    char *rpath;
+    struct vpath *vpaths;
+    int nvpaths;
+};
+
+/* Virtual path looked up with the previous rules, for inval_remap() */
+struct mapping {
+    char *vpath;
+    char *rpath;
+};
+
+struct pending {
+    struct pending *next;
+    char vpath[];
+};
+
+struct open_file {
+    char *vpath;
+    char *rpath;
+};
+
+static struct {
+    int running;
+    void (*notify)(const char *vpath);
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    struct alias **buckets;
+    size_t nbuckets, size;
+    long timeout; /* after which the kernel dropped a virtual path */
+    long next_sweep;
+    struct open_file *files; /* by fd */
+    int nfiles;
+
+    pthread_cond_t cond;
+    struct pending *head, *tail;
+    int stop;
+} inval = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static size_t hash_path(const char *path) {
+    size_t h = 5381;
+    while(*path)
+        h = h * 33 + (unsigned char)*path++;
+    return h;
+}
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int expired(const struct vpath *v, long now) {
+    return now - v->seen > inval.timeout;
+}
+
+static void drop_vpath(struct alias *a, int i) {
+    free(a->vpaths[i].path);
+    a->vpaths[i] = a->vpaths[--a->nvpaths];
+}
+
+static void free_alias(struct alias *a) {
+    for(int i = 0; i < a->nvpaths; i++)
+        free(a->vpaths[i].path);
+    free(a->vpaths);
+    free(a->rpath);
+    free(a);
+}
+
+/* Forget the virtual paths the kernel no longer caches, and the source paths
+ * left without any */
+static void sweep(long now) {
+    struct alias **pa, *a;
+
+    for(size_t b = 0; b < inval.nbuckets; b++) {
+        for(pa = &inval.buckets[b]; (a = *pa) != NULL;) {
+            for(int i = 0; i < a->nvpaths; i++) {
+                if(expired(&a->vpaths[i], now))
+                    drop_vpath(a, i--);
+            }
+            if(a->nvpaths > 0) {
+                pa = &a->hnext;
+                continue;
+            }
+            *pa = a->hnext;
+            free_alias(a);
+            inval.size--;
+        }
+    }
+}
+
+static struct alias *find_alias(const char *rpath) {
+    struct alias *a;
+
+    if(inval.nbuckets == 0)
+        return NULL;
+    for(a = inval.buckets[hash_path(rpath) % inval.nbuckets]; a; a = a->hnext) {
+        if(!strcmp(a->rpath, rpath))
+            return a;
+    }
+    return NULL;
+}
+
+static struct alias *add_alias(const char *rpath) {
+    struct alias *a;
+    size_t b;
+
+    if(inval.size >= inval.nbuckets) {
+        size_t nbuckets = inval.nbuckets ? inval.nbuckets * 2 : 256;
+        struct alias **buckets = calloc(nbuckets, sizeof(struct alias *));
+        if(buckets == NULL)
+            return NULL;
+        for(size_t i = 0; i < inval.nbuckets; i++) {
+            struct alias *next;
+            for(a = inval.buckets[i]; a; a = next) {
+                next = a->hnext;
+                b = hash_path(a->rpath) % nbuckets;
+                a->hnext = buckets[b];
+                buckets[b] = a;
+            }
+        }
+        free(inval.buckets);
+        inval.buckets = buckets;
+        inval.nbuckets = nbuckets;
+    }
+
+    a = calloc(1, sizeof(struct alias));
+    if(a == NULL || (a->rpath = strdup(rpath)) == NULL) {
+        free(a);
+        return NULL;
+    }
+    b = hash_path(rpath) % inval.nbuckets;
+    a->hnext = inval.buckets[b];
+    inval.buckets[b] = a;
+    inval.size++;
+    return a;
+}
+
+/* "." is the root of the source directory, anything else is relative to it */
+static int is_identity(const char *vpath, const char *rpath) {
+    if(!strcmp(rpath, "."))
+        return !strcmp(vpath, "/");
+    return !strcmp(vpath + 1, rpath);
+}
+
+void inval_record(const char *vpath, const char *rpath) {
+    long now = now_ns();
+    struct alias *a;
+    struct vpath *vpaths;
+
+    if(!inval.running)
+        return;
+
+    pthread_mutex_lock(&inval.lock);
+    /* Each path is kept between one and two timeouts after its last lookup */
+    if(now >= inval.next_sweep) {
+        sweep(now);
+        inval.next_sweep = now + (inval.timeout > SWEEP_INTERVAL ? inval.timeout : SWEEP_INTERVAL);
+    }
+    a = find_alias(rpath);
+    if(a == NULL)
+        a = add_alias(rpath);
+    if(a == NULL)
+        goto out;
+    for(int i = 0; i < a->nvpaths; i++) {
+        if(!strcmp(a->vpaths[i].path, vpath)) {
+            a->vpaths[i].seen = now;
+            goto out;
+        }
+    }
+    vpaths = reallocarray(a->vpaths, a->nvpaths + 1, sizeof(struct vpath));
+    if(vpaths == NULL)
+        goto out;
+    a->vpaths = vpaths;
+    a->vpaths[a->nvpaths].seen = now;
+    if((a->vpaths[a->nvpaths].path = strdup(vpath)) != NULL)
+        a->nvpaths++;
+out:
+    pthread_mutex_unlock(&inval.lock);
+}
+
+/* Called with inval.lock held */
+static void queue(const char *vpath, size_t len) {
+    struct pending *p = malloc(sizeof(struct pending) + len + 1);
+
+    if(p == NULL)
+        return;
+    memcpy(p->vpath, vpath, len);
+    p->vpath[len] = '\0';
+    p->next = NULL;
+    if(inval.tail)
+        inval.tail->next = p;
+    else
+        inval.head = p;
+    inval.tail = p;
+}
+
+/* Drop the entry of vpath and the attributes of its parent directory */
+static void queue_alias(const char *vpath) {
+    const char *slash = strrchr(vpath, '/');
+
+    if(!strcmp(vpath, "/"))
+        return;
+    queue(vpath, strlen(vpath));
+    if(slash == vpath)
+        queue("/", 1);
+    else
+        queue(vpath, slash - vpath);
+}
+
+void inval_mutated(const char *vpath, const char *rpath) {
+    long now = now_ns();
+    struct alias *a;
+    char *identity;
+
+    if(!inval.running)
+        return;
+
+    if(!strcmp(rpath, "."))
+        identity = strdup("/");
+    else if(asprintf(&identity, "/%s", rpath) == -1)
+        identity = NULL;
+
+    pthread_mutex_lock(&inval.lock);
+    if(identity && (vpath == NULL || strcmp(identity, vpath)))
+        queue_alias(identity);
+    a = find_alias(rpath);
+    for(int i = 0; a && i < a->nvpaths; i++) {
+        if(is_identity(a->vpaths[i].path, rpath) || expired(&a->vpaths[i], now))
+            continue;
+        if(vpath == NULL || strcmp(a->vpaths[i].path, vpath))
+            queue_alias(a->vpaths[i].path);
+    }
+    if(inval.head)
+        pthread_cond_signal(&inval.cond);
+    pthread_mutex_unlock(&inval.lock);
+
+    free(identity);
+}
+
+/* Copy of every recorded virtual path, so that they are rewritten without
+ * blocking lookups */
+static struct mapping *copy_mappings(size_t *n) {
+    struct mapping *mappings;
+    struct alias *a;
+    size_t count = 0;
+
+    pthread_mutex_lock(&inval.lock);
+    for(size_t b = 0; b < inval.nbuckets; b++) {
+        for(a = inval.buckets[b]; a; a = a->hnext)
+            count += a->nvpaths;
+    }
+    mappings = calloc(count ? count : 1, sizeof(struct mapping));
+    *n = 0;
+    for(size_t b = 0; mappings && b < inval.nbuckets; b++) {
+        for(a = inval.buckets[b]; a; a = a->hnext) {
+            for(int i = 0; i < a->nvpaths; i++) {
+                mappings[*n].vpath = strdup(a->vpaths[i].path);
+                mappings[*n].rpath = strdup(a->rpath);
+                (*n)++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&inval.lock);
+
+    return mappings;
+}
+
+void inval_remap(char *(*rewrite)(const char *vpath)) {
+    struct mapping *mappings;
+    struct alias *a;
+    size_t n;
+    char *rpath;
+
+    if(!inval.running)
+        return;
+
+    mappings = copy_mappings(&n);
+    if(mappings == NULL)
+        return;
+    for(size_t i = 0; i < n; i++) {
+        if(mappings[i].vpath == NULL || mappings[i].rpath == NULL)
+            continue;
+        rpath = rewrite(mappings[i].vpath);
+        if(rpath && !strcmp(rpath, mappings[i].rpath)) {
+            free(mappings[i].vpath);
+            mappings[i].vpath = NULL;
+        }
+        free(rpath);
+    }
+
+    pthread_mutex_lock(&inval.lock);
+    for(size_t i = 0; i < n; i++) {
+        if(mappings[i].vpath == NULL || mappings[i].rpath == NULL)
+            continue;
+        /* Recorded again by the next lookup */
+        queue_alias(mappings[i].vpath);
+        a = find_alias(mappings[i].rpath);
+        for(int j = 0; a && j < a->nvpaths; j++) {
+            if(!strcmp(a->vpaths[j].path, mappings[i].vpath)) {
+                drop_vpath(a, j);
+                break;
+            }
+        }
+    }
+    if(inval.head)
+        pthread_cond_signal(&inval.cond);
+    pthread_mutex_unlock(&inval.lock);
+
+    for(size_t i = 0; i < n; i++) {
+        free(mappings[i].vpath);
+        free(mappings[i].rpath);
+    }
+    free(mappings);
+}
+
+void inval_open(int fd, int flags, const char *vpath, const char *rpath) {
+    if(!inval.running || (flags & O_ACCMODE) == O_RDONLY)
+        return;
+
+    pthread_mutex_lock(&inval.lock);
+    if(fd >= inval.nfiles) {
+        int nfiles = fd < 64 ? 128 : fd * 2;
+        struct open_file *files = reallocarray(inval.files, nfiles, sizeof(struct open_file));
+        if(files == NULL)
+            goto out;
+        memset(files + inval.nfiles, 0, (nfiles - inval.nfiles) * sizeof(struct open_file));
+        inval.files = files;
+        inval.nfiles = nfiles;
+    }
+    free(inval.files[fd].vpath);
+    free(inval.files[fd].rpath);
+    inval.files[fd].vpath = strdup(vpath);
+    inval.files[fd].rpath = strdup(rpath);
+out:
+    pthread_mutex_unlock(&inval.lock);
+}
+
+void inval_release(int fd) {
+    struct open_file file = { NULL, NULL };
+
+    if(!inval.running)
+        return;
+
+    pthread_mutex_lock(&inval.lock);
+    if(fd < inval.nfiles) {
+        file = inval.files[fd];
+        inval.files[fd].vpath = inval.files[fd].rpath = NULL;
+    }
+    pthread_mutex_unlock(&inval.lock);
+
+    if(file.vpath && file.rpath)
+        inval_mutated(file.vpath, file.rpath);
+    free(file.vpath);
+    free(file.rpath);
+}
+
+static void *worker(void *arg) {
+    struct pending *p;
+
+    (void)arg;
+    pthread_mutex_lock(&inval.lock);
+    while(!inval.stop) {
+        if(inval.head == NULL) {
+            pthread_cond_wait(&inval.cond, &inval.lock);
+            continue;
+        }
+        p = inval.head;
+        inval.head = p->next;
+        if(inval.head == NULL)
+            inval.tail = NULL;
+
+        pthread_mutex_unlock(&inval.lock);
+        inval.notify(p->vpath);
+        free(p);
+        pthread_mutex_lock(&inval.lock);
+    }
+    pthread_mutex_unlock(&inval.lock);
+
+    return NULL;
+}
+
+void inval_start(void (*notify)(const char *vpath), double timeout) {
+    inval.notify = notify;
+    inval.timeout = timeout * 1000000000L;
+    inval.next_sweep = now_ns();
+    if(pthread_create(&inval.thread, NULL, worker, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    inval.running = 1;
+}
+
+void inval_stop() {
+    struct pending *p;
+
+    if(!inval.running)
+        return;
+
+    pthread_mutex_lock(&inval.lock);
+    inval.stop = 1;
+    pthread_cond_signal(&inval.cond);
+    pthread_mutex_unlock(&inval.lock);
+    pthread_join(inval.thread, NULL);
+    inval.running = 0;
+
+    while((p = inval.head) != NULL) {
+        inval.head = p->next;
+        free(p);
+    }
+    inval.tail = NULL;
+    for(size_t i = 0; i < inval.nbuckets; i++) {
+        struct alias *a, *next;
+        for(a = inval.buckets[i]; a; a = next) {
+            next = a->hnext;
+            free_alias(a);
+        }
+    }
+    free(inval.buckets);
+    inval.buckets = NULL;
+    inval.nbuckets = inval.size = 0;
+    for(int i = 0; i < inval.nfiles; i++) {
+        free(inval.files[i].vpath);
+        free(inval.files[i].rpath);
+    }
+    free(inval.files);
+    inval.files = NULL;
+    inval.nfiles = 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Invalidation of the kernel caches.
+ *
+ * When entry and attribute timeouts are enabled, the kernel keeps the result
+ * of lookups. A file of the source directory can be reachable under several
+ * virtual paths: its own and every path rewritten to it. A mutation through
+ * one of them must invalidate the others, so virtual paths are recorded by
+ * source path as they are looked up.
+ *
+ * Invalidations are sent from a worker thread, since the kernel doesn't
+ * accept them while a related operation is in progress.
+ */
+
+/* notify is called from the worker thread for every virtual path to drop.
+ * Virtual paths are forgotten timeout seconds after their last lookup, once
+ * the kernel dropped them too. */
+void inval_start(void (*notify)(const char *vpath), double timeout);
+void inval_stop();
+
+/* vpath was looked up and rewritten to rpath (relative to the source directory) */
+void inval_record(const char *vpath, const char *rpath);
+/* rpath was modified through vpath (NULL if by rewritefs itself) */
+void inval_mutated(const char *vpath, const char *rpath);
+/* The rules changed: drop the virtual paths that rewrite() no longer maps to
+ * the same source path */
+void inval_remap(char *(*rewrite)(const char *vpath));
+
+/* File descriptors opened for writing, the aliases of their file are
+ * invalidated when they are released */
+void inval_open(int fd, int flags, const char *vpath, const char *rpath);
+void inval_release(int fd);
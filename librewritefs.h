@@ -0,0 +1,82 @@
+/*
+ * Rewrite engine.
+ *
+ * An engine holds the rules of a configuration file and rewrites paths with
+ * them on behalf of a caller, from any number of threads. It needs neither
+ * FUSE nor a mount point: rewritefs, rewritefs-replay, rewritefs-resolve and
+ * the benchmark all use it. Link with librewritefs.a, PCRE2 and pthreads.
+ *
+ * Paths are absolute, as seen in the mount point. Rewritten paths are
+ * relative to the source directory.
+ */
+#ifndef LIBREWRITEFS_H
+#define LIBREWRITEFS_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct rewrite_engine;
+
+struct rewrite_engine_options {
+    const char *config_file; /* NULL to rewrite nothing */
+    const char *compiled_config; /* NULL to always parse the configuration */
+    int cache_size; /* rewritten paths cached, 0 for none */
+    int cmdline_cache_size; /* callers cached, 0 for none */
+    int verbose; /* level of the debug output, shared by every engine */
+};
+
+/* Process on behalf of which a path is rewritten */
+struct rewrite_caller {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+    mode_t umask;
+    /* Command line matched by the contexts, with spaces between the
+     * arguments. NULL to read the one of pid. */
+    const char *cmdline;
+};
+
+/* Storage of a rewritten path, usually on the stack of the caller */
+struct rewrite_buf {
+    char *heap; /* when it doesn't fit in data */
+    char data[PATH_MAX];
+};
+
+/* Options of rewritefs without any -o */
+void rewrite_engine_defaults(struct rewrite_engine_options *opts);
+/* Load the configuration file. NULL if it can't be read or is invalid, with
+ * the reason on stderr. */
+struct rewrite_engine *rewrite_engine_new(const struct rewrite_engine_options *opts);
+/* No other thread may use engine anymore */
+void rewrite_engine_free(struct rewrite_engine *engine);
+/* Load the configuration file again. Paths being rewritten meanwhile use
+ * the previous rules. Return 0 on success, -1 if the configuration is
+ * invalid and 1 if it has contexts and allow_contexts is 0, keeping the
+ * previous rules. */
+int rewrite_engine_reload(struct rewrite_engine *engine, int allow_contexts);
+
+/* Rewritten path of path, which points into path itself when it is not
+ * rewritten, or into buf. NULL on allocation failure. It is valid until
+ * rewrite_buf_free(buf), which must be called if it is not NULL. Without
+ * caller, contexts don't match and the result is not cached. */
+const char *rewrite_engine_into(struct rewrite_engine *engine, const char *path,
+                                const struct rewrite_caller *caller, struct rewrite_buf *buf);
+/* Rewrite the n paths into res and bufs, as rewrite_engine_into(), with the
+ * contexts of caller looked up once. Return -1 on allocation failure, with
+ * no buffer to free. */
+int rewrite_engine_batch(struct rewrite_engine *engine, const struct rewrite_caller *caller,
+                         const char *const *paths, const char **res, struct rewrite_buf *bufs, size_t n);
+void rewrite_buf_free(struct rewrite_buf *buf);
+/* Rewritten path of path for no caller in particular, in a string to free */
+char *rewrite_engine_dry(struct rewrite_engine *engine, const char *path);
+
+/* Whether the rewriting of a path depends on its caller */
+int rewrite_engine_has_contexts(struct rewrite_engine *engine);
+/* Evaluation count, match count and matching time of every context and rule,
+ * in the order of the configuration file. Only counted by rewritefs with
+ * -o stats. */
+void rewrite_engine_print_rules(struct rewrite_engine *engine, FILE *out);
+
+#endif
@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "negcache.h"
+
+#define WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* Paths of a watched directory, several if it is reached through symlinks.
+ * It is watched as long as a missing path needs it. */
+struct watch {
+    char **dirs;
+    int ndirs;
+    int refs; /* missing paths */
+    unsigned gen; /* incremented when the watch is removed */
+};
+
+/* Watches a missing path needs: its deepest existing directory and the
+ * ancestors of this one, any of which could be moved or removed */
+struct missing {
+    int nwatches;
+    struct {
+        int wd;
+        unsigned gen;
+    } watches[];
+};
+
+static struct {
+    int root;
+    struct cache *missing; /* struct missing by path */
+    struct cache *watched; /* watch descriptor + 1 by directory, to skip inotify_add_watch() */
+    int inotify_fd;
+    int stop_pipe[2];
+    pthread_t thread;
+
+    pthread_mutex_t lock; /* taken when dropping a missing path, never held then */
+    struct watch *watches; /* by watch descriptor */
+    int nwatches;
+    /* Incremented before every removal */
+    unsigned long generation;
+} neg = { .root = -1, .inotify_fd = -1, .stop_pipe = { -1, -1 }, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int drop(void *value, void *arg) {
+    (void)value;
+    (void)arg;
+    return 1;
+}
+
+static void forget(const char *rpath, size_t len) {
+    __atomic_add_fetch(&neg.generation, 1, __ATOMIC_SEQ_CST);
+    cache_get(neg.missing, rpath, len, drop, NULL);
+}
+
+static void forget_all() {
+    __atomic_add_fetch(&neg.generation, 1, __ATOMIC_SEQ_CST);
+    cache_flush(neg.missing);
+}
+
+/* Length of the parent directory of the first len characters of rpath, 0
+ * for the source directory */
+static size_t parent_len(const char *rpath, size_t len) {
+    const char *slash = memrchr(rpath, '/', len);
+    return slash ? (size_t)(slash - rpath) : 0;
+}
+
+/* Only paths made of plain names have a single spelling */
+static int plain_path(const char *rpath) {
+    const char *p = rpath, *end;
+
+    for(;;) {
+        end = strchrnul(p, '/');
+        if(end == p || (end - p == 1 && p[0] == '.') || (end - p == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        if(*end == '\0')
+            return 1;
+        p = end + 1;
+    }
+}
+
+static void clear_dirs(struct watch *watch) {
+    for(int i = 0; i < watch->ndirs; i++)
+        free(watch->dirs[i]);
+    free(watch->dirs);
+    watch->dirs = NULL;
+    watch->ndirs = 0;
+}
+
+static int has_dir(struct watch *watch, const char *dir, size_t len) {
+    for(int i = 0; i < watch->ndirs; i++) {
+        if(strlen(watch->dirs[i]) == len && !memcmp(watch->dirs[i], dir, len))
+            return 1;
+    }
+    return 0;
+}
+
+static void add_dir(struct watch *watch, const char *dir, size_t len) {
+    char **dirs;
+
+    if(has_dir(watch, dir, len))
+        return;
+    dirs = reallocarray(watch->dirs, watch->ndirs + 1, sizeof(char *));
+    if(dirs == NULL)
+        return;
+    watch->dirs = dirs;
+    if((watch->dirs[watch->ndirs] = strndup(dir, len)) != NULL)
+        watch->ndirs++;
+}
+
+static int copy_wd(void *value, void *arg) {
+    *(int *)arg = (intptr_t)value - 1;
+    return 0;
+}
+
+/* Watch the first len characters of rpath for new entries, on behalf of
+ * missing. Return -1 and set errno on failure. The watch is added with the
+ * lock held, so that it can't be removed meanwhile by release(). */
+static int watch_dir(const char *rpath, size_t len, struct missing *missing) {
+    char path[PATH_MAX];
+    struct watch *watches;
+    int wd, res = -1;
+
+    pthread_mutex_lock(&neg.lock);
+    /* Unless it was removed since */
+    if(cache_get(neg.watched, rpath, len, copy_wd, &wd) && wd < neg.nwatches &&
+       neg.watches[wd].refs > 0 && has_dir(&neg.watches[wd], rpath, len))
+        goto hold;
+
+    /* The source directory may be hidden by the mount point */
+    if(len == 0)
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", neg.root);
+    else if(snprintf(path, sizeof(path), "/proc/self/fd/%d/%.*s", neg.root, (int)len, rpath) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+    wd = inotify_add_watch(neg.inotify_fd, path, WATCH_MASK);
+    if(wd == -1)
+        goto out;
+
+    if(wd >= neg.nwatches) {
+        watches = reallocarray(neg.watches, wd + 1, sizeof(struct watch));
+        if(watches == NULL) {
+            if(neg.nwatches <= wd || neg.watches[wd].refs == 0)
+                inotify_rm_watch(neg.inotify_fd, wd);
+            errno = ENOMEM;
+            goto out;
+        }
+        memset(watches + neg.nwatches, 0, (wd + 1 - neg.nwatches) * sizeof(struct watch));
+        neg.watches = watches;
+        neg.nwatches = wd + 1;
+    }
+    add_dir(&neg.watches[wd], rpath, len);
+    cache_put(neg.watched, rpath, len, (void *)(intptr_t)(wd + 1));
+
+hold:
+    neg.watches[wd].refs++;
+    missing->watches[missing->nwatches].wd = wd;
+    missing->watches[missing->nwatches].gen = neg.watches[wd].gen;
+    missing->nwatches++;
+    res = 0;
+out:
+    pthread_mutex_unlock(&neg.lock);
+    return res;
+}
+
+/* Free a missing path, and remove the watches no other one needs */
+static void release(void *value) {
+    struct missing *missing = value;
+    struct watch *watch;
+
+    pthread_mutex_lock(&neg.lock);
+    for(int i = 0; i < missing->nwatches; i++) {
+        watch = &neg.watches[missing->watches[i].wd];
+        if(watch->gen != missing->watches[i].gen || --watch->refs > 0)
+            continue;
+        inotify_rm_watch(neg.inotify_fd, missing->watches[i].wd);
+        clear_dirs(watch);
+        watch->gen++;
+    }
+    pthread_mutex_unlock(&neg.lock);
+    free(missing);
+}
+
+/* The watch wd was removed by the kernel. Return 0 if it was already
+ * released, once no missing path needed it. */
+static int unwatch(int wd) {
+    int live = 0;
+
+    pthread_mutex_lock(&neg.lock);
+    if(wd < neg.nwatches && neg.watches[wd].refs > 0) {
+        clear_dirs(&neg.watches[wd]);
+        neg.watches[wd].refs = 0;
+        neg.watches[wd].gen++;
+        live = 1;
+    }
+    pthread_mutex_unlock(&neg.lock);
+    if(live)
+        cache_flush(neg.watched);
+    return live;
+}
+
+/* name was created in the directory watched as wd. Return 1 if it is a
+ * symbolic link, which may bring files with it like a directory. */
+static int entry_created(int wd, const char *name) {
+    char **rpaths = NULL;
+    int n = 0, failed = 0, link = 0;
+    struct stat st;
+
+    /* Forgotten once unlocked, since dropping them takes the lock */
+    pthread_mutex_lock(&neg.lock);
+    if(wd < neg.nwatches && neg.watches[wd].ndirs > 0) {
+        rpaths = calloc(neg.watches[wd].ndirs, sizeof(char *));
+        failed = rpaths == NULL;
+        for(int i = 0; rpaths && i < neg.watches[wd].ndirs; i++) {
+            if(neg.watches[wd].dirs[i][0] == '\0')
+                rpaths[n] = strdup(name);
+            else if(asprintf(&rpaths[n], "%s/%s", neg.watches[wd].dirs[i], name) == -1)
+                rpaths[n] = NULL;
+            if(rpaths[n] != NULL)
+                n++;
+            else
+                failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&neg.lock);
+
+    /* Without memory, forget everything */
+    if(failed)
+        forget_all();
+    if(n > 0 && fstatat(neg.root, rpaths[0], &st, AT_SYMLINK_NOFOLLOW) == 0)
+        link = S_ISLNK(st.st_mode);
+    for(int i = 0; i < n; i++) {
+        forget(rpaths[i], strlen(rpaths[i]));
+        free(rpaths[i]);
+    }
+    free(rpaths);
+    return link;
+}
+
+static void *watch_thread(void *arg) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct pollfd fds[2];
+    ssize_t len;
+
+    (void)arg;
+    fds[0].fd = neg.inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = neg.stop_pipe[0];
+    fds[1].events = POLLIN;
+
+    for(;;) {
+        if(poll(fds, 2, -1) == -1) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(fds[1].revents)
+            break;
+
+        len = read(neg.inotify_fd, buf, sizeof(buf));
+        if(len <= 0)
+            continue;
+        for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if(event->mask & IN_Q_OVERFLOW) {
+                forget_all();
+            } else if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                /* Its paths, and those of the directories under it, are no
+                 * longer right */
+                if(event->mask & IN_MOVE_SELF)
+                    inotify_rm_watch(neg.inotify_fd, event->wd);
+                if(unwatch(event->wd))
+                    forget_all();
+            } else if(event->len > 0) {
+                /* It may have brought files with it */
+                if(entry_created(event->wd, event->name) || (event->mask & IN_ISDIR))
+                    forget_all();
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int negcache_start(int root, int size) {
+    int err;
+
+    neg.root = root;
+    if(size <= 0)
+        return 0;
+
+    neg.inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if(neg.inotify_fd == -1)
+        return -1;
+    if(pipe2(neg.stop_pipe, O_CLOEXEC) == -1)
+        goto fail;
+    neg.missing = cache_new(size, release);
+    neg.watched = cache_new(size, NULL);
+    err = pthread_create(&neg.thread, NULL, watch_thread, NULL);
+    if(err != 0) {
+        cache_free(neg.missing);
+        cache_free(neg.watched);
+        neg.missing = neg.watched = NULL;
+        errno = err;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    close(neg.inotify_fd);
+    if(neg.stop_pipe[0] != -1) {
+        close(neg.stop_pipe[0]);
+        close(neg.stop_pipe[1]);
+    }
+    neg.inotify_fd = neg.stop_pipe[0] = neg.stop_pipe[1] = -1;
+    errno = err;
+    return -1;
+}
+
+void negcache_stop() {
+    if(neg.missing == NULL)
+        return;
+
+    if(write(neg.stop_pipe[1], "", 1) == -1)
+        perror("negcache_stop");
+    pthread_join(neg.thread, NULL);
+    close(neg.stop_pipe[0]);
+    close(neg.stop_pipe[1]);
+
+    /* Releases the watches */
+    cache_free(neg.missing);
+    cache_free(neg.watched);
+    neg.missing = neg.watched = NULL;
+    close(neg.inotify_fd);
+    neg.inotify_fd = neg.stop_pipe[0] = neg.stop_pipe[1] = -1;
+
+    for(int wd = 0; wd < neg.nwatches; wd++)
+        clear_dirs(&neg.watches[wd]);
+    free(neg.watches);
+    neg.watches = NULL;
+    neg.nwatches = 0;
+}
+
+int negcache_missing(const char *rpath) {
+    if(neg.missing == NULL)
+        return 0;
+    return cache_get(neg.missing, rpath, strlen(rpath), NULL, NULL);
+}
+
+/* Remember rpath as missing, if it still is once its directory is watched */
+static void add(const char *rpath) {
+    size_t len = strlen(rpath), dir_len = len;
+    unsigned long generation;
+    struct missing *missing;
+    struct stat st;
+    int depth = 1;
+
+    for(const char *p = rpath; (p = strchr(p, '/')) != NULL; p++)
+        depth++;
+    missing = malloc(sizeof(struct missing) + depth * sizeof(missing->watches[0]));
+    if(missing == NULL)
+        return;
+    missing->nwatches = 0;
+
+    /* Watch the deepest existing directory, where the first missing
+     * component would be created */
+    for(;;) {
+        dir_len = parent_len(rpath, dir_len);
+        if(watch_dir(rpath, dir_len, missing) == 0)
+            break;
+        if(errno != ENOENT || dir_len == 0)
+            goto fail;
+    }
+    /* And its ancestors: moving or removing one of them moves or removes it,
+     * without any event for it */
+    while(dir_len > 0) {
+        dir_len = parent_len(rpath, dir_len);
+        if(watch_dir(rpath, dir_len, missing) == -1)
+            goto fail;
+    }
+
+    /* It may have been created before the watch */
+    generation = __atomic_load_n(&neg.generation, __ATOMIC_SEQ_CST);
+    if(fstatat(neg.root, rpath, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT)
+        goto fail;
+    cache_put(neg.missing, rpath, len, missing);
+    /* Or just after */
+    if(__atomic_load_n(&neg.generation, __ATOMIC_SEQ_CST) != generation)
+        forget(rpath, len);
+    return;
+
+fail:
+    release(missing);
+}
+
+void negcache_add(const char *rpath) {
+    int saved_errno = errno;
+
+    if(neg.missing && plain_path(rpath))
+        add(rpath);
+    errno = saved_errno;
+}
+
+void negcache_created(const char *rpath) {
+    size_t len = strlen(rpath);
+
+    if(neg.missing == NULL)
+        return;
+
+    /* Its parents may have been created too */
+    for(; len > 0; len = parent_len(rpath, len))
+        forget(rpath, len);
+}
+
+void negcache_flush() {
+    if(neg.missing)
+        forget_all();
+}
@@ -0,0 +1,26 @@
+/*
+ * Cache of missing files of the source directory.
+ *
+ * Programs probe many files that don't exist (fallback configuration
+ * locations, plugins, locales), over and over. Rewritten paths found missing
+ * are remembered until a file is created at them through rewritefs, or
+ * directly in the source directory: the deepest existing directory of each
+ * missing path and its ancestors are watched with inotify, until no missing
+ * path needs them. A path whose directories can't be watched is not
+ * remembered.
+ */
+
+/* Remember up to size missing paths of root (none if size is 0). Return -1
+ * and set errno if inotify is not available. */
+int negcache_start(int root, int size);
+void negcache_stop();
+
+/* Whether rpath, relative to root, is known to be missing */
+int negcache_missing(const char *rpath);
+/* rpath was just found missing. Keeps errno. */
+void negcache_add(const char *rpath);
+/* rpath was created, and possibly its parents */
+void negcache_created(const char *rpath);
+/* Something was renamed, or a symbolic link created: a directory may have
+ * brought files with it */
+void negcache_flush();
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "pagecache.h"
+
+/* What the pages of a file were cached from */
+struct version {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+/* A file opened through rewritefs */
+struct open_file {
+    char *vpath; /* NULL if the descriptor is not recorded */
+    struct version opened;
+    int writable;
+};
+
+static struct {
+    int writeback;
+    struct cache *files; /* version by virtual path */
+
+    pthread_mutex_t lock;
+    struct open_file *open; /* by file descriptor */
+    int nopen;
+} pc = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void get_version(const struct stat *st, struct version *v) {
+    memset(v, 0, sizeof(struct version));
+    v->dev = st->st_dev;
+    v->ino = st->st_ino;
+    v->size = st->st_size;
+    v->mtime = st->st_mtim;
+    v->ctime = st->st_ctim;
+}
+
+/* Drop the recorded version unless it is the current one (arg, NULL if
+ * unknown) */
+static int same_version(void *value, void *arg) {
+    return arg == NULL || memcmp(value, arg, sizeof(struct version)) != 0;
+}
+
+/* Current version of fd into cur. Return -1 if it is not a regular file. */
+static int current_version(int fd, struct version *cur) {
+    struct stat st;
+
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return -1;
+    get_version(&st, cur);
+    return 0;
+}
+
+static void remember(const char *vpath, const struct version *cur) {
+    struct version *v = malloc(sizeof(struct version));
+
+    if(v != NULL) {
+        *v = *cur;
+        cache_put(pc.files, vpath, strlen(vpath), v);
+    }
+}
+
+static void forget(const char *vpath) {
+    cache_get(pc.files, vpath, strlen(vpath), same_version, NULL);
+}
+
+/* Record the current version of vpath, open as fd, into cur. Return 1 if it
+ * was already recorded, -1 if it is not a regular file. */
+static int record(const char *vpath, int fd, struct version *cur) {
+    if(current_version(fd, cur) == -1) {
+        forget(vpath);
+        return -1;
+    }
+    if(cache_get(pc.files, vpath, strlen(vpath), same_version, cur))
+        return 1;
+    remember(vpath, cur);
+    return 0;
+}
+
+void pagecache_start(int size, int writeback) {
+    if(size <= 0)
+        return;
+    pc.files = cache_new(size, free);
+    pc.writeback = writeback;
+}
+
+void pagecache_stop() {
+    if(pc.files == NULL)
+        return;
+
+    cache_free(pc.files);
+    pc.files = NULL;
+    for(int fd = 0; fd < pc.nopen; fd++)
+        free(pc.open[fd].vpath);
+    free(pc.open);
+    pc.open = NULL;
+    pc.nopen = 0;
+}
+
+int pagecache_open_flags(int flags) {
+    if(!pc.writeback)
+        return flags;
+    if((flags & O_ACCMODE) == O_WRONLY)
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    return flags & ~O_APPEND;
+}
+
+int pagecache_write_only_flags(int flags) {
+    if(!pc.writeback || (flags & O_ACCMODE) != O_WRONLY)
+        return -1;
+    return flags & ~O_APPEND;
+}
+
+int pagecache_opened(const char *vpath, int fd, int flags) {
+    struct version cur;
+    char *path;
+    int keep;
+
+    if(pc.files == NULL)
+        return 0;
+
+    keep = record(vpath, fd, &cur);
+    if(keep == -1)
+        return 0;
+
+    /* Checked again when released */
+    path = strdup(vpath);
+    pthread_mutex_lock(&pc.lock);
+    if(fd >= pc.nopen) {
+        int nopen = fd < 64 ? 128 : fd * 2;
+        struct open_file *files = reallocarray(pc.open, nopen, sizeof(struct open_file));
+        if(files == NULL) {
+            pthread_mutex_unlock(&pc.lock);
+            free(path);
+            return keep;
+        }
+        memset(files + pc.nopen, 0, (nopen - pc.nopen) * sizeof(struct open_file));
+        pc.open = files;
+        pc.nopen = nopen;
+    }
+    free(pc.open[fd].vpath);
+    pc.open[fd].vpath = path;
+    pc.open[fd].opened = cur;
+    pc.open[fd].writable = (flags & O_ACCMODE) != O_RDONLY;
+    pthread_mutex_unlock(&pc.lock);
+
+    return keep;
+}
+
+void pagecache_released(int fd) {
+    struct open_file file = { NULL };
+    struct version cur;
+
+    if(pc.files == NULL)
+        return;
+
+    pthread_mutex_lock(&pc.lock);
+    if(fd < pc.nopen) {
+        file = pc.open[fd];
+        pc.open[fd].vpath = NULL;
+    }
+    pthread_mutex_unlock(&pc.lock);
+    if(file.vpath == NULL)
+        return;
+
+    /* The pages are up to date if the file is unchanged, or was written
+     * through this descriptor. Changed from elsewhere, it is forgotten. */
+    if(current_version(fd, &cur) == 0 &&
+       (file.writable || memcmp(&cur, &file.opened, sizeof(struct version)) == 0))
+        remember(file.vpath, &cur);
+    else
+        forget(file.vpath);
+    free(file.vpath);
+}
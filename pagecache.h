@@ -0,0 +1,33 @@
+/*
+ * Kernel page cache of files.
+ *
+ * The kernel drops the pages of a file when it is opened, unless told that
+ * they are still valid. With -o page_cache, the inode, size, mtime and ctime
+ * of files are recorded by virtual path when they are opened: a file that is
+ * opened again unchanged keeps its pages. When released, a file opened for
+ * writing is recorded again with the changes made through it, and a file
+ * changed from elsewhere meanwhile is forgotten.
+ *
+ * With -o writeback_cache, the kernel also buffers writes and sends them in
+ * large chunks, and keeps mtime and size up to date itself.
+ */
+
+/* Record up to size files (none if size is 0), with writes buffered if
+ * writeback is set */
+void pagecache_start(int size, int writeback);
+void pagecache_stop();
+
+/* Flags to open a file with, for an open request with flags: with writeback,
+ * the kernel reads the pages it partially writes, and computes the offset of
+ * appends itself */
+int pagecache_open_flags(int flags);
+/* Flags to open a file the caller may write but not read with, if opening it
+ * with pagecache_open_flags(flags) was denied: it must then be opened with
+ * direct I/O, so that the kernel never reads it. -1 if there is nothing else
+ * to try. */
+int pagecache_write_only_flags(int flags);
+/* vpath was opened as fd with flags: whether the kernel may keep the pages
+ * it has */
+int pagecache_opened(const char *vpath, int fd, int flags);
+/* fd is being released */
+void pagecache_released(int fd);
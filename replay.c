@@ -0,0 +1,332 @@
+/* replay.c - rewritefs trace player
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ *
+ * Plays back a trace recorded with -o trace=FILE through the rule engine,
+ * with any configuration, and optionally makes the system calls of the
+ * operations on a scratch copy of the source directory. Prints one
+ * tab-separated line per type of operation.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "rewrite.h"
+#include "stats.h"
+#include "trace.h"
+
+struct entry {
+    struct trace_record rec;
+    char *path;
+    char *rewritten;
+    char *cmdline; /* matched by the contexts */
+    int changed; /* rewritten differently than when recorded */
+};
+
+struct run {
+    int first, step;
+    long *latencies; /* by entry */
+    long played;
+};
+
+static struct entry *entries;
+static int nentries;
+static int source_fd = -1;
+static int repeat = 1;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void load_trace(const char *file) {
+    const char *map, *p, *end;
+    struct entry *e;
+    struct stat st;
+    int fd, cap = 0, v1;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &st) == -1) {
+        perror(file);
+        exit(1);
+    }
+    map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(map == MAP_FAILED || st.st_size < TRACE_MAGIC_LEN ||
+       (memcmp(map, TRACE_MAGIC, TRACE_MAGIC_LEN) && memcmp(map, TRACE_MAGIC_V1, TRACE_MAGIC_LEN))) {
+        fprintf(stderr, "%s: not a rewritefs trace\n", file);
+        exit(1);
+    }
+    v1 = !memcmp(map, TRACE_MAGIC_V1, TRACE_MAGIC_LEN);
+
+    end = map + st.st_size;
+    for(p = map + TRACE_MAGIC_LEN; p + sizeof(struct trace_record) <= end; ) {
+        if(nentries == cap) {
+            cap = cap ? cap * 2 : 4096;
+            entries = reallocarray(entries, cap, sizeof(struct entry));
+            if(entries == NULL) {
+                perror("reallocarray");
+                abort();
+            }
+        }
+        e = &entries[nentries];
+        e->changed = 0;
+        memcpy(&e->rec, p, sizeof(struct trace_record));
+        if(v1) {
+            /* op and failed were where cmdline_len is */
+            e->rec.op = p[offsetof(struct trace_record, cmdline_len)];
+            e->rec.failed = p[offsetof(struct trace_record, cmdline_len) + 1];
+            e->rec.cmdline_len = 0;
+        }
+        p += sizeof(struct trace_record);
+        if(p + e->rec.path_len + e->rec.rewritten_len + e->rec.cmdline_len > end)
+            break;
+        e->path = strndup(p, e->rec.path_len);
+        p += e->rec.path_len;
+        e->rewritten = strndup(p, e->rec.rewritten_len);
+        p += e->rec.rewritten_len;
+        e->cmdline = strndup(p, e->rec.cmdline_len);
+        p += e->rec.cmdline_len;
+        if(e->path == NULL || e->rewritten == NULL || e->cmdline == NULL) {
+            perror("strndup");
+            abort();
+        }
+        nentries++;
+    }
+    if(p != end)
+        fprintf(stderr, "%s: truncated, %d records read\n", file, nentries);
+    munmap((void *)map, st.st_size);
+}
+
+/* The system call rewritefs makes for op on rpath, or the closest one.
+ * Renames and links are played as a stat of their source, which is the path
+ * recorded. */
+static void play_syscall(int op, const char *rpath) {
+    struct statvfs stvfs;
+    struct stat st;
+    struct dirent *d;
+    char buf[PATH_MAX];
+    DIR *dir;
+    int fd;
+
+    switch(op) {
+    case STATS_ACCESS:
+        faccessat(source_fd, rpath, F_OK, AT_SYMLINK_NOFOLLOW);
+        break;
+    case STATS_READLINK:
+        readlinkat(source_fd, rpath, buf, sizeof(buf));
+        break;
+    case STATS_MKNOD:
+        mknodat(source_fd, rpath, S_IFREG | 0644, 0);
+        break;
+    case STATS_MKDIR:
+        mkdirat(source_fd, rpath, 0755);
+        break;
+    case STATS_UNLINK:
+        unlinkat(source_fd, rpath, 0);
+        break;
+    case STATS_RMDIR:
+        unlinkat(source_fd, rpath, AT_REMOVEDIR);
+        break;
+    case STATS_SYMLINK:
+        symlinkat("rewritefs-replay", source_fd, rpath);
+        break;
+    case STATS_OPEN:
+    case STATS_CREATE:
+        fd = openat(source_fd, rpath, op == STATS_CREATE ? O_WRONLY | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+        if(fd != -1)
+            close(fd);
+        break;
+    case STATS_OPENDIR:
+    case STATS_READDIR:
+        fd = openat(source_fd, rpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd == -1)
+            break;
+        if(op == STATS_OPENDIR || (dir = fdopendir(fd)) == NULL) {
+            close(fd);
+            break;
+        }
+        while((d = readdir(dir)) != NULL)
+            fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        closedir(dir);
+        break;
+    case STATS_STATFS:
+        fstatvfs(source_fd, &stvfs);
+        break;
+    default:
+        fstatat(source_fd, rpath, &st, AT_SYMLINK_NOFOLLOW);
+        break;
+    }
+}
+
+static void *run_thread(void *arg) {
+    struct run *run = arg;
+    struct rewrite_caller caller = { 0, 0, 0, 022 };
+    struct rewrite_buf buf;
+    const char *res;
+    long t;
+
+    for(int r = 0; r < repeat; r++) {
+        for(int i = run->first; i < nentries; i += run->step) {
+            struct entry *e = &entries[i];
+
+            if(e->rec.path_len == 0)
+                continue;
+            caller.pid = e->rec.pid;
+            caller.uid = e->rec.uid;
+            caller.gid = e->rec.gid;
+            caller.cmdline = e->cmdline;
+
+            t = now_ns();
+            res = rewrite_as_into(e->path, &caller, &buf);
+            if(res == NULL) {
+                fprintf(stderr, "rewrite failed\n");
+                exit(1);
+            }
+            if(source_fd != -1)
+                play_syscall(e->rec.op, res);
+            run->latencies[i] += now_ns() - t;
+
+            if(r == 0)
+                e->changed = strcmp(res, e->rewritten) != 0;
+            run->played++;
+            rewrite_buf_free(&buf);
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Latencies of the entries of op (all of them if op is -1), averaged over
+ * the plays, sorted in all */
+static void print_op(const char *name, int op, struct run *runs, int nthreads, long *all) {
+    long n = 0, sum = 0, changed = 0, recorded = 0;
+
+    for(int i = 0; i < nentries; i++) {
+        struct run *run = &runs[i % nthreads];
+
+        if(entries[i].rec.path_len == 0 || (op != -1 && entries[i].rec.op != op))
+            continue;
+        all[n] = run->latencies[i] / repeat;
+        sum += all[n];
+        recorded += entries[i].rec.total_ns;
+        changed += entries[i].changed;
+        n++;
+    }
+    if(n == 0)
+        return;
+    qsort(all, n, sizeof(long), compare_long);
+    printf("%s\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n", name, n, changed, sum / n, all[n / 2],
+           all[n * 99 / 100], all[n - 1], recorded / n);
+}
+
+int main(int argc, char *argv[]) {
+    char *opts = "cache_size=4096", *source = NULL;
+    struct run *runs;
+    pthread_t *threads;
+    long start, elapsed, played = 0, changed = 0, skipped = 0, *all;
+    int opt, nthreads = 1;
+
+    while((opt = getopt(argc, argv, "ho:s:t:n:")) != -1) {
+        switch(opt) {
+        case 'o':
+            opts = optarg;
+            break;
+        case 's':
+            source = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            repeat = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if(optind != argc - 1 || nthreads < 1 || repeat < 1)
+        goto usage;
+
+    load_trace(argv[optind]);
+
+    /* The engine needs a source directory and a mount point */
+    char *fuse_argv[] = { "rewritefs-replay", "-o", opts, source ? source : "/", "/nonexistent", NULL };
+    struct fuse_args args = FUSE_ARGS_INIT(5, fuse_argv);
+    parse_args(5, fuse_argv, &args);
+    if(source)
+        source_fd = orig_fd();
+
+    runs = calloc(nthreads, sizeof(struct run));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    for(int i = 0; i < nthreads; i++) {
+        runs[i].first = i;
+        runs[i].step = nthreads;
+        runs[i].latencies = calloc(nentries, sizeof(long));
+        if(runs[i].latencies == NULL) {
+            perror("calloc");
+            return 1;
+        }
+    }
+
+    start = now_ns();
+    for(int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, run_thread, &runs[i]);
+    for(int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        played += runs[i].played;
+    }
+    elapsed = now_ns() - start;
+    for(int i = 0; i < nentries; i++) {
+        skipped += entries[i].rec.path_len == 0;
+        changed += entries[i].changed;
+    }
+
+    all = malloc((nentries + 1) * sizeof(long));
+    printf("op\trecords\tchanged\tns_per_op\tp50_ns\tp99_ns\tmax_ns\trecorded_ns_per_op\n");
+    for(int op = 0; op < STATS_NOPS; op++)
+        print_op(stats_op_name(op), op, runs, nthreads, all);
+    print_op("all", -1, runs, nthreads, all);
+    fprintf(stderr, "%ld operations played in %ld ms (%.0f/s), %ld rewritten differently, "
+            "%ld records without path skipped\n", played, elapsed / 1000000,
+            elapsed ? played * 1e9 / elapsed : 0, changed, skipped);
+
+    rewrite_cleanup();
+    fuse_opt_free_args(&args);
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-o OPTIONS] [-s SOURCE] [-t THREADS] [-n TIMES] TRACE\n"
+            "\n"
+            "    -o  rewritefs options, config=CONFIG to use another configuration\n"
+            "        (default: cache_size=4096)\n"
+            "    -s  also make the system calls of the operations in SOURCE, a scratch\n"
+            "        copy of the source directory that may be modified\n"
+            "    -t  number of threads the records are spread over (default: 1)\n"
+            "    -n  number of times the trace is played (default: 1)\n",
+            argv[0]);
+    return 1;
+}
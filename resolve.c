@@ -0,0 +1,174 @@
+/* resolve.c - rewritefs path resolver
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ *
+ * Reads paths, one per line, and prints how rewritefs would rewrite them,
+ * without mounting anything. The paths are resolved in batches with the
+ * rewrite engine library, for one caller.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "librewritefs.h"
+
+/* A line read, with room for the leading slash */
+struct line {
+    char *data;
+    size_t cap;
+};
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Read the next path into line, as an absolute path. Return 0 at the end
+ * of the input. */
+static int read_path(struct line *line, int delim) {
+    ssize_t len = getdelim(&line->data, &line->cap, delim, stdin);
+
+    if(len == -1)
+        return 0;
+    if(len > 0 && line->data[len - 1] == delim)
+        line->data[--len] = '\0';
+    if(line->data[0] != '/') {
+        if((size_t)len + 2 > line->cap) {
+            line->cap = len + 2;
+            line->data = realloc(line->data, line->cap);
+            if(line->data == NULL) {
+                perror("realloc");
+                abort();
+            }
+        }
+        memmove(line->data + 1, line->data, len + 1);
+        line->data[0] = '/';
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct rewrite_engine_options opts;
+    struct rewrite_caller caller = { 0, getuid(), getgid(), 022, "" };
+    struct rewrite_engine *engine;
+    struct rewrite_buf *bufs;
+    struct line *lines;
+    const char **paths, **res;
+    long start, total = 0, rewritten = 0;
+    int opt, n, batch = 256, delim = '\n', pairs = 0, summary = 0;
+
+    rewrite_engine_defaults(&opts);
+    while((opt = getopt(argc, argv, "hc:C:p:a:n:tzsv:")) != -1) {
+        switch(opt) {
+        case 'c':
+            opts.config_file = optarg;
+            break;
+        case 'C':
+            opts.compiled_config = optarg;
+            break;
+        case 'p':
+            caller.pid = atoi(optarg);
+            caller.cmdline = NULL;
+            break;
+        case 'a':
+            caller.cmdline = optarg;
+            break;
+        case 'n':
+            batch = atoi(optarg);
+            break;
+        case 't':
+            pairs = 1;
+            break;
+        case 'z':
+            delim = '\0';
+            break;
+        case 's':
+            summary = 1;
+            break;
+        case 'v':
+            opts.verbose = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if(optind != argc || batch < 1)
+        goto usage;
+
+    engine = rewrite_engine_new(&opts);
+    if(engine == NULL)
+        return 1;
+
+    lines = calloc(batch, sizeof(struct line));
+    bufs = malloc(batch * sizeof(struct rewrite_buf));
+    paths = malloc(batch * sizeof(char *));
+    res = malloc(batch * sizeof(char *));
+    if(lines == NULL || bufs == NULL || paths == NULL || res == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    start = now_ns();
+    do {
+        for(n = 0; n < batch && read_path(&lines[n], delim); n++)
+            paths[n] = lines[n].data;
+        if(rewrite_engine_batch(engine, &caller, paths, res, bufs, n) == -1) {
+            fprintf(stderr, "rewrite failed\n");
+            return 1;
+        }
+        for(int i = 0; i < n; i++) {
+            if(pairs) {
+                fputs(paths[i] + 1, stdout);
+                putchar('\t');
+            }
+            fputs(res[i], stdout);
+            putchar(delim);
+            rewritten += strcmp(res[i], paths[i] + 1) != 0;
+            rewrite_buf_free(&bufs[i]);
+        }
+        total += n;
+    } while(n == batch);
+
+    if(fflush(stdout) != 0) {
+        perror("writing paths");
+        return 1;
+    }
+    if(summary) {
+        long elapsed = now_ns() - start;
+        fprintf(stderr, "%ld paths resolved in %ld ms (%.0f/s), %ld rewritten\n", total,
+                elapsed / 1000000, elapsed ? total * 1e9 / elapsed : 0, rewritten);
+    }
+
+    for(int i = 0; i < batch; i++)
+        free(lines[i].data);
+    free(lines);
+    free(bufs);
+    free(paths);
+    free(res);
+    rewrite_engine_free(engine);
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-c CONFIG] [-C COMPILED] [-p PID | -a CMDLINE] [-n BATCH] [-t] [-z] [-s]\n"
+            "       [-v LEVEL] < PATHS\n"
+            "\n"
+            "    -c  configuration file\n"
+            "    -C  compiled configuration, as with -o compiled_config\n"
+            "    -p  resolve on behalf of process PID, for its contexts\n"
+            "    -a  resolve for the contexts matching CMDLINE (default: none)\n"
+            "    -n  number of paths resolved together (default: 256)\n"
+            "    -t  print each path, a tab and its rewritten path\n"
+            "    -z  paths are separated by null characters instead of newlines\n"
+            "    -s  print how long resolving took to stderr\n"
+            "    -v  verbose level, as with -o verbose\n",
+            argv[0]);
+    return 1;
+}
@@ -5,366 +5,65 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
-#include <ctype.h>
 #include <string.h>
 #include <errno.h>
-#include <libgen.h>
+#include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <fuse.h>
 #include <fuse_opt.h>
-#include <pcre.h>
+#include <pthread.h>
 
 #include "rewrite.h"
+#include "cache.h"
+#include "inval.h"
 
 #define DEBUG(lvl, x...) if(config.verbose >= lvl) fprintf(stderr, x)
 
-/*
- * Type definiton 
- */
-struct regexp {
-    pcre *regexp;
-    pcre_extra *extra;
-    int captures;
-    int replace_all;
-    char *raw;
-};
-
-struct replacement_part {
-    int group;
-    char *data;
-    int len;
-};
-
-struct replacement_template {
-    int nparts;
-    char *raw;
-    struct replacement_part *parts;
-};
-
-struct rewrite_rule {
-    struct regexp *filename_regexp;
-    struct replacement_template *rewritten_path; /* NULL for "." */
-    struct rewrite_rule *next;
-};
-
-struct rewrite_context {
-    struct regexp *cmdline; /* NULL for all contexts */
-    struct rewrite_rule *rules;
-    struct rewrite_context *next;
-};
+/* Number of directories remembered by autocreate */
+#define AUTOCREATE_DIRS 4096
+/* Number of files recorded by writeback_cache without page_cache=N */
+#define PAGE_CACHE_FILES 4096
 
 struct config {
     char *config_file;
+    char *compiled_config;
     char *orig_fs;
     int orig_fd;
     char *mount_point;
-    struct rewrite_context *contexts;
+    struct rewrite_engine *engine;
     int verbose;
     int autocreate;
-};
-
-enum type {
-    CMDLINE,
-    RULE,
-    END
+    int lowlevel;
+    int passthrough;
+    int io_uring;
+    int dir_cache;
+    int negative_cache;
+    int page_cache;
+    int writeback_cache;
+    int stats;
+    int reload_file;
+    char *trace_file;
+    int trace_fd;
+    int cache_size;
+    int cmdline_cache_size;
+    struct cache *dirs; /* rewritten directories known to exist, for autocreate */
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
 };
 
 /*
  * Global variables
  */
 static struct config config;
-
-/*
- * Config-file parsing
- */
-static void *abmalloc(size_t sz) {
-    void *res = malloc(sz);
-    if(res == NULL) {
-        perror("malloc");
-        abort();
-    }
-    return res;
-}
-
-/* Consume all blanks (according to isspace) */
-static void parse_blanks(FILE *fd) {
-    int c;
-    do {
-        c = getc(fd);
-    } while(isspace(c) && c != EOF);
-    ungetc(c, fd);
-}
-
-/* Consume all characters until reaching EOL */
-static void parse_comment(FILE *fd) {
-    int c;
-    do {
-        c = getc(fd);
-    } while(c != '\n' && c != EOF);
-}
-
-static char *string_new(int *string_cap, int *string_size) {
-    *string_cap = 255;
-    *string_size = 0;
-    char *s = abmalloc(*string_cap);
-    s[0] = '\0';
-    return s;
-}
-
-/* append c to string, extending it if necessary */
-static void string_append(char **string, char c, int *string_cap, int *string_size) {
-    if(*string_cap == *string_size + 1) {
-        *string_cap *= 2;
-        *string = realloc(*string, *string_cap);
-        if(*string == NULL) {
-            perror("realloc");
-            abort();
-        }
-    }
-    
-    (*string)[(*string_size)++] = c;
-    (*string)[*string_size] = 0;
-}
-
-/* Consume the string until reaching sep */
-static void parse_string(FILE *fd, char **string, char sep) {
-    int string_cap, string_size;
-    int escaped = 0;
-    int c;
-    
-    *string = string_new(&string_cap, &string_size);
-    for(;;) {
-        c = getc(fd);
-        if(c == EOF) {
-            fprintf(stderr, "Unexpected EOF\n");
-            exit(1);
-        }
-
-        if(escaped) {
-            /* \\ -> \
-             * \(sep) -> (sep)
-             * \(other) -> \(other)
-             */
-            escaped = 0;
-            if(c != '\\' && c != (int)sep) {
-                string_append(string, '\\', &string_cap, &string_size);
-            }
-            string_append(string, c, &string_cap, &string_size);
-        } else {
-            if(c == '\\') {
-                escaped = 1;
-            } else if(c == (int)sep) {
-                break;
-            } else {
-                string_append(string, c, &string_cap, &string_size);
-            }
-        }
-    }
-}
-
-/* Consume the regexp (until reaching end-of-flags) and put it in regexp */
-static void parse_regexp(FILE *fd, struct regexp **regexp, char sep) {
-    char *regexp_body;
-    int regexp_flags = 0;
-    int replace_all = 0;
-    const char *error;
-    int offset;
-    int c;
-    
-    /* Determine separator */
-    if(sep == 0) {
-        sep = getc(fd);
-        if(sep == 'm') {
-            sep = getc(fd);
-        } else if(sep != '/') {
-            fprintf(stderr, "Unexpected character \"%c\"\n", (char)sep);
-            exit(1);
-        }
-    }
-    
-    if(sep == EOF) {
-        fprintf(stderr, "Unexpected EOF\n");
-        exit(1);
-    }
-    
-    /* Get body */
-    parse_string(fd, &regexp_body, sep);
-    
-    /* Get flags */
-    while(!isspace(c = getc(fd))) {
-        switch(c) {
-        case 'i':
-            regexp_flags |= PCRE_CASELESS;
-            break;
-        case 'x':
-            regexp_flags |= PCRE_EXTENDED;
-            break;
-        case 'u':
-            regexp_flags |= PCRE_UCP | PCRE_UTF8;
-            break;
-        case 'g':
-            replace_all = 1;
-            break;
-        case EOF:
-            fprintf(stderr, "Unexpected EOF\n");
-            exit(1);
-        default:
-            fprintf(stderr, "Unknown flag %c\n", (char)c);
-            exit(1);
-        }
-    }
-    
-    /* Compilation */
-    *regexp = abmalloc(sizeof(struct regexp));
-
-    (*regexp)->replace_all = replace_all;
-    
-    (*regexp)->regexp = pcre_compile(regexp_body, regexp_flags, &error, &offset, NULL);
-    if((*regexp)->regexp == NULL) {
-        fprintf(stderr, "Invalid regular expression: %s\n. Regular expression was :\n  %s\n", error, regexp_body);
-        exit(1);
-    }
-    
-    (*regexp)->extra = pcre_study((*regexp)->regexp, 0, &error);
-    if((*regexp)->extra == NULL && error != NULL) {
-        fprintf(stderr, "Can't compile regular expression: %s\n. Regular expression was :\n  %s\n", error, regexp_body);
-        exit(1);
-    }
-    
-    pcre_fullinfo((*regexp)->regexp, (*regexp)->extra, PCRE_INFO_CAPTURECOUNT, &(*regexp)->captures);
-    (*regexp)->raw = regexp_body;
-}
-
-/* Get a CMDLINE or RULE definition */
-static void parse_item(FILE *fd, enum type *type, struct regexp **regexp, char **string) {
-    int c;
-    
-    parse_blanks(fd);
-    switch(c = getc(fd)) {
-    case '-':
-        *type = CMDLINE;
-        parse_blanks(fd);
-        parse_regexp(fd, regexp, 0);
-        return;
-    case 'm':
-        c = getc(fd);
-        /* continue */
-    case '/':
-        *type = RULE;
-        parse_regexp(fd, regexp, (char)c);
-        parse_blanks(fd);
-        parse_string(fd, string, '\n');
-        return;
-    case '#':
-        parse_comment(fd);
-        parse_item(fd, type, regexp, string);
-        return;
-    case EOF:
-        *type = END;
-        return;
-    default:
-        fprintf(stderr, "Unexpected character \"%c\"\n", (char)c);
-        exit(1);
-    }
-}
-
-static struct replacement_part *alloc_part(struct replacement_part **parts, int *nparts) {
-    *parts = reallocarray(*parts, ++(*nparts), sizeof(struct replacement_part));
-    if(*parts == NULL) {
-        perror("reallocarray");
-        abort();
-    }
-    return (*parts) + (*nparts - 1);
-}
-
-static struct replacement_template *parse_replacement_template(char *tpl) {
-    int buf_cap, buf_size;
-    char *buf = string_new(&buf_cap, &buf_size);
-
-    int nparts = 0;
-    struct replacement_part *parts = NULL;
-    struct replacement_part *cur_part;
-
-    int escaped = 0;
-    for(int i = 0; i < strlen(tpl); i++) {
-        if(escaped) {
-            if(tpl[i] >= '0' && tpl[i] <= '9') {
-                if(buf_size > 0) {
-                    cur_part = alloc_part(&parts, &nparts);
-                    cur_part->data = buf;
-                    cur_part->len = buf_size;
-                    buf = string_new(&buf_cap, &buf_size);
-                }
-
-                cur_part = alloc_part(&parts, &nparts);
-                cur_part->data = NULL;
-                cur_part->group = tpl[i] - '0';
-            } else {
-                string_append(&buf, tpl[i], &buf_cap, &buf_size);
-            }
-            escaped = 0;
-        } else {
-            if(tpl[i] == '\\') {
-                escaped = 1;
-            } else {
-                string_append(&buf, tpl[i], &buf_cap, &buf_size);
-            }
-        }
-    }
-
-    if(nparts == 0 || buf_size > 0) {
-        cur_part = alloc_part(&parts, &nparts);
-        cur_part->data = buf;
-        cur_part->len = buf_size;
-    }
-
-    struct replacement_template *res = abmalloc(sizeof(struct replacement_template));
-    res->parts = parts;
-    res->nparts = nparts;
-    res->raw = tpl;
-
-    return res;
-}
-
-static void parse_config(FILE *fd) {
-    enum type type;
-    struct regexp *regexp;
-    char *string;
-    
-    struct rewrite_rule *rule, *last_rule = NULL;
-    
-    struct rewrite_context *new_context;
-    struct rewrite_context *current_context = abmalloc(sizeof(struct rewrite_context));
-    current_context->cmdline = NULL;
-    current_context->rules = NULL;
-    current_context->next = NULL;
-    config.contexts = current_context;
-    
-    do {
-        parse_item(fd, &type, &regexp, &string);
-        if(type == CMDLINE) {
-            new_context = abmalloc(sizeof(struct rewrite_context));
-            new_context->cmdline = !strcmp(regexp->raw, "") ? NULL : regexp;
-            new_context->rules = last_rule = NULL;
-            new_context->next = NULL;
-            current_context->next = new_context;
-            current_context = new_context;
-        } else if(type == RULE) {
-            rule = abmalloc(sizeof(struct rewrite_rule));
-            rule->filename_regexp = regexp;
-            rule->rewritten_path = (!strcmp(string, ".")) ? (free(string), NULL) : parse_replacement_template(string);
-            rule->next = NULL;
-            if(last_rule)
-                last_rule->next = rule;
-            last_rule = rule;
-            if(current_context->rules == NULL)
-                current_context->rules = rule;
-        }
-    } while(type != END);
-}
+static pthread_t reload_thread;
+static int reload_running;
+static int reload_stopping;
+static void (*reload_hook)();
 
 /*
  * Command-line arguments parsing
@@ -378,8 +77,24 @@ enum {
 
 static struct fuse_opt options[] = {
     REWRITE_OPT("config=%s",       config_file, 0),
+    REWRITE_OPT("compiled_config=%s", compiled_config, 0),
     REWRITE_OPT("verbose=%i",      verbose, 0),
     REWRITE_OPT("autocreate",      autocreate, 1),
+    REWRITE_OPT("lowlevel",        lowlevel, 1),
+    REWRITE_OPT("passthrough",     passthrough, 1),
+    REWRITE_OPT("io_uring",        io_uring, 1),
+    REWRITE_OPT("dir_cache=%i",    dir_cache, 0),
+    REWRITE_OPT("negative_cache=%i", negative_cache, 0),
+    REWRITE_OPT("page_cache=%i",   page_cache, 0),
+    REWRITE_OPT("writeback_cache", writeback_cache, 1),
+    REWRITE_OPT("stats",           stats, 1),
+    REWRITE_OPT("reload_file",     reload_file, 1),
+    REWRITE_OPT("trace=%s",        trace_file, 0),
+    REWRITE_OPT("cache_size=%i",   cache_size, 0),
+    REWRITE_OPT("cmdline_cache_size=%i", cmdline_cache_size, 0),
+    REWRITE_OPT("entry_timeout=%lf", entry_timeout, 0),
+    REWRITE_OPT("attr_timeout=%lf", attr_timeout, 0),
+    REWRITE_OPT("negative_timeout=%lf", negative_timeout, 0),
 
     FUSE_OPT_KEY("-V",             KEY_VERSION),
     FUSE_OPT_KEY("--version",      KEY_VERSION),
@@ -414,7 +129,35 @@ static int options_proc(void *data, const char *arg, int key, struct fuse_args *
                 "    -f               foreground\n"
                 "    -d               debug\n"
                 "    -o config=CONFIG path to configuration file\n"
+                "    -o compiled_config=FILE\n"
+                "                     path to the compiled configuration, to load large ones faster\n"
                 "    -o verbose=LEVEL verbose level [to be used with -f or -d] (LEVEL is 1 to 4)\n"
+                "    -o autocreate    create missing parent directories of rewritten paths\n"
+                "    -o lowlevel      use the inode-based backend\n"
+                "    -o passthrough   let the kernel read and write files directly (implies lowlevel)\n"
+                "    -o io_uring      make system calls through io_uring (path-based backend only)\n"
+                "    -o dir_cache=N   number of source directories kept open (path-based backend only,\n"
+                "                     0 to disable, default: 0)\n"
+                "    -o negative_cache=N\n"
+                "                     number of cached missing paths, watched with inotify\n"
+                "                     (0 to disable, default: 0)\n"
+                "    -o page_cache=N  number of files whose pages the kernel keeps across opens\n"
+                "                     (0 to disable, default: 0)\n"
+                "    -o writeback_cache\n"
+                "                     let the kernel buffer writes (implies page_cache)\n"
+                "    -o stats         collect statistics in /.rewritefs/stats\n"
+                "    -o reload_file   reload the configuration when /.rewritefs/reload is written\n"
+                "    -o trace=FILE    record every operation in FILE, for rewritefs-replay\n"
+                "                     (implies stats)\n"
+                "    -o cache_size=N  number of cached rewritten paths (0 to disable, default: 4096)\n"
+                "    -o cmdline_cache_size=N\n"
+                "                     number of cached caller command lines (0 to disable, default: 256)\n"
+                "    -o entry_timeout=T\n"
+                "                     seconds the kernel caches names (default: 0)\n"
+                "    -o attr_timeout=T\n"
+                "                     seconds the kernel caches attributes (default: 0)\n"
+                "    -o negative_timeout=T\n"
+                "                     seconds the kernel caches missing names (default: 0)\n"
                 "\n",
                 outargs->argv[0]);
         fuse_opt_add_arg(outargs, "-ho");
@@ -430,9 +173,12 @@ static int options_proc(void *data, const char *arg, int key, struct fuse_args *
 }
 
 void parse_args(int argc, char **argv, struct fuse_args *outargs) {
-    FILE *fd;
-    
+    struct rewrite_engine_options opts;
+
     memset(&config, 0, sizeof(config));
+    rewrite_engine_defaults(&opts);
+    config.cache_size = opts.cache_size;
+    config.cmdline_cache_size = opts.cmdline_cache_size;
     fuse_opt_parse(outargs, &config, options, options_proc);
     fuse_opt_add_arg(outargs, "-o");
     fuse_opt_add_arg(outargs, "default_permissions");
@@ -452,249 +198,351 @@ void parse_args(int argc, char **argv, struct fuse_args *outargs) {
         fprintf(stderr, "missing mount point argument\n");
         exit(1);
     }
-   
-    if(config.config_file) {
-        fd = fopen(config.config_file, "r");
-        if(fd == NULL) {
-            perror("opening config file");
+
+    /* Only the inode-based backend can register backing files */
+    if(config.passthrough)
+        config.lowlevel = 1;
+
+    /* Operations are timed by the statistics */
+    config.trace_fd = -1;
+    if(config.trace_file) {
+        AS_USER(getuid(), getgid(),
+                config.trace_fd = open(config.trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644));
+        if(config.trace_fd == -1) {
+            fprintf(stderr, "Cannot open trace file: %s\n", strerror(errno));
             exit(1);
         }
-        parse_config(fd);
-        fclose(fd);
-        
-        struct rewrite_context *ctx;
-        struct rewrite_rule *rule;
-        for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
-            DEBUG(1, "CTX \"%s\":\n", ctx->cmdline ? ctx->cmdline->raw : "default");
-            for(rule = ctx->rules; rule != NULL; rule = rule->next)
-                DEBUG(1, "  \"%s\" -> \"%s\"\n", rule->filename_regexp->raw, rule->rewritten_path ? rule->rewritten_path->raw : "(don't rewrite)");
-        }
-        DEBUG(1, "\n");
+        config.stats = 1;
+    }
+
+    opts.config_file = config.config_file;
+    opts.compiled_config = config.compiled_config;
+    opts.cache_size = config.cache_size;
+    opts.cmdline_cache_size = config.cmdline_cache_size;
+    opts.verbose = config.verbose;
+    config.engine = rewrite_engine_new(&opts);
+    if(config.engine == NULL)
+        exit(1);
+    if(config.autocreate)
+        config.dirs = cache_new(AUTOCREATE_DIRS, NULL);
+
+    /* The kernel caches are shared by every process */
+    if(rewrite_engine_has_contexts(config.engine) &&
+       (config.entry_timeout > 0 || config.attr_timeout > 0 || config.negative_timeout > 0)) {
+        fprintf(stderr, "Warning: contexts are used, cache timeouts are ignored\n");
+        config.entry_timeout = config.attr_timeout = config.negative_timeout = 0;
+    }
+    if(config.writeback_cache && config.page_cache <= 0)
+        config.page_cache = PAGE_CACHE_FILES;
+    if(rewrite_engine_has_contexts(config.engine) && config.page_cache > 0) {
+        fprintf(stderr, "Warning: contexts are used, page_cache and writeback_cache are ignored\n");
+        config.page_cache = config.writeback_cache = 0;
+    }
+
+    /* Waited for by the reload thread, blocked before any other thread is
+     * created so that it is the only one to receive it */
+    if(config.config_file) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
     }
 }
 
 /*
  * Rewrite stuff
  */
-char *get_caller_cmdline() {
-    char path[PATH_MAX];
-    FILE *fd;
-    int size = 0, cap = 255, c;
-    char *ret = malloc(cap);
-    
-    if(ret == NULL) {
-        return NULL;
-    } else {
-        *ret = 0;
-    }
-    
-    snprintf(path, PATH_MAX, "/proc/%d/cmdline", fuse_get_context()->pid);
-    fd = fopen(path, "r");
-    if(fd == NULL)
-        return ret;
-    
-    while((c = getc(fd)) != EOF) {
-        if(c == 0)
-            c = ' ';
-        string_append(&ret, c, &cap, &size);
-    }
-    
-    fclose(fd);
-    
-    return ret;
+const char *rewrite_as_into(const char *path, const struct rewrite_caller *caller, struct rewrite_buf *buf) {
+    return rewrite_engine_into(config.engine, path, caller, buf);
+}
+
+const char *rewrite_into(const char *path, struct rewrite_buf *buf) {
+    struct fuse_context *ctx = fuse_get_context();
+    struct rewrite_caller caller = { ctx->pid, ctx->uid, ctx->gid, ctx->umask };
+
+    return rewrite_as_into(path, &caller, buf);
+}
+
+/* Copy of a rewritten path, for the callers that keep it */
+static char *rewrite_copy(const char *res, struct rewrite_buf *buf) {
+    char *copy = res ? strdup(res) : NULL;
+
+    rewrite_buf_free(buf);
+    return copy;
+}
+
+char *rewrite_as(const char *path, const struct rewrite_caller *caller) {
+    struct rewrite_buf buf;
+
+    return rewrite_copy(rewrite_as_into(path, caller, &buf), &buf);
+}
+
+char *rewrite_dry(const char *path) {
+    return rewrite_engine_dry(config.engine, path);
 }
 
-/* Recursively create all parent directories in `path`. */
-static int mkdir_parents(const char *path, mode_t mode) {
-    int result = 0;
+char *rewrite(const char *path) {
+    struct fuse_context *ctx = fuse_get_context();
+    struct rewrite_caller caller = { ctx->pid, ctx->uid, ctx->gid, ctx->umask };
+
+    return rewrite_as(path, &caller);
+}
 
-    /* dirname() could clobber its argument. */
-    char *path_ = strdup(path);
+void rule_stats_print(FILE *out) {
+    rewrite_engine_print_rules(config.engine, out);
+}
 
-    /* dirname() may statically allocate the result; we need to copy so we don’t */
-    char *dir = strdup(dirname(path_));
+int has_contexts() {
+    return rewrite_engine_has_contexts(config.engine);
+}
 
-    struct stat dirstat;
-    errno = 0;
-    if ((fstatat(config.orig_fd, dir, &dirstat, 0) == -1) && errno == ENOENT) {
-        if (mkdir_parents(dir, mode)) {
-            result = -1;
+/* Length of the parent of the first len characters of path, 0 for "." */
+static size_t parent_len(const char *path, size_t len) {
+    const char *slash = memrchr(path, '/', len);
+    return slash ? slash - path : 0;
+}
+
+static int drop_dir(void *value, void *arg) {
+    (void)value;
+    (void)arg;
+    return 1;
+}
+
+/* Create the missing parent directories of path, and return how many were
+ * created. Directories found or created are remembered, so that creating
+ * more files in them only costs a lookup in config.dirs. Unless cached is
+ * set, the remembered ones are checked again. */
+static int mkdir_parents(const char *path, mode_t mode, const struct rewrite_caller *caller, int cached) {
+    char *dir = strdup(path);
+    size_t target, len;
+    struct stat st;
+    int res = 0, created = 0;
+
+    if(dir == NULL)
+        return -1;
+
+    /* Go up to the deepest ancestor that exists */
+    target = parent_len(dir, strlen(dir));
+    for(len = target; len > 0; len = parent_len(dir, len)) {
+        dir[len] = '\0';
+        if(config.dirs && cache_get(config.dirs, dir, len, cached ? NULL : drop_dir, NULL))
+            break;
+        if(fstatat(config.orig_fd, dir, &st, 0) == 0) {
+            if(config.dirs)
+                cache_put(config.dirs, dir, len, NULL);
+            break;
+        }
+        if(errno != ENOENT) {
+            res = -1;
             goto done;
         }
+    }
 
-        WLOCK(result = mkdirat(config.orig_fd, dir, mode));
-        if (result == -1)
+    /* Then create the missing ones down to the parent of path */
+    while(len < target) {
+        if(len > 0)
+            dir[len] = '/';
+        len = strlen(dir);
+        AS_USER(caller->uid, caller->gid, res = mkdirat(config.orig_fd, dir, mode & ~caller->umask));
+        /* Another request may have created it meanwhile */
+        if(res == -1 && errno != EEXIST)
             goto done;
+        res = 0;
+        created++;
+        inval_mutated(NULL, dir);
+        if(config.dirs)
+            cache_put(config.dirs, dir, len, NULL);
     }
 
 done:
     free(dir);
-    free(path_);
-    return result;
-}
-
-char *regexp_replace(struct regexp *re, const char *subject, struct replacement_template *tpl) {
-    int nvec, repl_sz, *ovector = NULL;
-    char *result, *repl, *repl_buf = NULL, *suffix_buf = NULL;
-    const char *suffix;
-    
-    /* Fill ovector */
-    nvec = (re->captures + 1) * 3;
-    ovector = calloc(nvec, sizeof(int));
-    if(ovector == NULL) {
-        result = NULL;
-        goto end;
-    }
+    return res == -1 ? -1 : created;
+}
 
-    int scount = pcre_exec(re->regexp, re->extra, subject,
-                           strlen(subject), 0, 0, ovector, nvec);
-
-    if(scount == PCRE_ERROR_NOMATCH)
-        return strdup(subject);
-
-    /* Replace backreferences */
-    if(tpl->nparts > 1 || tpl->parts[0].data == NULL) {
-        int i, wpos, group;
-
-        for(i = 0, repl_sz = 0; i < tpl->nparts; i++) {
-            if(tpl->parts[i].data == NULL) {
-                group = tpl->parts[i].group;
-                if(group < scount) {
-                    repl_sz += ovector[group*2+1] - ovector[group*2];
-                }
-            } else {
-                repl_sz += tpl->parts[i].len;
-            }
-        }
+void autocreate_as(const char *vpath, const char *rpath, const struct rewrite_caller *caller) {
+    /* Paths that were not rewritten have their parents looked up already */
+    if(!config.autocreate || !strcmp(vpath + 1, rpath))
+        return;
 
-        repl = repl_buf = malloc(repl_sz + 1);
-        if(repl == NULL) {
-            result = NULL;
-            goto end;
-        }
+    if(mkdir_parents(rpath, (S_IRWXU | S_IRWXG | S_IRWXO), caller, 1) == -1)
+        fprintf(stderr, "Warning: %s -> %s: autocreating parents failed: %s\n",
+                vpath, rpath, strerror(errno));
+}
 
-        for(i = 0, wpos = 0; i < tpl->nparts; i++) {
-            if(tpl->parts[i].data == NULL) {
-                group = tpl->parts[i].group;
-                if(group < scount) {
-                    strncpy(repl + wpos, subject + ovector[group*2], ovector[group*2+1]-ovector[group*2]);
-                    wpos += ovector[group*2+1] - ovector[group*2];
-                }
-            } else {
-                strcpy(repl + wpos, tpl->parts[i].data);
-                wpos += tpl->parts[i].len;
-            }
-        }
-        repl[wpos] = '\0';
-    } else {
-        repl = tpl->parts[0].data;
-        repl_sz = tpl->parts[0].len;
-    }
+void autocreate(const char *vpath, const char *rpath) {
+    struct fuse_context *ctx = fuse_get_context();
+    struct rewrite_caller caller = { ctx->pid, ctx->uid, ctx->gid, ctx->umask };
 
-    suffix = subject + ovector[1];
-    if(re->replace_all && suffix[0] != '\0') {
-        suffix = suffix_buf = regexp_replace(re, suffix, tpl);
-        if(suffix == NULL) {
-            result = NULL;
-            goto end;
-        }
-    }
+    autocreate_as(vpath, rpath, &caller);
+}
 
-    DEBUG(4, "  subject = %s\n", subject);
-    DEBUG(4, "  prefix = %s\n", strndup(subject, ovector[0]));
-    DEBUG(4, "  replaced match = %s\n", repl);
-    DEBUG(4, "  suffix = %s\n", suffix);
+int autocreate_retry_as(const char *vpath, const char *rpath, const struct rewrite_caller *caller) {
+    int res;
 
-    result = malloc(ovector[0] + repl_sz + strlen(suffix) + 1);
-    if(result == NULL) {
-        result = NULL;
-        goto end;
-    }
+    /* Parents are only remembered when autocreating them */
+    if(errno != ENOENT || !config.autocreate || config.dirs == NULL || !strcmp(vpath + 1, rpath))
+        return 0;
 
-    result[0] = 0;
-    strncat(result, subject, ovector[0]);
-    strcat(result, repl);
-    strcat(result, suffix);
+    res = mkdir_parents(rpath, (S_IRWXU | S_IRWXG | S_IRWXO), caller, 0);
+    errno = ENOENT;
+    return res > 0;
+}
 
-end:
-    free(repl_buf);
-    free(suffix_buf);
-    free(ovector);
+int autocreate_retry(const char *vpath, const char *rpath) {
+    struct fuse_context *ctx = fuse_get_context();
+    struct rewrite_caller caller = { ctx->pid, ctx->uid, ctx->gid, ctx->umask };
 
-    return result;
+    return autocreate_retry_as(vpath, rpath, &caller);
 }
 
-char *apply_rule(const char *path, struct rewrite_rule *rule) {
-    if(rule == NULL || rule->rewritten_path == NULL) {
-        DEBUG(2, "  (ignored) %s -> %s\n", path, path + 1);
-        DEBUG(3, "\n");
-        return strdup(path[1] == '\0' ? "." : path+1);
-    }
+void autocreate_forget() {
+    if(config.dirs)
+        cache_flush(config.dirs);
+}
 
-    char *rewritten = regexp_replace(rule->filename_regexp, path + 1, rule->rewritten_path);
+void rewrite_cleanup() {
+    rewrite_engine_free(config.engine);
+    config.engine = NULL;
 
-    if(config.autocreate) {
-        if(mkdir_parents(rewritten, (S_IRWXU | S_IRWXG | S_IRWXO)) == -1)
-            fprintf(stderr, "Warning: %s -> %s: autocreating parents failed: %s\n",
-                    path, rewritten, strerror(errno));
+    if(config.dirs) {
+        cache_free(config.dirs);
+        config.dirs = NULL;
     }
+}
 
-    DEBUG(1, "  %s -> %s\n", path, rewritten);
-    DEBUG(3, "\n");
+/*
+ * Reloading: the new rules are published atomically, requests in progress
+ * finish with the old ones, see rewrite_engine_reload().
+ */
+static void reload() {
+    /* The kernel caches can't be disabled once mounted */
+    switch(rewrite_engine_reload(config.engine, !kernel_cache())) {
+    case -1:
+        fprintf(stderr, "Reloading %s failed, keeping the current rules\n", config.config_file);
+        return;
+    case 1:
+        fprintf(stderr, "Reloading %s failed: contexts can't be used with kernel caches\n",
+                config.config_file);
+        return;
+    }
+    DEBUG(1, "Reloaded %s\n", config.config_file);
 
-    return rewritten;
+    /* Drop what was cached with the old rules */
+    if(reload_hook)
+        reload_hook();
+    inval_remap(rewrite_dry);
 }
 
-char *rewrite(const char *path) {
-    struct rewrite_context *ctx;
-    struct rewrite_rule *rule;
-    char *caller = NULL;
-    
-    int res;
-    
-    DEBUG(3, "%s:\n", path);
-    
-    for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
-        if(ctx->cmdline) {
-            if(!caller) {
-                caller = get_caller_cmdline();
-                if(caller == NULL) {
-                    fprintf(stderr, "WARNING: cannot obtain caller command line\n");
-                    continue;
-                }
-            }
-            res = pcre_exec(ctx->cmdline->regexp, ctx->cmdline->extra, caller,
-                strlen(caller), 0, 0, NULL, 0);
-            if(res < 0) {
-                if(res != PCRE_ERROR_NOMATCH)
-                    fprintf(stderr, "WARNING: pcre_exec returned %d\n", res);
-                DEBUG(3, "  CTX NOMATCH \"%s\"\n", ctx->cmdline->raw);
-                continue;
-            }
-            DEBUG(3, "  CTX OK \"%s\"\n", ctx->cmdline->raw);
-        } else {
-            DEBUG(3, "  CTX DEFAULT\n");
-        }
-        
-        for(rule = ctx->rules; rule != NULL; rule = rule->next) {
-            res = pcre_exec(rule->filename_regexp->regexp, rule->filename_regexp->extra, path + 1,
-                strlen(path) - 1, 0, 0, NULL, 0);
-            if(res < 0) {
-                if(res != PCRE_ERROR_NOMATCH)
-                    fprintf(stderr, "WARNING: pcre_exec returned %d\n", res);
-                DEBUG(3, "    RULE NOMATCH \"%s\"\n", rule->filename_regexp->raw);
-            } else {
-                DEBUG(3, "    RULE OK \"%s\" \"%s\"\n", rule->filename_regexp->raw, rule->rewritten_path ? rule->rewritten_path->raw : "(don't rewrite)");
-                free(caller);
-                return apply_rule(path, rule);
-            }
-        }
+static void *reload_main(void *arg) {
+    sigset_t set;
+    int sig;
+
+    (void)arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while(sigwait(&set, &sig) == 0 && !__atomic_load_n(&reload_stopping, __ATOMIC_ACQUIRE))
+        reload();
+
+    return NULL;
+}
+
+void reload_start(void (*hook)()) {
+    if(config.config_file == NULL)
+        return;
+    reload_hook = hook;
+    if(pthread_create(&reload_thread, NULL, reload_main, NULL) != 0) {
+        perror("pthread_create");
+        return;
     }
-    
-    free(caller);
-    return apply_rule(path, NULL);
+    reload_running = 1;
+}
+
+void reload_request() {
+    if(reload_running)
+        pthread_kill(reload_thread, SIGHUP);
+}
+
+void reload_stop() {
+    if(!reload_running)
+        return;
+    __atomic_store_n(&reload_stopping, 1, __ATOMIC_RELEASE);
+    pthread_kill(reload_thread, SIGHUP);
+    pthread_join(reload_thread, NULL);
+    reload_running = 0;
 }
 
 int orig_fd() {
     return config.orig_fd;
 }
+
+int lowlevel() {
+    return config.lowlevel;
+}
+
+int passthrough() {
+    return config.passthrough;
+}
+
+int use_io_uring() {
+    return config.io_uring;
+}
+
+int dir_cache_size() {
+    return config.dir_cache;
+}
+
+int negative_cache_size() {
+    return config.negative_cache;
+}
+
+int page_cache_size() {
+    return config.page_cache;
+}
+
+int writeback_cache() {
+    return config.writeback_cache;
+}
+
+double entry_timeout() {
+    return config.entry_timeout;
+}
+
+double attr_timeout() {
+    return config.attr_timeout;
+}
+
+double negative_timeout() {
+    return config.negative_timeout;
+}
+
+/* -1 without trace option */
+int trace_fd() {
+    return config.trace_fd;
+}
+
+int collect_stats() {
+    return config.stats;
+}
+
+int reloadable() {
+    return config.reload_file && config.config_file != NULL;
+}
+
+int control_files() {
+    return collect_stats() || reloadable();
+}
+
+double kernel_cache_timeout() {
+    double timeout = config.entry_timeout;
+
+    if(config.attr_timeout > timeout)
+        timeout = config.attr_timeout;
+    if(config.negative_timeout > timeout)
+        timeout = config.negative_timeout;
+    return timeout;
+}
+
+int kernel_cache() {
+    return config.entry_timeout > 0 || config.attr_timeout > 0 || config.negative_timeout > 0 ||
+           config.page_cache > 0;
+}
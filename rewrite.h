@@ -1,23 +1,65 @@
-#include <pthread.h>
+#include "librewritefs.h"
+#include "user.h"
 
-/* Lock for process EUID/EGID/umask */
-extern pthread_rwlock_t rwlock;
-
-#define RLOCK(expr) { \
-    pthread_rwlock_rdlock(&rwlock);\
-    expr; \
-    pthread_rwlock_unlock(&rwlock); \
-}
-
-#define WLOCK(expr) { \
-    pthread_rwlock_wrlock(&rwlock); \
-    uid_t _euid = geteuid(); gid_t _egid = getegid(); mode_t _umask = umask(fuse_get_context()->umask); \
-    setegid(fuse_get_context()->gid); seteuid(fuse_get_context()->uid); \
-    expr; \
-    seteuid(_euid); setegid(_egid); umask(_umask); \
-    pthread_rwlock_unlock(&rwlock); \
-}
+#define AS_CALLER(expr) AS_USER(fuse_get_context()->uid, fuse_get_context()->gid, expr)
 
+/* Options of the mount, and the rewrite engine of its configuration */
 void parse_args(int argc, char **argv, struct fuse_args *outargs);
+/* rewrite_engine_into() with the engine of the mount, on behalf of the
+ * caller of the current request */
+const char *rewrite_into(const char *path, struct rewrite_buf *buf);
+const char *rewrite_as_into(const char *path, const struct rewrite_caller *caller, struct rewrite_buf *buf);
+/* Same, in a string to free */
 char *rewrite(const char *path);
+char *rewrite_as(const char *path, const struct rewrite_caller *caller);
+/* Rewritten path of path for no caller in particular, without creating its
+ * parents or caching it */
+char *rewrite_dry(const char *path);
+/* With autocreate, create the missing parent directories of rpath, the
+ * rewritten path of vpath, before creating it */
+void autocreate(const char *vpath, const char *rpath);
+void autocreate_as(const char *vpath, const char *rpath, const struct rewrite_caller *caller);
+/* Creating rpath failed with errno: if it is ENOENT because a remembered
+ * parent was removed outside of the mount, create the parents again and
+ * return 1 so that the creation is retried. errno is kept otherwise. */
+int autocreate_retry(const char *vpath, const char *rpath);
+int autocreate_retry_as(const char *vpath, const char *rpath, const struct rewrite_caller *caller);
+/* A directory was removed or renamed: forget which ones exist */
+void autocreate_forget();
+/* Whether the rewriting of a path depends on its caller */
+int has_contexts();
+void rewrite_cleanup();
+/* Reload the configuration file on SIGHUP or reload_request(), in a thread.
+ * hook is called after every successful reload. */
+void reload_start(void (*hook)());
+void reload_request();
+void reload_stop();
+/* Evaluation count, match count and matching time of every context and rule,
+ * in the order of the configuration file */
+void rule_stats_print(FILE *out);
 int orig_fd();
+int lowlevel();
+int passthrough();
+int use_io_uring();
+int dir_cache_size();
+int negative_cache_size();
+int page_cache_size();
+int writeback_cache();
+int collect_stats();
+/* Whether the configuration file can be reloaded through /.rewritefs/reload,
+ * with reload_file */
+int reloadable();
+/* Whether /.rewritefs is served, hiding the one of the source directory: with
+ * stats or reload_file */
+int control_files();
+int trace_fd();
+double entry_timeout();
+double attr_timeout();
+double negative_timeout();
+/* Whether the kernel caches entries, attributes or file contents */
+int kernel_cache();
+/* Longest time the kernel keeps an entry or attributes */
+double kernel_cache_timeout();
+
+/* Inode-based backend, in rewritefs_ll.c */
+int rewrite_ll_main(struct fuse_args *args);
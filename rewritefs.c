@@ -28,35 +28,95 @@
 #endif
 
 #include "rewrite.h"
-
-pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+#include "inval.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+#include "dircache.h"
+#include "negcache.h"
+#include "pagecache.h"
+
+static struct fuse *fuse;
+
+static void invalidate_path(const char *path) {
+    fuse_invalidate_path(fuse, path);
+}
 
 static void *rewrite_init(struct fuse_conn_info *conn,
                           struct fuse_config *cfg) {
-    (void)conn;
+    int writeback = 0;
+
     cfg->use_ino = 1;
     cfg->nullpath_ok = 1;
-    cfg->entry_timeout = 0;
-    cfg->attr_timeout = 0;
-    cfg->negative_timeout = 0;
+    cfg->entry_timeout = entry_timeout();
+    cfg->attr_timeout = attr_timeout();
+    cfg->negative_timeout = negative_timeout();
     cfg->hard_remove = 1;
 
+    if (kernel_cache()) {
+        fuse = fuse_get_context()->fuse;
+        inval_start(invalidate_path, kernel_cache_timeout());
+    }
+    if (writeback_cache()) {
+        if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+            conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+            writeback = 1;
+        } else {
+            fprintf(stderr, "rewritefs: writeback_cache not supported, writing through\n");
+        }
+    }
+    pagecache_start(page_cache_size(), writeback);
+    if (use_io_uring() && uring_start() == -1)
+        fprintf(stderr, "rewritefs: io_uring not available (%s), using regular system calls\n",
+                strerror(errno));
+    if (dircache_start(orig_fd(), dir_cache_size()) == -1)
+        fprintf(stderr, "rewritefs: dir_cache not available (%s)\n", strerror(errno));
+    if (negcache_start(orig_fd(), negative_cache_size()) == -1)
+        fprintf(stderr, "rewritefs: negative_cache not available (%s)\n", strerror(errno));
+    stats_start_dumper(rule_stats_print);
+    reload_start(NULL);
+
     return NULL;
 }
 
+static void rewrite_destroy(void *private_data) {
+    (void)private_data;
+    reload_stop();
+    stats_stop();
+    trace_stop();
+    inval_stop();
+    uring_stop();
+    dircache_stop();
+    negcache_stop();
+    pagecache_stop();
+    rewrite_cleanup();
+}
+
 static int rewrite_getattr(const char *path, struct stat *stbuf,
                            struct fuse_file_info *fi) {
     int res;
 
     if(fi == NULL) {
-        char *new_path = rewrite(path);
+        struct rewrite_buf rbuf;
+        struct dir_ref dir;
+        const char *new_path = rewrite_into(path, &rbuf);
         if (new_path == NULL)
             return -ENOMEM;
 
-        RLOCK(res = fstatat(orig_fd(), new_path, stbuf, AT_SYMLINK_NOFOLLOW));
-        free(new_path);
+        if (negcache_missing(new_path)) {
+            res = -1;
+            errno = ENOENT;
+        } else {
+            dircache_get(new_path, &dir);
+            res = uring_fstatat(dir.fd, dir.name, stbuf, AT_SYMLINK_NOFOLLOW);
+            dircache_release(&dir);
+            if (res == -1 && errno == ENOENT)
+                negcache_add(new_path);
+        }
+        inval_record(path, new_path);
+        rewrite_buf_free(&rbuf);
     } else {
-        RLOCK(res = fstat(fi->fh, stbuf));
+        res = uring_fstatat(fi->fh, "", stbuf, AT_EMPTY_PATH);
     }
 
     if (res == -1)
@@ -67,12 +127,16 @@ static int rewrite_getattr(const char *path, struct stat *stbuf,
 
 static int rewrite_access(const char *path, int mask) {
     int res;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(res = faccessat(orig_fd(), new_path, mask, 0));
-    free(new_path);
+    dircache_get(new_path, &dir);
+    res = faccessat(dir.fd, dir.name, mask, 0);
+    dircache_release(&dir);
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
 
@@ -81,12 +145,16 @@ static int rewrite_access(const char *path, int mask) {
 
 static int rewrite_readlink(const char *path, char *buf, size_t size) {
     int res;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(res = readlinkat(orig_fd(), new_path, buf, size - 1));
-    free(new_path);
+    dircache_get(new_path, &dir);
+    res = readlinkat(dir.fd, dir.name, buf, size - 1);
+    dircache_release(&dir);
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
 
@@ -98,35 +166,49 @@ struct rewrite_dirp {
     DIR *dp;
     struct dirent *entry;
     off_t offset;
+    char *path;
+    char *new_path;
 };
 
 static int rewrite_opendir(const char *path, struct fuse_file_info *fi) {
     int fd;
     char *new_path;
+    struct dir_ref dir;
     struct rewrite_dirp *d = malloc(sizeof(struct rewrite_dirp));
     if (d == NULL)
         return -ENOMEM;
 
     new_path = rewrite(path);
-    if (new_path == NULL)
+    d->path = strdup(path);
+    if (new_path == NULL || d->path == NULL) {
+        free(new_path);
+        free(d->path);
+        free(d);
         return -ENOMEM;
+    }
 
-    RLOCK(fd = openat(orig_fd(), new_path, O_RDONLY));
-    free(new_path);
+    dircache_get(new_path, &dir);
+    fd = openat(dir.fd, dir.name, O_RDONLY);
+    dircache_release(&dir);
     if(fd == -1) {
+        free(new_path);
+        free(d->path);
         free(d);
         return -errno;
     }
 
-    RLOCK(d->dp = fdopendir(fd));
+    d->dp = fdopendir(fd);
 
     if (d->dp == NULL) {
         close(fd);
+        free(new_path);
+        free(d->path);
         free(d);
         return -errno;
     }
     d->offset = 0;
     d->entry = NULL;
+    d->new_path = new_path;
 
     fi->fh = (unsigned long) d;
     return 0;
@@ -136,33 +218,82 @@ static inline struct rewrite_dirp *get_dirp(struct fuse_file_info *fi) {
     return (struct rewrite_dirp *) (uintptr_t) fi->fh;
 }
 
+/* Whether new_path is the entry name of the directory dir_path */
+static int is_entry(const char *new_path, const char *dir_path, const char *name) {
+    size_t len = strlen(dir_path);
+
+    if (!strcmp(dir_path, "."))
+        return !strcmp(new_path, name);
+    return !strncmp(new_path, dir_path, len) && new_path[len] == '/' &&
+        !strcmp(new_path + len + 1, name);
+}
+
+/* Attributes of the file the entry name of d is rewritten to. When it isn't
+ * rewritten, the file is the entry itself and is found from the directory. */
+static int entry_stat(struct rewrite_dirp *d, const char *name, struct stat *st) {
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path;
+    char *path;
+    int res;
+
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+        return -1;
+
+    if (asprintf(&path, "%s/%s", strcmp(d->path, "/") ? d->path : "", name) == -1)
+        return -1;
+    new_path = rewrite_into(path, &rbuf);
+    if (new_path == NULL) {
+        free(path);
+        return -1;
+    }
+
+    if (is_entry(new_path, d->new_path, name)) {
+        res = fstatat(dirfd(d->dp), name, st, AT_SYMLINK_NOFOLLOW);
+    } else {
+        dircache_get(new_path, &dir);
+        res = fstatat(dir.fd, dir.name, st, AT_SYMLINK_NOFOLLOW);
+        dircache_release(&dir);
+    }
+    inval_record(path, new_path);
+    rewrite_buf_free(&rbuf);
+    free(path);
+
+    return res;
+}
+
 static int rewrite_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                            off_t offset, struct fuse_file_info *fi,
                            enum fuse_readdir_flags flags) {
     struct rewrite_dirp *d = get_dirp(fi);
 
     (void) path;
-    (void) flags;
     if (offset != d->offset) {
-        RLOCK(seekdir(d->dp, offset));
+        seekdir(d->dp, offset);
         d->entry = NULL;
         d->offset = offset;
     }
     for (;;) {
         struct stat st;
         off_t nextoff;
+        enum fuse_fill_dir_flags fill_flags;
 
         if (!d->entry) {
-            RLOCK(d->entry = readdir(d->dp));
+            d->entry = readdir(d->dp);
             if (!d->entry)
                 break;
         }
 
-        memset(&st, 0, sizeof(st));
-        st.st_ino = d->entry->d_ino;
-        st.st_mode = d->entry->d_type << 12;
-        RLOCK(nextoff = telldir(d->dp));
-        if (filler(buf, d->entry->d_name, &st, nextoff, 0))
+        fill_flags = 0;
+        if ((flags & FUSE_READDIR_PLUS) && entry_stat(d, d->entry->d_name, &st) == 0) {
+            fill_flags = FUSE_FILL_DIR_PLUS;
+        } else {
+            memset(&st, 0, sizeof(st));
+            st.st_ino = d->entry->d_ino;
+            st.st_mode = d->entry->d_type << 12;
+        }
+        nextoff = telldir(d->dp);
+        if (filler(buf, d->entry->d_name, &st, nextoff, fill_flags))
             break;
 
         d->entry = NULL;
@@ -175,19 +306,45 @@ static int rewrite_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int rewrite_releasedir(const char *path, struct fuse_file_info *fi) {
     struct rewrite_dirp *d = get_dirp(fi);
     (void) path;
-    RLOCK(closedir(d->dp));
+    closedir(d->dp);
+    free(d->path);
+    free(d->new_path);
     free(d);
     return 0;
 }
 
+/* Creating new_path failed: whether to try again, its parents having been
+ * removed outside of the mount and created again. The directories kept open
+ * may be among the removed ones. */
+static int retry_create(const char *path, const char *new_path) {
+    if (!autocreate_retry(path, new_path))
+        return 0;
+    dircache_forget();
+    return 1;
+}
+
 static int rewrite_mknod(const char *path, mode_t mode, dev_t rdev) {
     int res;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    WLOCK(res = mknodat(orig_fd(), new_path, mode, rdev));
-    free(new_path);
+    autocreate(path, new_path);
+    dircache_get(new_path, &dir);
+    AS_CALLER(res = mknodat(dir.fd, dir.name, mode & ~fuse_get_context()->umask, rdev));
+    dircache_release(&dir);
+    if (res == -1 && retry_create(path, new_path)) {
+        dircache_get(new_path, &dir);
+        AS_CALLER(res = mknodat(dir.fd, dir.name, mode & ~fuse_get_context()->umask, rdev));
+        dircache_release(&dir);
+    }
+    if (res == 0) {
+        negcache_created(new_path);
+        inval_mutated(path, new_path);
+    }
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
 
@@ -196,12 +353,26 @@ static int rewrite_mknod(const char *path, mode_t mode, dev_t rdev) {
 
 static int rewrite_mkdir(const char *path, mode_t mode) {
     int res;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    WLOCK(res = mkdirat(orig_fd(), new_path, mode));
-    free(new_path);
+    autocreate(path, new_path);
+    dircache_get(new_path, &dir);
+    AS_CALLER(res = mkdirat(dir.fd, dir.name, mode & ~fuse_get_context()->umask));
+    dircache_release(&dir);
+    if (res == -1 && retry_create(path, new_path)) {
+        dircache_get(new_path, &dir);
+        AS_CALLER(res = mkdirat(dir.fd, dir.name, mode & ~fuse_get_context()->umask));
+        dircache_release(&dir);
+    }
+    if (res == 0) {
+        negcache_created(new_path);
+        inval_mutated(path, new_path);
+    }
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
 
@@ -210,12 +381,18 @@ static int rewrite_mkdir(const char *path, mode_t mode) {
 
 static int rewrite_unlink(const char *path) {
     int res;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(res = unlinkat(orig_fd(), new_path, 0));
-    free(new_path);
+    dircache_get(new_path, &dir);
+    res = unlinkat(dir.fd, dir.name, 0);
+    dircache_release(&dir);
+    if (res == 0)
+        inval_mutated(path, new_path);
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
 
@@ -224,12 +401,21 @@ static int rewrite_unlink(const char *path) {
 
 static int rewrite_rmdir(const char *path) {
     int res;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(res = unlinkat(orig_fd(), new_path, AT_REMOVEDIR));
-    free(new_path);
+    dircache_get(new_path, &dir);
+    res = unlinkat(dir.fd, dir.name, AT_REMOVEDIR);
+    dircache_release(&dir);
+    if (res == 0) {
+        dircache_forget();
+        autocreate_forget();
+        inval_mutated(path, new_path);
+    }
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
 
@@ -238,12 +424,27 @@ static int rewrite_rmdir(const char *path) {
 
 static int rewrite_symlink(const char *from, const char *to) {
     int res;
-    char *new_to = rewrite(to);
+    struct rewrite_buf to_buf;
+    struct dir_ref dir;
+    const char *new_to = rewrite_into(to, &to_buf);
     if (new_to == NULL)
         return -ENOMEM;
 
-    WLOCK(res = symlinkat(from, orig_fd(), new_to));
-    free(new_to);
+    autocreate(to, new_to);
+    dircache_get(new_to, &dir);
+    AS_CALLER(res = symlinkat(from, dir.fd, dir.name));
+    dircache_release(&dir);
+    if (res == -1 && retry_create(to, new_to)) {
+        dircache_get(new_to, &dir);
+        AS_CALLER(res = symlinkat(from, dir.fd, dir.name));
+        dircache_release(&dir);
+    }
+    if (res == 0) {
+        /* A link to a directory brings the files under it */
+        negcache_flush();
+        inval_mutated(to, new_to);
+    }
+    rewrite_buf_free(&to_buf);
     if (res == -1)
         return -errno;
 
@@ -252,22 +453,47 @@ static int rewrite_symlink(const char *from, const char *to) {
 
 static int rewrite_rename(const char *from, const char *to, unsigned int flags) {
     int res;
-    char *new_from, *new_to;
+    struct rewrite_buf from_buf, to_buf;
+    struct dir_ref from_dir, to_dir;
+    const char *new_from, *new_to;
 
     if (flags != 0)
         return -EINVAL;
 
-    new_from = rewrite(from);
-    new_to = rewrite(to);
-    if (new_from == NULL || new_to == NULL) {
-        free(new_from);
-        free(new_to);
+    new_from = rewrite_into(from, &from_buf);
+    if (new_from == NULL)
+        return -ENOMEM;
+    new_to = rewrite_into(to, &to_buf);
+    if (new_to == NULL) {
+        rewrite_buf_free(&from_buf);
         return -ENOMEM;
     }
 
-    RLOCK(res = renameat(orig_fd(), new_from, orig_fd(), new_to));
-    free(new_from);
-    free(new_to);
+    autocreate(to, new_to);
+    dircache_get(new_from, &from_dir);
+    dircache_get(new_to, &to_dir);
+    res = renameat(from_dir.fd, from_dir.name, to_dir.fd, to_dir.name);
+    if (res == 0)
+        dircache_renamed(&to_dir);
+    dircache_release(&from_dir);
+    dircache_release(&to_dir);
+    if (res == -1 && retry_create(to, new_to)) {
+        dircache_get(new_from, &from_dir);
+        dircache_get(new_to, &to_dir);
+        res = renameat(from_dir.fd, from_dir.name, to_dir.fd, to_dir.name);
+        if (res == 0)
+            dircache_renamed(&to_dir);
+        dircache_release(&from_dir);
+        dircache_release(&to_dir);
+    }
+    if (res == 0) {
+        negcache_flush();
+        autocreate_forget();
+        inval_mutated(from, new_from);
+        inval_mutated(to, new_to);
+    }
+    rewrite_buf_free(&from_buf);
+    rewrite_buf_free(&to_buf);
     if (res == -1)
         return -errno;
 
@@ -276,18 +502,36 @@ static int rewrite_rename(const char *from, const char *to, unsigned int flags)
 
 static int rewrite_link(const char *from, const char *to) {
     int res;
-    char *new_from = rewrite(from),
-         *new_to = rewrite(to);
+    struct rewrite_buf from_buf, to_buf;
+    struct dir_ref from_dir, to_dir;
+    const char *new_from = rewrite_into(from, &from_buf), *new_to;
     if (new_from == NULL)
         return -ENOMEM;
+    new_to = rewrite_into(to, &to_buf);
     if (new_to == NULL) {
-        free(new_from);
+        rewrite_buf_free(&from_buf);
         return -ENOMEM;
     }
 
-    RLOCK(res = linkat(orig_fd(), new_from, orig_fd(), new_to, 0));
-    free(new_from);
-    free(new_to);
+    autocreate(to, new_to);
+    dircache_get(new_from, &from_dir);
+    dircache_get(new_to, &to_dir);
+    res = linkat(from_dir.fd, from_dir.name, to_dir.fd, to_dir.name, 0);
+    dircache_release(&from_dir);
+    dircache_release(&to_dir);
+    if (res == -1 && retry_create(to, new_to)) {
+        dircache_get(new_from, &from_dir);
+        dircache_get(new_to, &to_dir);
+        res = linkat(from_dir.fd, from_dir.name, to_dir.fd, to_dir.name, 0);
+        dircache_release(&from_dir);
+        dircache_release(&to_dir);
+    }
+    if (res == 0) {
+        negcache_created(new_to);
+        inval_mutated(to, new_to);
+    }
+    rewrite_buf_free(&from_buf);
+    rewrite_buf_free(&to_buf);
     if (res == -1)
         return -errno;
 
@@ -299,14 +543,20 @@ static int rewrite_chmod(const char *path, mode_t mode,
     int res;
 
     if(fi == NULL) {
-        char *new_path = rewrite(path);
+        struct rewrite_buf rbuf;
+        struct dir_ref dir;
+        const char *new_path = rewrite_into(path, &rbuf);
         if (new_path == NULL)
             return -ENOMEM;
 
-        RLOCK(res = fchmodat(orig_fd(), new_path, mode, 0));
-        free(new_path);
+        dircache_get(new_path, &dir);
+        res = fchmodat(dir.fd, dir.name, mode, 0);
+        dircache_release(&dir);
+        if (res == 0)
+            inval_mutated(path, new_path);
+        rewrite_buf_free(&rbuf);
     } else {
-        RLOCK(res = fchmod(fi->fh, mode));
+        res = fchmod(fi->fh, mode);
     }
 
     if (res == -1)
@@ -320,14 +570,20 @@ static int rewrite_chown(const char *path, uid_t uid, gid_t gid,
     int res;
 
     if(fi == NULL) {
-        char *new_path = rewrite(path);
+        struct rewrite_buf rbuf;
+        struct dir_ref dir;
+        const char *new_path = rewrite_into(path, &rbuf);
         if (new_path == NULL)
             return -ENOMEM;
 
-        RLOCK(res = fchownat(orig_fd(), new_path, uid, gid, AT_SYMLINK_NOFOLLOW));
-        free(new_path);
+        dircache_get(new_path, &dir);
+        res = fchownat(dir.fd, dir.name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        dircache_release(&dir);
+        if (res == 0)
+            inval_mutated(path, new_path);
+        rewrite_buf_free(&rbuf);
     } else {
-        RLOCK(res = fchown(fi->fh, uid, gid));
+        res = fchown(fi->fh, uid, gid);
     }
 
     if (res == -1)
@@ -340,19 +596,27 @@ static int rewrite_truncate(const char *path, off_t size,
                             struct fuse_file_info *fi) {
     int fd, res;
     if(fi == NULL) {
-        char *new_path = rewrite(path);
+        struct rewrite_buf rbuf;
+        struct dir_ref dir;
+        const char *new_path = rewrite_into(path, &rbuf);
         if (new_path == NULL)
             return -ENOMEM;
 
-        RLOCK(fd = openat(orig_fd(), new_path, O_WRONLY));
-        free(new_path);
-        if (fd == -1)
+        dircache_get(new_path, &dir);
+        fd = uring_openat(dir.fd, dir.name, O_WRONLY);
+        dircache_release(&dir);
+        if (fd == -1) {
+            rewrite_buf_free(&rbuf);
             return -errno;
+        }
 
-        RLOCK(res = ftruncate(fd, size));
+        res = ftruncate(fd, size);
         close(fd);
+        if (res == 0)
+            inval_mutated(path, new_path);
+        rewrite_buf_free(&rbuf);
     } else {
-        RLOCK(res = ftruncate(fi->fh, size));
+        res = ftruncate(fi->fh, size);
     }
 
     if (res == -1)
@@ -365,13 +629,19 @@ static int rewrite_utimens(const char *path, const struct timespec ts[2],
                            struct fuse_file_info *fi) {
     int res;
     if (fi == NULL) {
-        char *new_path = rewrite(path);
+        struct rewrite_buf rbuf;
+        struct dir_ref dir;
+        const char *new_path = rewrite_into(path, &rbuf);
         if (new_path == NULL)
             return -ENOMEM;
-        RLOCK(res = utimensat(orig_fd(), new_path, ts, AT_SYMLINK_NOFOLLOW));
-        free(new_path);
+        dircache_get(new_path, &dir);
+        res = utimensat(dir.fd, dir.name, ts, AT_SYMLINK_NOFOLLOW);
+        dircache_release(&dir);
+        if (res == 0)
+            inval_mutated(path, new_path);
+        rewrite_buf_free(&rbuf);
     } else {
-        RLOCK(res = futimens(fi->fh, ts));
+        res = futimens(fi->fh, ts);
     }
 
     if (res == -1)
@@ -381,20 +651,50 @@ static int rewrite_utimens(const char *path, const struct timespec ts[2],
 }
 
 static int rewrite_open(const char *path, struct fuse_file_info *fi) {
-    int fd;
-    char *new_path = rewrite(path);
+    int fd, flags;
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
     if (fi->flags & O_CREAT) {
-        WLOCK(fd = openat(orig_fd(), new_path, fi->flags));
+        autocreate(path, new_path);
+        dircache_get(new_path, &dir);
+        AS_CALLER(fd = openat(dir.fd, dir.name, pagecache_open_flags(fi->flags),
+                              0666 & ~fuse_get_context()->umask));
+        if (fd == -1 && retry_create(path, new_path)) {
+            dircache_release(&dir);
+            dircache_get(new_path, &dir);
+            AS_CALLER(fd = openat(dir.fd, dir.name, pagecache_open_flags(fi->flags),
+                                  0666 & ~fuse_get_context()->umask));
+        }
     } else {
-        RLOCK(fd = openat(orig_fd(), new_path, fi->flags));
+        dircache_get(new_path, &dir);
+        fd = uring_openat(dir.fd, dir.name, pagecache_open_flags(fi->flags));
     }
-    free(new_path);
-    if (fd == -1)
+    /* Written without the page cache if it can't be read */
+    if (fd == -1 && errno == EACCES && (flags = pagecache_write_only_flags(fi->flags)) != -1) {
+        if (fi->flags & O_CREAT) {
+            AS_CALLER(fd = openat(dir.fd, dir.name, flags, 0666 & ~fuse_get_context()->umask));
+        } else {
+            fd = uring_openat(dir.fd, dir.name, flags);
+        }
+        fi->direct_io = fd != -1;
+    }
+    dircache_release(&dir);
+    if (fd == -1) {
+        rewrite_buf_free(&rbuf);
         return -errno;
+    }
 
+    if (fi->flags & O_CREAT)
+        negcache_created(new_path);
+    if (fi->flags & (O_CREAT | O_TRUNC))
+        inval_mutated(path, new_path);
+    inval_open(fd, fi->flags, path, new_path);
+    fi->keep_cache = fi->direct_io ? 0 : pagecache_opened(path, fd, fi->flags);
+    rewrite_buf_free(&rbuf);
     fi->fh = fd;
     return 0;
 }
@@ -404,7 +704,7 @@ static int rewrite_read(const char *path, char *buf, size_t size, off_t offset,
     int res;
 
     (void) path;
-    RLOCK(res = pread(fi->fh, buf, size, offset));
+    res = pread(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
 
@@ -423,6 +723,27 @@ static int rewrite_read_buf(const char *path, struct fuse_bufvec **bufp,
 
     *src = FUSE_BUFVEC_INIT(size);
 
+    /* Splicing would read the file synchronously */
+    if (uring_enabled()) {
+        ssize_t res;
+
+        src->buf[0].mem = malloc(size);
+        if (src->buf[0].mem == NULL) {
+            free(src);
+            return -ENOMEM;
+        }
+        res = uring_pread(fi->fh, src->buf[0].mem, size, offset);
+        if (res == -1) {
+            res = -errno;
+            free(src->buf[0].mem);
+            free(src);
+            return res;
+        }
+        src->buf[0].size = res;
+        *bufp = src;
+        return 0;
+    }
+
     src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
     src->buf[0].fd = fi->fh;
     src->buf[0].pos = offset;
@@ -437,7 +758,7 @@ static int rewrite_write(const char *path, const char *buf, size_t size,
     int res;
 
     (void) path;
-    RLOCK(res = pwrite(fi->fh, buf, size, offset));
+    res = pwrite(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
 
@@ -450,6 +771,13 @@ static int rewrite_write_buf(const char *path, struct fuse_bufvec *buf,
 
     (void) path;
 
+    if (uring_enabled() && buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        ssize_t res = uring_pwrite(fi->fh, buf->buf[0].mem, buf->buf[0].size, offset);
+        if (res == -1)
+            return -errno;
+        return res;
+    }
+
     dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
     dst.buf[0].fd = fi->fh;
     dst.buf[0].pos = offset;
@@ -459,16 +787,20 @@ static int rewrite_write_buf(const char *path, struct fuse_bufvec *buf,
 
 static int rewrite_statfs(const char *path, struct statvfs *stbuf) {
     int res, fd;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(fd = openat(orig_fd(), new_path, O_RDONLY));
-    free(new_path);
+    dircache_get(new_path, &dir);
+    fd = openat(dir.fd, dir.name, O_RDONLY);
+    dircache_release(&dir);
+    rewrite_buf_free(&rbuf);
     if (fd == -1)
         return -errno;
 
-    RLOCK(res = fstatvfs(fd, stbuf));
+    res = fstatvfs(fd, stbuf);
     close(fd);
     if (res == -1)
         return -errno;
@@ -480,7 +812,7 @@ static int rewrite_flush(const char *path, struct fuse_file_info *fi) {
     int res;
 
     (void) path;
-    RLOCK(res = close(dup(fi->fh)));
+    res = close(dup(fi->fh));
     if (res == -1)
         return -errno;
 
@@ -489,7 +821,9 @@ static int rewrite_flush(const char *path, struct fuse_file_info *fi) {
 
 static int rewrite_release(const char *path, struct fuse_file_info *fi) {
     (void) path;
-    RLOCK(close(fi->fh));
+    inval_release(fi->fh);
+    pagecache_released(fi->fh);
+    close(fi->fh);
 
     return 0;
 }
@@ -499,16 +833,7 @@ static int rewrite_fsync(const char *path, int isdatasync,
     int res;
     (void) path;
 
-#ifndef HAVE_FDATASYNC
-    (void) isdatasync;
-#else
-    if (isdatasync) {
-        RLOCK(res = fdatasync(fi->fh));
-    } else
-#endif
-    {
-        RLOCK(res = fsync(fi->fh));
-    }
+    res = uring_fsync(fi->fh, isdatasync);
     if (res == -1)
         return -errno;
 
@@ -526,18 +851,19 @@ static int rewrite_fallocate(const char *path, int mode,
 #ifdef HAVE_SETXATTR
 static int rewrite_setxattr(const char *path, const char *name, const char *value,
         size_t size, int flags) {
-    int res, fd;
-    char *new_path = rewrite(path);
+    int res;
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(fd = openat(orig_fd(), new_path, O_RDONLY));
-    free(new_path);
-    if (fd == -1)
-        return -errno;
-
-    RLOCK(res = fsetxattr(fd, name, value, size, flags));
-    close(fd);
+    dircache_get(new_path, &dir);
+    res = uring_setxattrat(dir.fd, dir.name, name, value, size, flags);
+    dircache_release(&dir);
+    if (res == 0)
+        inval_mutated(path, new_path);
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
     return 0;
@@ -545,18 +871,17 @@ static int rewrite_setxattr(const char *path, const char *name, const char *valu
 
 static int rewrite_getxattr(const char *path, const char *name, char *value,
         size_t size) {
-    int res, fd;
-    char *new_path = rewrite(path);
+    int res;
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(fd = openat(orig_fd(), new_path, O_RDONLY));
-    free(new_path);
-    if (fd == -1)
-        return -errno;
-
-    RLOCK(res = fgetxattr(fd, name, value, size));
-    close(fd);
+    dircache_get(new_path, &dir);
+    res = uring_getxattrat(dir.fd, dir.name, name, value, size);
+    dircache_release(&dir);
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
     return 0;
@@ -564,16 +889,20 @@ static int rewrite_getxattr(const char *path, const char *name, char *value,
 
 static int rewrite_listxattr(const char *path, char *list, size_t size) {
     int res, fd;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(fd = openat(orig_fd(), new_path, O_RDONLY));
-    free(new_path);
+    dircache_get(new_path, &dir);
+    fd = openat(dir.fd, dir.name, O_RDONLY);
+    dircache_release(&dir);
+    rewrite_buf_free(&rbuf);
     if (fd == -1)
         return -errno;
 
-    RLOCK(res = flistxattr(fd, list, size));
+    res = flistxattr(fd, list, size);
     close(fd);
     if (res == -1)
         return -errno;
@@ -582,17 +911,25 @@ static int rewrite_listxattr(const char *path, char *list, size_t size) {
 
 static int rewrite_removexattr(const char *path, const char *name) {
     int res, fd;
-    char *new_path = rewrite(path);
+    struct rewrite_buf rbuf;
+    struct dir_ref dir;
+    const char *new_path = rewrite_into(path, &rbuf);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(fd = openat(orig_fd(), new_path, O_RDONLY));
-    free(new_path);
-    if (fd == -1)
+    dircache_get(new_path, &dir);
+    fd = openat(dir.fd, dir.name, O_RDONLY);
+    dircache_release(&dir);
+    if (fd == -1) {
+        rewrite_buf_free(&rbuf);
         return -errno;
+    }
 
-    RLOCK(res = fremovexattr(fd, name));
+    res = fremovexattr(fd, name);
     close(fd);
+    if (res == 0)
+        inval_mutated(path, new_path);
+    rewrite_buf_free(&rbuf);
     if (res == -1)
         return -errno;
     return 0;
@@ -641,6 +978,7 @@ static off_t rewrite_lseek(const char *path, off_t off, int whence, struct fuse_
 
 static struct fuse_operations rewrite_oper = {
     .init            = rewrite_init,
+    .destroy         = rewrite_destroy,
 
     .getattr         = rewrite_getattr,
     .readlink        = rewrite_readlink,
@@ -681,10 +1019,337 @@ static struct fuse_operations rewrite_oper = {
     .lseek           = rewrite_lseek,
 };
 
+/*
+ * Control files: with stats, every operation is timed by a wrapper, and the
+ * statistics are served as virtual files. Writing to the reload file, there
+ * whenever a configuration file is, reloads the rules.
+ */
+
+enum { CONTROL_NONE, CONTROL_DIR, CONTROL_STATS, CONTROL_RULES, CONTROL_RELOAD, CONTROL_OTHER };
+
+static int control_file(const char *path) {
+    size_t len = strlen("/" STATS_DIR);
+
+    if (path == NULL || strncmp(path, "/" STATS_DIR, len))
+        return CONTROL_NONE;
+    if (path[len] == '\0')
+        return CONTROL_DIR;
+    if (path[len] != '/')
+        return CONTROL_NONE;
+    if (collect_stats() && !strcmp(path + len + 1, STATS_FILE))
+        return CONTROL_STATS;
+    if (collect_stats() && !strcmp(path + len + 1, STATS_RULES_FILE))
+        return CONTROL_RULES;
+    if (reloadable() && !strcmp(path + len + 1, STATS_RELOAD_FILE))
+        return CONTROL_RELOAD;
+    return CONTROL_OTHER;
+}
+
+static int control_getattr(const char *path, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    switch (control_file(path)) {
+    case CONTROL_DIR:
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
+    case CONTROL_STATS:
+    case CONTROL_RULES:
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        return 0;
+    case CONTROL_RELOAD:
+        stbuf->st_mode = S_IFREG | 0200;
+        stbuf->st_nlink = 1;
+        return 0;
+    default:
+        return -ENOENT;
+    }
+}
+
+/* File handle of the virtual directory, never a struct rewrite_dirp */
+#define CONTROL_DIR_FH 0
+/* File handle of the reload file, never a file descriptor */
+#define CONTROL_RELOAD_FH ((uint64_t)-1)
+
+#define WITH_STATS(op, type, call) { \
+    struct stats_timer _timer; \
+    type _res; \
+    if (!stats_enabled()) \
+        return call; \
+    stats_begin(&_timer); \
+    _res = call; \
+    stats_end(&_timer, op, _res < 0); \
+    return _res; \
+}
+
+static int stats_getattr(const char *path, struct stat *stbuf,
+                         struct fuse_file_info *fi) {
+    if (control_file(path) != CONTROL_NONE)
+        return control_getattr(path, stbuf);
+    WITH_STATS(STATS_GETATTR, int, rewrite_getattr(path, stbuf, fi));
+}
+
+static int stats_access(const char *path, int mask) {
+    if (control_file(path) != CONTROL_NONE)
+        return (mask & W_OK) ? -EACCES : 0;
+    WITH_STATS(STATS_ACCESS, int, rewrite_access(path, mask));
+}
+
+static int stats_readlink(const char *path, char *buf, size_t size) {
+    WITH_STATS(STATS_READLINK, int, rewrite_readlink(path, buf, size));
+}
+
+static int stats_opendir(const char *path, struct fuse_file_info *fi) {
+    if (control_file(path) == CONTROL_DIR) {
+        fi->fh = CONTROL_DIR_FH;
+        return 0;
+    }
+    WITH_STATS(STATS_OPENDIR, int, rewrite_opendir(path, fi));
+}
+
+static int stats_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi,
+                         enum fuse_readdir_flags flags) {
+    if (fi->fh == CONTROL_DIR_FH) {
+        if (offset == 0) {
+            filler(buf, ".", NULL, 0, 0);
+            filler(buf, "..", NULL, 0, 0);
+            if (collect_stats()) {
+                filler(buf, STATS_FILE, NULL, 0, 0);
+                filler(buf, STATS_RULES_FILE, NULL, 0, 0);
+            }
+            if (reloadable())
+                filler(buf, STATS_RELOAD_FILE, NULL, 0, 0);
+        }
+        return 0;
+    }
+    WITH_STATS(STATS_READDIR, int, rewrite_readdir(path, buf, filler, offset, fi, flags));
+}
+
+static int stats_releasedir(const char *path, struct fuse_file_info *fi) {
+    if (fi->fh == CONTROL_DIR_FH)
+        return 0;
+    WITH_STATS(STATS_RELEASEDIR, int, rewrite_releasedir(path, fi));
+}
+
+static int stats_mknod(const char *path, mode_t mode, dev_t rdev) {
+    WITH_STATS(STATS_MKNOD, int, rewrite_mknod(path, mode, rdev));
+}
+
+static int stats_mkdir(const char *path, mode_t mode) {
+    WITH_STATS(STATS_MKDIR, int, rewrite_mkdir(path, mode));
+}
+
+static int stats_unlink(const char *path) {
+    WITH_STATS(STATS_UNLINK, int, rewrite_unlink(path));
+}
+
+static int stats_rmdir(const char *path) {
+    WITH_STATS(STATS_RMDIR, int, rewrite_rmdir(path));
+}
+
+static int stats_symlink(const char *from, const char *to) {
+    WITH_STATS(STATS_SYMLINK, int, rewrite_symlink(from, to));
+}
+
+static int stats_rename(const char *from, const char *to, unsigned int flags) {
+    WITH_STATS(STATS_RENAME, int, rewrite_rename(from, to, flags));
+}
+
+static int stats_link(const char *from, const char *to) {
+    WITH_STATS(STATS_LINK, int, rewrite_link(from, to));
+}
+
+static int stats_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    WITH_STATS(STATS_SETATTR, int, rewrite_chmod(path, mode, fi));
+}
+
+static int stats_chown(const char *path, uid_t uid, gid_t gid,
+                       struct fuse_file_info *fi) {
+    WITH_STATS(STATS_SETATTR, int, rewrite_chown(path, uid, gid, fi));
+}
+
+static int stats_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    if (fi ? fi->fh == CONTROL_RELOAD_FH : control_file(path) == CONTROL_RELOAD)
+        return 0;
+    WITH_STATS(STATS_SETATTR, int, rewrite_truncate(path, size, fi));
+}
+
+static int stats_utimens(const char *path, const struct timespec ts[2],
+                         struct fuse_file_info *fi) {
+    WITH_STATS(STATS_SETATTR, int, rewrite_utimens(path, ts, fi));
+}
+
+static int stats_open(const char *path, struct fuse_file_info *fi) {
+    int control = control_file(path), fd;
+
+    if (control == CONTROL_STATS || control == CONTROL_RULES) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fd = stats_open_file(control == CONTROL_STATS ? stats_print : rule_stats_print);
+        if (fd == -1)
+            return -errno;
+        fi->fh = fd;
+        fi->direct_io = 1;
+        return 0;
+    }
+    if (control == CONTROL_RELOAD) {
+        if ((fi->flags & O_ACCMODE) != O_WRONLY)
+            return -EACCES;
+        fi->fh = CONTROL_RELOAD_FH;
+        fi->direct_io = 1;
+        return 0;
+    }
+    WITH_STATS(STATS_OPEN, int, rewrite_open(path, fi));
+}
+
+static int stats_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+    WITH_STATS(STATS_READ, int, rewrite_read(path, buf, size, offset, fi));
+}
+
+static int stats_read_buf(const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset, struct fuse_file_info *fi) {
+    WITH_STATS(STATS_READ, int, rewrite_read_buf(path, bufp, size, offset, fi));
+}
+
+static int stats_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+    if (fi->fh == CONTROL_RELOAD_FH) {
+        reload_request();
+        return size;
+    }
+    WITH_STATS(STATS_WRITE, int, rewrite_write(path, buf, size, offset, fi));
+}
+
+static int stats_write_buf(const char *path, struct fuse_bufvec *buf,
+                           off_t offset, struct fuse_file_info *fi) {
+    if (fi->fh == CONTROL_RELOAD_FH) {
+        reload_request();
+        return fuse_buf_size(buf);
+    }
+    WITH_STATS(STATS_WRITE, int, rewrite_write_buf(path, buf, offset, fi));
+}
+
+static int stats_statfs(const char *path, struct statvfs *stbuf) {
+    WITH_STATS(STATS_STATFS, int, rewrite_statfs(path, stbuf));
+}
+
+static int stats_flush(const char *path, struct fuse_file_info *fi) {
+    if (fi->fh == CONTROL_RELOAD_FH)
+        return 0;
+    WITH_STATS(STATS_FLUSH, int, rewrite_flush(path, fi));
+}
+
+static int stats_release(const char *path, struct fuse_file_info *fi) {
+    if (fi->fh == CONTROL_RELOAD_FH)
+        return 0;
+    WITH_STATS(STATS_RELEASE, int, rewrite_release(path, fi));
+}
+
+static int stats_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    WITH_STATS(STATS_FSYNC, int, rewrite_fsync(path, isdatasync, fi));
+}
+
+static int stats_fallocate(const char *path, int mode, off_t offset, off_t length,
+                           struct fuse_file_info *fi) {
+    WITH_STATS(STATS_FALLOCATE, int, rewrite_fallocate(path, mode, offset, length, fi));
+}
+
+#ifdef HAVE_SETXATTR
+static int stats_setxattr(const char *path, const char *name, const char *value,
+                          size_t size, int flags) {
+    WITH_STATS(STATS_XATTR, int, rewrite_setxattr(path, name, value, size, flags));
+}
+
+static int stats_getxattr(const char *path, const char *name, char *value,
+                          size_t size) {
+    WITH_STATS(STATS_XATTR, int, rewrite_getxattr(path, name, value, size));
+}
+
+static int stats_listxattr(const char *path, char *list, size_t size) {
+    WITH_STATS(STATS_XATTR, int, rewrite_listxattr(path, list, size));
+}
+
+static int stats_removexattr(const char *path, const char *name) {
+    WITH_STATS(STATS_XATTR, int, rewrite_removexattr(path, name));
+}
+#endif /* HAVE_SETXATTR */
+
+static int stats_flock(const char *path, struct fuse_file_info *fi, int op) {
+    WITH_STATS(STATS_FLOCK, int, rewrite_flock(path, fi, op));
+}
+
+static ssize_t stats_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                                     off_t off_in, const char *path_out,
+                                     struct fuse_file_info *fi_out,
+                                     off_t off_out, size_t len, int flags) {
+    WITH_STATS(STATS_COPY_FILE_RANGE, ssize_t,
+               rewrite_copy_file_range(path_in, fi_in, off_in, path_out, fi_out,
+                                       off_out, len, flags));
+}
+
+static off_t stats_lseek(const char *path, off_t off, int whence,
+                         struct fuse_file_info *fi) {
+    WITH_STATS(STATS_LSEEK, off_t, rewrite_lseek(path, off, whence, fi));
+}
+
+static struct fuse_operations rewrite_stats_oper = {
+    .init            = rewrite_init,
+    .destroy         = rewrite_destroy,
+
+    .getattr         = stats_getattr,
+    .readlink        = stats_readlink,
+    .mknod           = stats_mknod,
+    .mkdir           = stats_mkdir,
+    .unlink          = stats_unlink,
+    .rmdir           = stats_rmdir,
+    .symlink         = stats_symlink,
+    .rename          = stats_rename,
+    .link            = stats_link,
+    .chmod           = stats_chmod,
+    .chown           = stats_chown,
+    .truncate        = stats_truncate,
+    .open            = stats_open,
+    .read            = stats_read,
+    .write           = stats_write,
+    .statfs          = stats_statfs,
+    .flush           = stats_flush,
+    .release         = stats_release,
+    .fsync           = stats_fsync,
+    .opendir         = stats_opendir,
+    .readdir         = stats_readdir,
+    .releasedir      = stats_releasedir,
+    .access          = stats_access,
+    .utimens         = stats_utimens,
+    .read_buf        = stats_read_buf,
+    .write_buf       = stats_write_buf,
+    .fallocate       = stats_fallocate,
+
+#ifdef HAVE_SETXATTR
+    .setxattr        = stats_setxattr,
+    .getxattr        = stats_getxattr,
+    .listxattr       = stats_listxattr,
+    .removexattr     = stats_removexattr,
+#endif
+    .flock           = stats_flock,
+    .copy_file_range = stats_copy_file_range,
+    .lseek           = stats_lseek,
+};
+
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     umask(0);
     parse_args(argc, argv, &args);
-    return fuse_main(args.argc, args.argv, &rewrite_oper, NULL);
+    if (collect_stats())
+        stats_setup();
+    if (trace_fd() != -1)
+        trace_start(trace_fd());
+    if (lowlevel())
+        return rewrite_ll_main(&args);
+    return fuse_main(args.argc, args.argv,
+                     control_files() ? &rewrite_stats_oper : &rewrite_oper, NULL);
 }
@@ -0,0 +1,1912 @@
+/* rewritefs_ll.c - inode-based backend for rewritefs
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ *
+ * Based on FUSE's passthrough_ll.c:
+ * Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+ */
+
+#define FUSE_USE_VERSION 31
+
+#define _GNU_SOURCE
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/file.h>
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+#include "rewrite.h"
+#include "inval.h"
+#include "stats.h"
+#include "trace.h"
+#include "negcache.h"
+#include "pagecache.h"
+
+/*
+ * Every inode is a virtual path. The rules are applied when the kernel looks
+ * it up, and the result is kept as an O_PATH descriptor on the rewritten
+ * path, so that operations on the inode don't have to rewrite and walk the
+ * path again.
+ */
+struct ll_inode {
+    struct ll_inode *hnext;
+    char *vpath;    /* protected by inodes.lock */
+    char *rpath;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    uint64_t nlookup; /* protected by inodes.lock */
+    int hashed;       /* protected by inodes.lock */
+    int stale;        /* vpath changed since lookup, protected by inodes.lock */
+    int backing_id;   /* passthrough backing file, protected by inodes.lock */
+    int nbacking;     /* open files using backing_id, protected by inodes.lock */
+};
+
+/* Inodes by virtual path */
+static struct {
+    pthread_mutex_t lock;
+    struct ll_inode **buckets;
+    size_t nbuckets, size;
+} inodes = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static struct fuse_session *session;
+
+static struct ll_inode root = { .vpath = "/", .rpath = ".", .fd = -1, .nlookup = 2 };
+
+/* Virtual directory and files of the statistics */
+static struct ll_inode control_dir = { .vpath = "/" STATS_DIR, .fd = -1, .nlookup = 1 };
+static struct ll_inode stats_file = { .vpath = "/" STATS_DIR "/" STATS_FILE, .fd = -1, .nlookup = 1 };
+static struct ll_inode rules_file = { .vpath = "/" STATS_DIR "/" STATS_RULES_FILE, .fd = -1, .nlookup = 1 };
+static struct ll_inode reload_file = { .vpath = "/" STATS_DIR "/" STATS_RELOAD_FILE, .fd = -1, .nlookup = 1 };
+
+/* Whether reads and writes are passed through to the backing files */
+static int use_passthrough;
+
+/* Whether the current operation failed, for statistics */
+static __thread int op_failed;
+
+static size_t hash_path(const char *path) {
+    size_t h = 5381;
+    while(*path)
+        h = h * 33 + (unsigned char)*path++;
+    return h;
+}
+
+static struct ll_inode *table_find(const char *vpath) {
+    struct ll_inode *inode;
+
+    if(inodes.nbuckets == 0)
+        return NULL;
+    for(inode = inodes.buckets[hash_path(vpath) % inodes.nbuckets]; inode; inode = inode->hnext) {
+        if(!strcmp(inode->vpath, vpath))
+            return inode;
+    }
+    return NULL;
+}
+
+static void table_remove(struct ll_inode *inode) {
+    struct ll_inode **p = &inodes.buckets[hash_path(inode->vpath) % inodes.nbuckets];
+    while(*p != inode)
+        p = &(*p)->hnext;
+    *p = inode->hnext;
+    inode->hashed = 0;
+    inodes.size--;
+}
+
+static int table_insert(struct ll_inode *inode) {
+    size_t b;
+
+    if(inodes.size >= inodes.nbuckets) {
+        size_t nbuckets = inodes.nbuckets ? inodes.nbuckets * 2 : 1024;
+        struct ll_inode **buckets = calloc(nbuckets, sizeof(struct ll_inode *));
+        if(buckets == NULL)
+            return -1;
+        for(size_t i = 0; i < inodes.nbuckets; i++) {
+            struct ll_inode *next;
+            for(struct ll_inode *e = inodes.buckets[i]; e; e = next) {
+                next = e->hnext;
+                b = hash_path(e->vpath) % nbuckets;
+                e->hnext = buckets[b];
+                buckets[b] = e;
+            }
+        }
+        free(inodes.buckets);
+        inodes.buckets = buckets;
+        inodes.nbuckets = nbuckets;
+    }
+
+    b = hash_path(inode->vpath) % inodes.nbuckets;
+    inode->hnext = inodes.buckets[b];
+    inodes.buckets[b] = inode;
+    inode->hashed = 1;
+    inodes.size++;
+    return 0;
+}
+
+static void free_inode(struct ll_inode *inode) {
+    close(inode->fd);
+    free(inode->vpath);
+    free(inode->rpath);
+    free(inode);
+}
+
+static struct ll_inode *get_inode(fuse_ino_t ino) {
+    if(ino == FUSE_ROOT_ID)
+        return &root;
+    return (struct ll_inode *)(uintptr_t)ino;
+}
+
+static void reply_err(fuse_req_t req, int err) {
+    if(err)
+        op_failed = 1;
+    fuse_reply_err(req, err);
+}
+
+static void get_caller(fuse_req_t req, struct rewrite_caller *caller) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    caller->pid = ctx->pid;
+    caller->uid = ctx->uid;
+    caller->gid = ctx->gid;
+    caller->umask = ctx->umask;
+}
+
+static char *child_vpath(struct ll_inode *parent, const char *name) {
+    char *vpath;
+
+    pthread_mutex_lock(&inodes.lock);
+    if(asprintf(&vpath, "%s/%s", parent == &root ? "" : parent->vpath, name) == -1)
+        vpath = NULL;
+    pthread_mutex_unlock(&inodes.lock);
+
+    return vpath;
+}
+
+/* Rewritten path of parent/name, for the caller of req */
+static char *rewrite_child(fuse_req_t req, struct ll_inode *parent, const char *name, char **vpath) {
+    struct rewrite_caller caller;
+    char *rpath;
+
+    *vpath = child_vpath(parent, name);
+    if(*vpath == NULL)
+        return NULL;
+
+    get_caller(req, &caller);
+    rpath = rewrite_as(*vpath, &caller);
+    if(rpath == NULL) {
+        free(*vpath);
+        *vpath = NULL;
+    }
+    return rpath;
+}
+
+/* Rewritten path of parent/name, a file about to be created by req */
+static char *rewrite_new_child(fuse_req_t req, struct ll_inode *parent, const char *name, char **vpath) {
+    struct rewrite_caller caller;
+    char *rpath = rewrite_child(req, parent, name, vpath);
+
+    if(rpath != NULL) {
+        get_caller(req, &caller);
+        autocreate_as(*vpath, rpath, &caller);
+    }
+    return rpath;
+}
+
+/* Creating rpath for req failed: whether to try again, its parents having
+ * been removed outside of the mount and created again */
+static int retry_new_child(fuse_req_t req, const char *vpath, const char *rpath) {
+    struct rewrite_caller caller;
+
+    get_caller(req, &caller);
+    return autocreate_retry_as(vpath, rpath, &caller);
+}
+
+/* Rewritten path of inode for the caller of req, which may differ from the
+ * one it was looked up with if contexts are used or if it was renamed. */
+static char *inode_rpath(fuse_req_t req, struct ll_inode *inode) {
+    struct rewrite_caller caller;
+    char *vpath, *rpath;
+    int stale;
+
+    pthread_mutex_lock(&inodes.lock);
+    stale = inode->stale;
+    vpath = (stale || has_contexts()) ? strdup(inode->vpath) : NULL;
+    pthread_mutex_unlock(&inodes.lock);
+
+    if(!stale && !has_contexts())
+        return strdup(inode->rpath);
+    if(vpath == NULL)
+        return NULL;
+
+    get_caller(req, &caller);
+    rpath = rewrite_as(vpath, &caller);
+    free(vpath);
+    return rpath;
+}
+
+static char *inode_vpath(struct ll_inode *inode) {
+    char *vpath;
+
+    pthread_mutex_lock(&inodes.lock);
+    vpath = strdup(inode->vpath);
+    pthread_mutex_unlock(&inodes.lock);
+    return vpath;
+}
+
+/* O_PATH descriptor of inode for the caller of req. If a new one had to be
+ * opened, it is also stored in tmp_fd and must be closed by the caller. */
+static int inode_fd(fuse_req_t req, struct ll_inode *inode, int *tmp_fd) {
+    char *rpath;
+    int stale;
+
+    *tmp_fd = -1;
+
+    pthread_mutex_lock(&inodes.lock);
+    stale = inode->stale;
+    pthread_mutex_unlock(&inodes.lock);
+    if(!stale && !has_contexts())
+        return inode->fd;
+
+    rpath = inode_rpath(req, inode);
+    if(rpath == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(!stale && !strcmp(rpath, inode->rpath)) {
+        free(rpath);
+        return inode->fd;
+    }
+
+    *tmp_fd = openat(orig_fd(), rpath, O_PATH | O_NOFOLLOW);
+    free(rpath);
+    return *tmp_fd;
+}
+
+static void proc_path(char *buf, int fd) {
+    snprintf(buf, 64, "/proc/self/fd/%d", fd);
+}
+
+/* Whether rpath is the entry name of the directory dir_rpath */
+static int is_entry(const char *rpath, const char *dir_rpath, const char *name) {
+    size_t len = strlen(dir_rpath);
+
+    if(!strcmp(dir_rpath, "."))
+        return !strcmp(rpath, name);
+    return !strncmp(rpath, dir_rpath, len) && rpath[len] == '/' && !strcmp(rpath + len + 1, name);
+}
+
+/* Look parent/name up. If the directory is open as dirfd, rewritten to
+ * dir_rpath, entries that are not rewritten are opened from it. */
+static int lookup_child(fuse_req_t req, struct ll_inode *parent, const char *name,
+                        int dirfd, const char *dir_rpath, struct fuse_entry_param *e) {
+    struct ll_inode *inode, *old;
+    char *vpath, *rpath;
+    int fd, err;
+
+    memset(e, 0, sizeof(*e));
+
+    rpath = rewrite_child(req, parent, name, &vpath);
+    if(rpath == NULL)
+        return ENOMEM;
+    inval_record(vpath, rpath);
+
+    if(negcache_missing(rpath)) {
+        fd = -1;
+        errno = ENOENT;
+    } else if(dirfd != -1 && is_entry(rpath, dir_rpath, name)) {
+        fd = openat(dirfd, name, O_PATH | O_NOFOLLOW);
+    } else {
+        fd = openat(orig_fd(), rpath, O_PATH | O_NOFOLLOW);
+        if(fd == -1 && errno == ENOENT)
+            negcache_add(rpath);
+    }
+    if(fd == -1 || fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+        err = errno;
+        if(fd != -1)
+            close(fd);
+        free(vpath);
+        free(rpath);
+        return err;
+    }
+
+    pthread_mutex_lock(&inodes.lock);
+    old = table_find(vpath);
+    if(old && !old->stale && old->dev == e->attr.st_dev && old->ino == e->attr.st_ino &&
+       !strcmp(old->rpath, rpath)) {
+        old->nlookup++;
+        inode = old;
+        pthread_mutex_unlock(&inodes.lock);
+        close(fd);
+        free(vpath);
+        free(rpath);
+    } else {
+        inode = calloc(1, sizeof(struct ll_inode));
+        if(inode == NULL) {
+            pthread_mutex_unlock(&inodes.lock);
+            close(fd);
+            free(vpath);
+            free(rpath);
+            return ENOMEM;
+        }
+        /* The previous inode, if any, lives on until the kernel forgets it */
+        if(old)
+            table_remove(old);
+        inode->vpath = vpath;
+        inode->rpath = rpath;
+        inode->fd = fd;
+        inode->dev = e->attr.st_dev;
+        inode->ino = e->attr.st_ino;
+        inode->nlookup = 1;
+        /* On allocation failure, the inode is just not shared */
+        table_insert(inode);
+        pthread_mutex_unlock(&inodes.lock);
+    }
+
+    e->ino = (uintptr_t)inode;
+    e->attr_timeout = attr_timeout();
+    e->entry_timeout = entry_timeout();
+    return 0;
+}
+
+static int do_lookup(fuse_req_t req, struct ll_inode *parent, const char *name,
+                     struct fuse_entry_param *e) {
+    return lookup_child(req, parent, name, -1, NULL, e);
+}
+
+static void forget_one(fuse_ino_t ino, uint64_t nlookup) {
+    struct ll_inode *inode = get_inode(ino);
+    int release = 0;
+
+    if(inode == &root || inode == &control_dir || inode == &stats_file || inode == &rules_file ||
+       inode == &reload_file)
+        return;
+
+    pthread_mutex_lock(&inodes.lock);
+    inode->nlookup -= nlookup;
+    if(inode->nlookup == 0) {
+        if(inode->hashed)
+            table_remove(inode);
+        release = 1;
+    }
+    pthread_mutex_unlock(&inodes.lock);
+
+    if(release)
+        free_inode(inode);
+}
+
+/* Drop the inode of vpath from the table, after it was unlinked */
+static void forget_path(const char *vpath) {
+    struct ll_inode *inode;
+
+    pthread_mutex_lock(&inodes.lock);
+    inode = table_find(vpath);
+    if(inode)
+        table_remove(inode);
+    pthread_mutex_unlock(&inodes.lock);
+}
+
+/* Drop the kernel entry of vpath and the attributes of its inode, if the
+ * kernel knows them */
+static void invalidate_path(const char *vpath) {
+    const char *name = strrchr(vpath, '/') + 1;
+    struct ll_inode *parent, *inode;
+    fuse_ino_t parent_ino = 0, ino = 0;
+    char *dir;
+
+    pthread_mutex_lock(&inodes.lock);
+    if(name - 1 == vpath) {
+        parent_ino = FUSE_ROOT_ID;
+    } else if((dir = strndup(vpath, name - 1 - vpath)) != NULL) {
+        parent = table_find(dir);
+        if(parent)
+            parent_ino = (uintptr_t)parent;
+        free(dir);
+    }
+    if(!strcmp(vpath, "/"))
+        ino = FUSE_ROOT_ID;
+    else if((inode = table_find(vpath)) != NULL)
+        ino = (uintptr_t)inode;
+    pthread_mutex_unlock(&inodes.lock);
+
+    if(ino)
+        fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+    if(parent_ino && *name)
+        fuse_lowlevel_notify_inval_entry(session, parent_ino, name, strlen(name));
+}
+
+/* Inodes whose path is rewritten elsewhere by the new rules are resolved by
+ * path until looked up again */
+static void rules_reloaded() {
+    struct ll_inode *inode;
+    char *rpath;
+
+    pthread_mutex_lock(&inodes.lock);
+    for(size_t i = 0; i < inodes.nbuckets; i++) {
+        for(inode = inodes.buckets[i]; inode; inode = inode->hnext) {
+            if(inode->stale)
+                continue;
+            rpath = rewrite_dry(inode->vpath);
+            if(rpath == NULL || strcmp(rpath, inode->rpath))
+                inode->stale = 1;
+            free(rpath);
+        }
+    }
+    pthread_mutex_unlock(&inodes.lock);
+}
+
+static void rewrite_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    int writeback = 0;
+
+    (void)userdata;
+    if(conn->capable & FUSE_CAP_FLOCK_LOCKS)
+        conn->want |= FUSE_CAP_FLOCK_LOCKS;
+    if(passthrough()) {
+#ifdef FUSE_CAP_PASSTHROUGH
+        if(conn->capable & FUSE_CAP_PASSTHROUGH) {
+            conn->want |= FUSE_CAP_PASSTHROUGH;
+            use_passthrough = 1;
+        }
+#endif
+        if(!use_passthrough)
+            fprintf(stderr, "rewritefs: passthrough not supported, falling back to regular I/O\n");
+    }
+    /* Files read and written by the kernel have no pages to buffer */
+    if(writeback_cache() && !use_passthrough) {
+        if(conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+            conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+            writeback = 1;
+        } else {
+            fprintf(stderr, "rewritefs: writeback_cache not supported, writing through\n");
+        }
+    }
+    pagecache_start(page_cache_size(), writeback);
+    if(kernel_cache())
+        inval_start(invalidate_path, kernel_cache_timeout());
+    if(negcache_start(orig_fd(), negative_cache_size()) == -1)
+        fprintf(stderr, "rewritefs: negative_cache not available (%s)\n", strerror(errno));
+    stats_start_dumper(rule_stats_print);
+    reload_start(rules_reloaded);
+}
+
+static void rewrite_ll_destroy(void *userdata) {
+    (void)userdata;
+    reload_stop();
+    stats_stop();
+    trace_stop();
+    inval_stop();
+    negcache_stop();
+    pagecache_stop();
+    rewrite_cleanup();
+}
+
+static void rewrite_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    int err = do_lookup(req, get_inode(parent), name, &e);
+
+    if(err == ENOENT && negative_timeout() > 0) {
+        e.ino = 0;
+        e.entry_timeout = negative_timeout();
+        fuse_reply_entry(req, &e);
+    } else if(err) {
+        reply_err(req, err);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void rewrite_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void rewrite_ll_forget_multi(fuse_req_t req, size_t count,
+                                    struct fuse_forget_data *forgets) {
+    for(size_t i = 0; i < count; i++)
+        forget_one(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void rewrite_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat st;
+    int res, fd, tmp_fd;
+
+    if(fi) {
+        res = fstat(fi->fh, &st);
+    } else {
+        fd = inode_fd(req, get_inode(ino), &tmp_fd);
+        res = fd == -1 ? -1 : fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+        if(tmp_fd != -1)
+            close(tmp_fd);
+    }
+
+    if(res == -1)
+        reply_err(req, errno);
+    else
+        fuse_reply_attr(req, &st, attr_timeout());
+}
+
+/* Attribute changes are rare, they go through the rewritten path like in the
+ * high-level backend */
+static void rewrite_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                               int valid, struct fuse_file_info *fi) {
+    char *rpath = inode_rpath(req, get_inode(ino));
+    char *vpath = inode_vpath(get_inode(ino));
+    int res = 0, fd;
+
+    if(rpath == NULL || vpath == NULL) {
+        free(rpath);
+        free(vpath);
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    if(valid & FUSE_SET_ATTR_MODE) {
+        if(fi)
+            res = fchmod(fi->fh, attr->st_mode);
+        else
+            res = fchmodat(orig_fd(), rpath, attr->st_mode, 0);
+        if(res == -1)
+            goto out;
+    }
+
+    if(valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+        gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+        if(fi)
+            res = fchown(fi->fh, uid, gid);
+        else
+            res = fchownat(orig_fd(), rpath, uid, gid, AT_SYMLINK_NOFOLLOW);
+        if(res == -1)
+            goto out;
+    }
+
+    if(valid & FUSE_SET_ATTR_SIZE) {
+        if(fi) {
+            res = ftruncate(fi->fh, attr->st_size);
+        } else {
+            fd = openat(orig_fd(), rpath, O_WRONLY);
+            if(fd == -1) {
+                res = -1;
+                goto out;
+            }
+            res = ftruncate(fd, attr->st_size);
+            close(fd);
+        }
+        if(res == -1)
+            goto out;
+    }
+
+    if(valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        struct timespec tv[2];
+
+        tv[0].tv_sec = tv[1].tv_sec = 0;
+        tv[0].tv_nsec = tv[1].tv_nsec = UTIME_OMIT;
+        if(valid & FUSE_SET_ATTR_ATIME_NOW)
+            tv[0].tv_nsec = UTIME_NOW;
+        else if(valid & FUSE_SET_ATTR_ATIME)
+            tv[0] = attr->st_atim;
+        if(valid & FUSE_SET_ATTR_MTIME_NOW)
+            tv[1].tv_nsec = UTIME_NOW;
+        else if(valid & FUSE_SET_ATTR_MTIME)
+            tv[1] = attr->st_mtim;
+
+        if(fi)
+            res = futimens(fi->fh, tv);
+        else
+            res = utimensat(orig_fd(), rpath, tv, AT_SYMLINK_NOFOLLOW);
+        if(res == -1)
+            goto out;
+    }
+
+out:
+    if(res == 0)
+        inval_mutated(vpath, rpath);
+    free(rpath);
+    free(vpath);
+    if(res == -1)
+        reply_err(req, errno);
+    else
+        rewrite_ll_getattr(req, ino, fi);
+}
+
+static void rewrite_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    char buf[PATH_MAX + 1];
+    int res, fd, tmp_fd;
+
+    fd = inode_fd(req, get_inode(ino), &tmp_fd);
+    res = fd == -1 ? -1 : readlinkat(fd, "", buf, sizeof(buf) - 1);
+    if(tmp_fd != -1)
+        close(tmp_fd);
+    if(res == -1) {
+        reply_err(req, errno);
+        return;
+    }
+
+    buf[res] = '\0';
+    fuse_reply_readlink(req, buf);
+}
+
+/* Reply to a creation request with the entry of the new file */
+static void reply_new_entry(fuse_req_t req, fuse_ino_t parent, const char *name, int res) {
+    struct fuse_entry_param e;
+    int err;
+
+    if(res == -1) {
+        reply_err(req, errno);
+        return;
+    }
+
+    err = do_lookup(req, get_inode(parent), name, &e);
+    if(err)
+        reply_err(req, err);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void rewrite_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             mode_t mode, dev_t rdev) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    char *vpath, *rpath = rewrite_new_child(req, get_inode(parent), name, &vpath);
+    int res;
+
+    if(rpath == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    AS_USER(ctx->uid, ctx->gid, res = mknodat(orig_fd(), rpath, mode & ~ctx->umask, rdev));
+    if(res == -1 && retry_new_child(req, vpath, rpath))
+        AS_USER(ctx->uid, ctx->gid, res = mknodat(orig_fd(), rpath, mode & ~ctx->umask, rdev));
+    if(res == 0) {
+        negcache_created(rpath);
+        inval_mutated(vpath, rpath);
+    }
+    free(vpath);
+    free(rpath);
+    reply_new_entry(req, parent, name, res);
+}
+
+static void rewrite_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    char *vpath, *rpath = rewrite_new_child(req, get_inode(parent), name, &vpath);
+    int res;
+
+    if(rpath == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    AS_USER(ctx->uid, ctx->gid, res = mkdirat(orig_fd(), rpath, mode & ~ctx->umask));
+    if(res == -1 && retry_new_child(req, vpath, rpath))
+        AS_USER(ctx->uid, ctx->gid, res = mkdirat(orig_fd(), rpath, mode & ~ctx->umask));
+    if(res == 0) {
+        negcache_created(rpath);
+        inval_mutated(vpath, rpath);
+    }
+    free(vpath);
+    free(rpath);
+    reply_new_entry(req, parent, name, res);
+}
+
+static void rewrite_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                               const char *name) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    char *vpath, *rpath = rewrite_new_child(req, get_inode(parent), name, &vpath);
+    int res;
+
+    if(rpath == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    AS_USER(ctx->uid, ctx->gid, res = symlinkat(link, orig_fd(), rpath));
+    if(res == -1 && retry_new_child(req, vpath, rpath))
+        AS_USER(ctx->uid, ctx->gid, res = symlinkat(link, orig_fd(), rpath));
+    if(res == 0) {
+        /* A link to a directory brings the files under it */
+        negcache_flush();
+        inval_mutated(vpath, rpath);
+    }
+    free(vpath);
+    free(rpath);
+    reply_new_entry(req, parent, name, res);
+}
+
+static void rewrite_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                            const char *newname) {
+    char *from = inode_rpath(req, get_inode(ino));
+    char *vpath, *to = rewrite_new_child(req, get_inode(newparent), newname, &vpath);
+    int res;
+
+    if(from == NULL || to == NULL) {
+        free(from);
+        free(to);
+        free(vpath);
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    res = linkat(orig_fd(), from, orig_fd(), to, 0);
+    if(res == -1 && retry_new_child(req, vpath, to))
+        res = linkat(orig_fd(), from, orig_fd(), to, 0);
+    if(res == 0) {
+        negcache_created(to);
+        inval_mutated(vpath, to);
+    }
+    free(from);
+    free(to);
+    free(vpath);
+    reply_new_entry(req, newparent, newname, res);
+}
+
+static void rewrite_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char *vpath, *rpath = rewrite_child(req, get_inode(parent), name, &vpath);
+    int res;
+
+    if(rpath == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    res = unlinkat(orig_fd(), rpath, 0);
+    if(res == 0) {
+        forget_path(vpath);
+        inval_mutated(vpath, rpath);
+    }
+    free(vpath);
+    free(rpath);
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+static void rewrite_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char *vpath, *rpath = rewrite_child(req, get_inode(parent), name, &vpath);
+    int res;
+
+    if(rpath == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    res = unlinkat(orig_fd(), rpath, AT_REMOVEDIR);
+    if(res == 0) {
+        autocreate_forget();
+        forget_path(vpath);
+        inval_mutated(vpath, rpath);
+    }
+    free(vpath);
+    free(rpath);
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+/* Move the inodes of from and its descendants to the virtual path to. Their
+ * descriptors follow the renamed file, but the rules may not agree, so they
+ * are marked stale and resolved again by path until looked up again. */
+static void rename_inodes(const char *from, const char *to) {
+    struct ll_inode *moved = NULL, *inode, *next;
+    size_t from_len = strlen(from);
+    char *vpath;
+
+    pthread_mutex_lock(&inodes.lock);
+    inode = table_find(to);
+    if(inode)
+        table_remove(inode);
+
+    for(size_t i = 0; i < inodes.nbuckets; i++) {
+        for(inode = inodes.buckets[i]; inode; inode = next) {
+            next = inode->hnext;
+            if(!strncmp(inode->vpath, from, from_len) &&
+               (inode->vpath[from_len] == '\0' || inode->vpath[from_len] == '/')) {
+                table_remove(inode);
+                inode->hnext = moved;
+                moved = inode;
+            }
+        }
+    }
+
+    for(inode = moved; inode; inode = next) {
+        next = inode->hnext;
+        if(asprintf(&vpath, "%s%s", to, inode->vpath + from_len) != -1) {
+            free(inode->vpath);
+            inode->vpath = vpath;
+        }
+        inode->stale = 1;
+        /* On allocation failure, the inode can still be found by its number */
+        table_insert(inode);
+    }
+    pthread_mutex_unlock(&inodes.lock);
+}
+
+static void rewrite_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                              fuse_ino_t newparent, const char *newname, unsigned int flags) {
+    char *vfrom, *vto, *from, *to;
+    int res;
+
+    if(flags != 0) {
+        reply_err(req, EINVAL);
+        return;
+    }
+
+    from = rewrite_child(req, get_inode(parent), name, &vfrom);
+    to = rewrite_new_child(req, get_inode(newparent), newname, &vto);
+    if(from == NULL || to == NULL) {
+        free(from);
+        free(vfrom);
+        free(to);
+        free(vto);
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    res = renameat(orig_fd(), from, orig_fd(), to);
+    if(res == -1 && retry_new_child(req, vto, to))
+        res = renameat(orig_fd(), from, orig_fd(), to);
+    if(res == 0) {
+        negcache_flush();
+        autocreate_forget();
+        rename_inodes(vfrom, vto);
+        inval_mutated(vfrom, from);
+        inval_mutated(vto, to);
+    }
+    free(from);
+    free(vfrom);
+    free(to);
+    free(vto);
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+/* Open inode, through the magic link of its O_PATH descriptor */
+static int open_inode(fuse_req_t req, fuse_ino_t ino, int flags) {
+    char path[64];
+    int fd, tmp_fd, res;
+
+    fd = inode_fd(req, get_inode(ino), &tmp_fd);
+    if(fd == -1)
+        return -1;
+
+    proc_path(path, fd);
+    res = open(path, flags & ~O_NOFOLLOW);
+    if(tmp_fd != -1) {
+        int err = errno;
+        close(tmp_fd);
+        errno = err;
+    }
+    return res;
+}
+
+static void inode_mutated(fuse_req_t req, fuse_ino_t ino) {
+    char *vpath, *rpath;
+
+    if(!kernel_cache())
+        return;
+
+    vpath = inode_vpath(get_inode(ino));
+    rpath = inode_rpath(req, get_inode(ino));
+    if(vpath && rpath)
+        inval_mutated(vpath, rpath);
+    free(vpath);
+    free(rpath);
+}
+
+/* Writes through fd must invalidate the aliases of inode */
+static void track_open(fuse_req_t req, fuse_ino_t ino, int fd, int flags) {
+    char *vpath, *rpath;
+
+    if(!kernel_cache() || (flags & O_ACCMODE) == O_RDONLY)
+        return;
+
+    vpath = inode_vpath(get_inode(ino));
+    rpath = inode_rpath(req, get_inode(ino));
+    if(vpath && rpath) {
+        if(flags & O_TRUNC)
+            inval_mutated(vpath, rpath);
+        inval_open(fd, flags, vpath, rpath);
+    }
+    free(vpath);
+    free(rpath);
+}
+
+/*
+ * Let the kernel do the reads and writes of fi on fd. The kernel allows only
+ * one backing file per inode, which is shared by all the open files of the
+ * inode, and is reopened with the flags of each one. So it is not used when
+ * the file depends on the caller or on a stale path.
+ */
+static void open_backing(fuse_req_t req, fuse_ino_t ino, int fd, struct fuse_file_info *fi) {
+#ifdef FUSE_CAP_PASSTHROUGH
+    struct ll_inode *inode = get_inode(ino);
+
+    pthread_mutex_lock(&inodes.lock);
+    if(inode->backing_id == 0 && __atomic_load_n(&use_passthrough, __ATOMIC_RELAXED)
+       && !inode->stale && !has_contexts()) {
+        int id = fuse_passthrough_open(req, fd);
+        if(id > 0) {
+            inode->backing_id = id;
+        } else if(__atomic_exchange_n(&use_passthrough, 0, __ATOMIC_RELAXED)) {
+            fprintf(stderr, "rewritefs: passthrough failed, falling back to regular I/O\n");
+        }
+    }
+    if(inode->backing_id) {
+        inode->nbacking++;
+        fi->backing_id = inode->backing_id;
+    }
+    pthread_mutex_unlock(&inodes.lock);
+#else
+    (void)req; (void)ino; (void)fd; (void)fi;
+#endif
+}
+
+static void close_backing(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+#ifdef FUSE_CAP_PASSTHROUGH
+    struct ll_inode *inode = get_inode(ino);
+
+    if(fi->backing_id == 0)
+        return;
+    pthread_mutex_lock(&inodes.lock);
+    if(--inode->nbacking == 0) {
+        fuse_passthrough_close(req, inode->backing_id);
+        inode->backing_id = 0;
+    }
+    pthread_mutex_unlock(&inodes.lock);
+#else
+    (void)req; (void)ino; (void)fi;
+#endif
+}
+
+/* Whether the kernel may keep the pages of inode, opened as fd with flags */
+static int keep_cache(fuse_ino_t ino, int fd, int flags) {
+    char *vpath;
+    int res;
+
+    if(page_cache_size() <= 0)
+        return 0;
+    vpath = inode_vpath(get_inode(ino));
+    res = vpath ? pagecache_opened(vpath, fd, flags) : 0;
+    free(vpath);
+    return res;
+}
+
+static void rewrite_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int fd = open_inode(req, ino, pagecache_open_flags(fi->flags)), flags;
+
+    /* Written without the page cache if it can't be read */
+    if(fd == -1 && errno == EACCES && (flags = pagecache_write_only_flags(fi->flags)) != -1) {
+        fd = open_inode(req, ino, flags);
+        fi->direct_io = fd != -1;
+    }
+    if(fd == -1) {
+        reply_err(req, errno);
+        return;
+    }
+
+    track_open(req, ino, fd, fi->flags);
+    fi->keep_cache = fi->direct_io ? 0 : keep_cache(ino, fd, fi->flags);
+    fi->fh = fd;
+    open_backing(req, ino, fd, fi);
+    fuse_reply_open(req, fi);
+}
+
+static void rewrite_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                              mode_t mode, struct fuse_file_info *fi) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    char *vpath, *rpath = rewrite_new_child(req, get_inode(parent), name, &vpath);
+    struct fuse_entry_param e;
+    int fd, err, flags;
+
+    if(rpath == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    AS_USER(ctx->uid, ctx->gid, fd = openat(orig_fd(), rpath, pagecache_open_flags(fi->flags) | O_CREAT,
+                                            mode & ~ctx->umask));
+    if(fd == -1 && retry_new_child(req, vpath, rpath))
+        AS_USER(ctx->uid, ctx->gid, fd = openat(orig_fd(), rpath, pagecache_open_flags(fi->flags) | O_CREAT,
+                                                mode & ~ctx->umask));
+    /* Written without the page cache if it can't be read */
+    if(fd == -1 && errno == EACCES && (flags = pagecache_write_only_flags(fi->flags)) != -1) {
+        AS_USER(ctx->uid, ctx->gid, fd = openat(orig_fd(), rpath, flags | O_CREAT, mode & ~ctx->umask));
+        fi->direct_io = fd != -1;
+    }
+    if(fd == -1) {
+        free(vpath);
+        free(rpath);
+        reply_err(req, errno);
+        return;
+    }
+    negcache_created(rpath);
+    inval_mutated(vpath, rpath);
+    inval_open(fd, fi->flags, vpath, rpath);
+    fi->keep_cache = fi->direct_io ? 0 : pagecache_opened(vpath, fd, fi->flags);
+    free(vpath);
+    free(rpath);
+
+    err = do_lookup(req, get_inode(parent), name, &e);
+    if(err) {
+        close(fd);
+        reply_err(req, err);
+        return;
+    }
+
+    fi->fh = fd;
+    open_backing(req, e.ino, fd, fi);
+    fuse_reply_create(req, &e, fi);
+}
+
+static void rewrite_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                            struct fuse_file_info *fi) {
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+    (void)ino;
+    buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    buf.buf[0].fd = fi->fh;
+    buf.buf[0].pos = offset;
+
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void rewrite_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+                                 off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+    ssize_t res;
+
+    (void)ino;
+    out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    out_buf.buf[0].fd = fi->fh;
+    out_buf.buf[0].pos = offset;
+
+    res = fuse_buf_copy(&out_buf, in_buf, FUSE_BUF_SPLICE_NONBLOCK);
+    if(res < 0)
+        reply_err(req, -res);
+    else
+        fuse_reply_write(req, (size_t)res);
+}
+
+static void rewrite_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int res;
+
+    (void)ino;
+    res = close(dup(fi->fh));
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+static void rewrite_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    close_backing(req, ino, fi);
+    inval_release(fi->fh);
+    pagecache_released(fi->fh);
+    close(fi->fh);
+    reply_err(req, 0);
+}
+
+static void rewrite_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                             struct fuse_file_info *fi) {
+    int res;
+
+    (void)ino;
+#ifdef HAVE_FDATASYNC
+    if(datasync)
+        res = fdatasync(fi->fh);
+    else
+#endif
+        res = fsync(fi->fh);
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+struct ll_dirp {
+    DIR *dp;
+    struct dirent *entry;
+    off_t offset;
+    char *rpath;
+};
+
+static inline struct ll_dirp *get_dirp(struct fuse_file_info *fi) {
+    return (struct ll_dirp *)(uintptr_t)fi->fh;
+}
+
+static void rewrite_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct ll_dirp *d = malloc(sizeof(struct ll_dirp));
+    int fd;
+
+    if(d == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    d->rpath = inode_rpath(req, get_inode(ino));
+    if(d->rpath == NULL) {
+        free(d);
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    fd = open_inode(req, ino, O_RDONLY | O_DIRECTORY);
+    if(fd == -1) {
+        free(d->rpath);
+        free(d);
+        reply_err(req, errno);
+        return;
+    }
+
+    d->dp = fdopendir(fd);
+    if(d->dp == NULL) {
+        int err = errno;
+        close(fd);
+        free(d->rpath);
+        free(d);
+        reply_err(req, err);
+        return;
+    }
+    d->offset = 0;
+    d->entry = NULL;
+
+    fi->fh = (uintptr_t)d;
+    fuse_reply_open(req, fi);
+}
+
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi, int plus) {
+    struct ll_dirp *d = get_dirp(fi);
+    char *buf, *p;
+    size_t rem = size;
+    int err = 0;
+
+    buf = p = malloc(size);
+    if(buf == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    if(offset != d->offset) {
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+    for(;;) {
+        struct stat st;
+        size_t entsize;
+        off_t nextoff;
+
+        if(!d->entry) {
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if(!d->entry) {
+                err = errno;
+                break;
+            }
+        }
+
+        nextoff = telldir(d->dp);
+        if(plus) {
+            struct fuse_entry_param e;
+            const char *name = d->entry->d_name;
+
+            /* Entries that can't be looked up are still listed, without attributes */
+            if(!strcmp(name, ".") || !strcmp(name, "..") ||
+               lookup_child(req, get_inode(ino), name, dirfd(d->dp), d->rpath, &e) != 0) {
+                memset(&e, 0, sizeof(e));
+                e.attr.st_ino = d->entry->d_ino;
+                e.attr.st_mode = d->entry->d_type << 12;
+            }
+            entsize = fuse_add_direntry_plus(req, p, rem, name, &e, nextoff);
+            if(entsize > rem) {
+                if(e.ino)
+                    forget_one(e.ino, 1);
+                break;
+            }
+        } else {
+            memset(&st, 0, sizeof(st));
+            st.st_ino = d->entry->d_ino;
+            st.st_mode = d->entry->d_type << 12;
+            entsize = fuse_add_direntry(req, p, rem, d->entry->d_name, &st, nextoff);
+            if(entsize > rem)
+                break;
+        }
+
+        p += entsize;
+        rem -= entsize;
+        d->entry = NULL;
+        d->offset = nextoff;
+    }
+
+    if(err && rem == size)
+        reply_err(req, err);
+    else
+        fuse_reply_buf(req, buf, size - rem);
+    free(buf);
+}
+
+static void rewrite_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                               struct fuse_file_info *fi) {
+    do_readdir(req, ino, size, offset, fi, 0);
+}
+
+/* List entries with their attributes, so that the kernel doesn't have to look
+ * them up one by one */
+static void rewrite_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                   struct fuse_file_info *fi) {
+    do_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void rewrite_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct ll_dirp *d = get_dirp(fi);
+
+    (void)ino;
+    closedir(d->dp);
+    free(d->rpath);
+    free(d);
+    reply_err(req, 0);
+}
+
+static void rewrite_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                                struct fuse_file_info *fi) {
+    int res, fd = dirfd(get_dirp(fi)->dp);
+
+    (void)ino;
+#ifdef HAVE_FDATASYNC
+    if(datasync)
+        res = fdatasync(fd);
+    else
+#endif
+        res = fsync(fd);
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+static void rewrite_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct statvfs st;
+    int res, fd, tmp_fd;
+
+    fd = inode_fd(req, get_inode(ino), &tmp_fd);
+    res = fd == -1 ? -1 : fstatvfs(fd, &st);
+    if(tmp_fd != -1)
+        close(tmp_fd);
+
+    if(res == -1)
+        reply_err(req, errno);
+    else
+        fuse_reply_statfs(req, &st);
+}
+
+static void rewrite_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                                 off_t offset, off_t length, struct fuse_file_info *fi) {
+    (void)ino;
+    if(mode) {
+        reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    reply_err(req, posix_fallocate(fi->fh, offset, length));
+}
+
+static void rewrite_ll_flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int op) {
+    int res;
+
+    (void)ino;
+    res = flock(fi->fh, op);
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+static void rewrite_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                                       struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+                                       off_t off_out, struct fuse_file_info *fi_out,
+                                       size_t len, int flags) {
+    ssize_t res;
+
+    (void)ino_in;
+    (void)ino_out;
+    res = copy_file_range(fi_in->fh, &off_in, fi_out->fh, &off_out, len, flags);
+    if(res == -1)
+        reply_err(req, errno);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void rewrite_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                             struct fuse_file_info *fi) {
+    off_t res;
+
+    (void)ino;
+    res = lseek(fi->fh, off, whence);
+    if(res == -1)
+        reply_err(req, errno);
+    else
+        fuse_reply_lseek(req, res);
+}
+
+#ifdef HAVE_SETXATTR
+static void rewrite_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                                const char *value, size_t size, int flags) {
+    int res, fd = open_inode(req, ino, O_RDONLY);
+
+    if(fd == -1) {
+        reply_err(req, errno);
+        return;
+    }
+
+    res = fsetxattr(fd, name, value, size, flags);
+    close(fd);
+    if(res == 0)
+        inode_mutated(req, ino);
+    reply_err(req, res == -1 ? errno : 0);
+}
+
+static void rewrite_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    char *value = NULL;
+    ssize_t res;
+    int fd = open_inode(req, ino, O_RDONLY);
+
+    if(fd == -1) {
+        reply_err(req, errno);
+        return;
+    }
+
+    if(size) {
+        value = malloc(size);
+        if(value == NULL) {
+            close(fd);
+            reply_err(req, ENOMEM);
+            return;
+        }
+    }
+
+    res = fgetxattr(fd, name, value, size);
+    if(res == -1)
+        reply_err(req, errno);
+    else if(size)
+        fuse_reply_buf(req, value, res);
+    else
+        fuse_reply_xattr(req, res);
+    free(value);
+    close(fd);
+}
+
+static void rewrite_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    char *list = NULL;
+    ssize_t res;
+    int fd = open_inode(req, ino, O_RDONLY);
+
+    if(fd == -1) {
+        reply_err(req, errno);
+        return;
+    }
+
+    if(size) {
+        list = malloc(size);
+        if(list == NULL) {
+            close(fd);
+            reply_err(req, ENOMEM);
+            return;
+        }
+    }
+
+    res = flistxattr(fd, list, size);
+    if(res == -1)
+        reply_err(req, errno);
+    else if(size)
+        fuse_reply_buf(req, list, res);
+    else
+        fuse_reply_xattr(req, res);
+    free(list);
+    close(fd);
+}
+
+static void rewrite_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    int res, fd = open_inode(req, ino, O_RDONLY);
+
+    if(fd == -1) {
+        reply_err(req, errno);
+        return;
+    }
+
+    res = fremovexattr(fd, name);
+    close(fd);
+    if(res == 0)
+        inode_mutated(req, ino);
+    reply_err(req, res == -1 ? errno : 0);
+}
+#endif /* HAVE_SETXATTR */
+
+static struct fuse_lowlevel_ops rewrite_ll_oper = {
+    .init            = rewrite_ll_init,
+    .destroy         = rewrite_ll_destroy,
+    .lookup          = rewrite_ll_lookup,
+    .forget          = rewrite_ll_forget,
+    .forget_multi    = rewrite_ll_forget_multi,
+    .getattr         = rewrite_ll_getattr,
+    .setattr         = rewrite_ll_setattr,
+    .readlink        = rewrite_ll_readlink,
+    .mknod           = rewrite_ll_mknod,
+    .mkdir           = rewrite_ll_mkdir,
+    .symlink         = rewrite_ll_symlink,
+    .link            = rewrite_ll_link,
+    .unlink          = rewrite_ll_unlink,
+    .rmdir           = rewrite_ll_rmdir,
+    .rename          = rewrite_ll_rename,
+    .open            = rewrite_ll_open,
+    .create          = rewrite_ll_create,
+    .read            = rewrite_ll_read,
+    .write_buf       = rewrite_ll_write_buf,
+    .flush           = rewrite_ll_flush,
+    .release         = rewrite_ll_release,
+    .fsync           = rewrite_ll_fsync,
+    .opendir         = rewrite_ll_opendir,
+    .readdir         = rewrite_ll_readdir,
+    .readdirplus     = rewrite_ll_readdirplus,
+    .releasedir      = rewrite_ll_releasedir,
+    .fsyncdir        = rewrite_ll_fsyncdir,
+    .statfs          = rewrite_ll_statfs,
+    .fallocate       = rewrite_ll_fallocate,
+    .flock           = rewrite_ll_flock,
+    .copy_file_range = rewrite_ll_copy_file_range,
+    .lseek           = rewrite_ll_lseek,
+#ifdef HAVE_SETXATTR
+    .setxattr        = rewrite_ll_setxattr,
+    .getxattr        = rewrite_ll_getxattr,
+    .listxattr       = rewrite_ll_listxattr,
+    .removexattr     = rewrite_ll_removexattr,
+#endif
+};
+
+/*
+ * Control files: with stats, every operation is timed by a wrapper, and the
+ * statistics are served as virtual files. Writing to the reload file, there
+ * whenever a configuration file is, reloads the rules.
+ */
+
+static int is_control(fuse_ino_t ino) {
+    struct ll_inode *inode = get_inode(ino);
+    return inode == &control_dir || inode == &stats_file || inode == &rules_file ||
+           inode == &reload_file;
+}
+
+static void control_attr(struct ll_inode *inode, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = (uintptr_t)inode;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    if(inode == &control_dir) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | (inode == &reload_file ? 0200 : 0444);
+        st->st_nlink = 1;
+    }
+}
+
+/* Reply with the entry of a virtual inode, or return 0 if parent/name isn't one */
+static int control_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    struct ll_inode *inode;
+
+    if(parent == FUSE_ROOT_ID && !strcmp(name, STATS_DIR))
+        inode = &control_dir;
+    else if(get_inode(parent) == &control_dir && collect_stats() && !strcmp(name, STATS_FILE))
+        inode = &stats_file;
+    else if(get_inode(parent) == &control_dir && collect_stats() && !strcmp(name, STATS_RULES_FILE))
+        inode = &rules_file;
+    else if(get_inode(parent) == &control_dir && reloadable() && !strcmp(name, STATS_RELOAD_FILE))
+        inode = &reload_file;
+    else if(get_inode(parent) == &control_dir)
+        inode = NULL;
+    else
+        return 0;
+
+    if(inode == NULL) {
+        reply_err(req, ENOENT);
+        return 1;
+    }
+    memset(&e, 0, sizeof(e));
+    e.ino = (uintptr_t)inode;
+    control_attr(inode, &e.attr);
+    fuse_reply_entry(req, &e);
+    return 1;
+}
+
+/* File handle of the virtual directory, never a struct ll_dirp */
+#define CONTROL_DIR_FH 0
+
+#define WITH_STATS(op, call) { \
+    struct stats_timer _timer; \
+    if(!stats_enabled()) { \
+        call; \
+        return; \
+    } \
+    stats_begin(&_timer); \
+    op_failed = 0; \
+    call; \
+    stats_end(&_timer, op, op_failed); \
+}
+
+/* Virtual inodes can't be modified */
+#define NOT_CONTROL(ino) \
+    if(is_control(ino)) { \
+        reply_err(req, EPERM); \
+        return; \
+    }
+
+static void stats_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if(control_lookup(req, parent, name))
+        return;
+    WITH_STATS(STATS_LOOKUP, rewrite_ll_lookup(req, parent, name));
+}
+
+static void stats_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    WITH_STATS(STATS_FORGET, rewrite_ll_forget(req, ino, nlookup));
+}
+
+static void stats_ll_forget_multi(fuse_req_t req, size_t count,
+                                  struct fuse_forget_data *forgets) {
+    WITH_STATS(STATS_FORGET, rewrite_ll_forget_multi(req, count, forgets));
+}
+
+static void stats_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat st;
+
+    if(is_control(ino)) {
+        control_attr(get_inode(ino), &st);
+        fuse_reply_attr(req, &st, 0);
+        return;
+    }
+    WITH_STATS(STATS_GETATTR, rewrite_ll_getattr(req, ino, fi));
+}
+
+static void stats_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                             int valid, struct fuse_file_info *fi) {
+    struct stat st;
+
+    /* Writing with O_TRUNC */
+    if(get_inode(ino) == &reload_file && valid == FUSE_SET_ATTR_SIZE) {
+        control_attr(&reload_file, &st);
+        fuse_reply_attr(req, &st, 0);
+        return;
+    }
+    NOT_CONTROL(ino);
+    WITH_STATS(STATS_SETATTR, rewrite_ll_setattr(req, ino, attr, valid, fi));
+}
+
+static void stats_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    NOT_CONTROL(ino);
+    WITH_STATS(STATS_READLINK, rewrite_ll_readlink(req, ino));
+}
+
+static void stats_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, dev_t rdev) {
+    NOT_CONTROL(parent);
+    WITH_STATS(STATS_MKNOD, rewrite_ll_mknod(req, parent, name, mode, rdev));
+}
+
+static void stats_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    NOT_CONTROL(parent);
+    WITH_STATS(STATS_MKDIR, rewrite_ll_mkdir(req, parent, name, mode));
+}
+
+static void stats_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                             const char *name) {
+    NOT_CONTROL(parent);
+    WITH_STATS(STATS_SYMLINK, rewrite_ll_symlink(req, link, parent, name));
+}
+
+static void stats_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                          const char *newname) {
+    NOT_CONTROL(ino);
+    NOT_CONTROL(newparent);
+    WITH_STATS(STATS_LINK, rewrite_ll_link(req, ino, newparent, newname));
+}
+
+static void stats_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    NOT_CONTROL(parent);
+    WITH_STATS(STATS_UNLINK, rewrite_ll_unlink(req, parent, name));
+}
+
+static void stats_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    NOT_CONTROL(parent);
+    WITH_STATS(STATS_RMDIR, rewrite_ll_rmdir(req, parent, name));
+}
+
+static void stats_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            fuse_ino_t newparent, const char *newname, unsigned int flags) {
+    NOT_CONTROL(parent);
+    NOT_CONTROL(newparent);
+    WITH_STATS(STATS_RENAME, rewrite_ll_rename(req, parent, name, newparent, newname, flags));
+}
+
+static void stats_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct ll_inode *inode = get_inode(ino);
+    int fd;
+
+    if(inode == &stats_file || inode == &rules_file) {
+        if((fi->flags & O_ACCMODE) != O_RDONLY) {
+            reply_err(req, EACCES);
+            return;
+        }
+        fd = stats_open_file(inode == &stats_file ? stats_print : rule_stats_print);
+        if(fd == -1) {
+            reply_err(req, errno);
+            return;
+        }
+        fi->fh = fd;
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+        return;
+    }
+    if(inode == &reload_file) {
+        if((fi->flags & O_ACCMODE) != O_WRONLY) {
+            reply_err(req, EACCES);
+            return;
+        }
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+        return;
+    }
+    NOT_CONTROL(ino);
+    WITH_STATS(STATS_OPEN, rewrite_ll_open(req, ino, fi));
+}
+
+static void stats_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            mode_t mode, struct fuse_file_info *fi) {
+    NOT_CONTROL(parent);
+    WITH_STATS(STATS_CREATE, rewrite_ll_create(req, parent, name, mode, fi));
+}
+
+static void stats_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+    WITH_STATS(STATS_READ, rewrite_ll_read(req, ino, size, offset, fi));
+}
+
+static void stats_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+                               off_t offset, struct fuse_file_info *fi) {
+    if(get_inode(ino) == &reload_file) {
+        reload_request();
+        fuse_reply_write(req, fuse_buf_size(in_buf));
+        return;
+    }
+    WITH_STATS(STATS_WRITE, rewrite_ll_write_buf(req, ino, in_buf, offset, fi));
+}
+
+static void stats_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if(get_inode(ino) == &reload_file) {
+        reply_err(req, 0);
+        return;
+    }
+    WITH_STATS(STATS_FLUSH, rewrite_ll_flush(req, ino, fi));
+}
+
+static void stats_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if(get_inode(ino) == &reload_file) {
+        reply_err(req, 0);
+        return;
+    }
+    WITH_STATS(STATS_RELEASE, rewrite_ll_release(req, ino, fi));
+}
+
+static void stats_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                           struct fuse_file_info *fi) {
+    WITH_STATS(STATS_FSYNC, rewrite_ll_fsync(req, ino, datasync, fi));
+}
+
+static void stats_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if(get_inode(ino) == &control_dir) {
+        fi->fh = CONTROL_DIR_FH;
+        fuse_reply_open(req, fi);
+        return;
+    }
+    NOT_CONTROL(ino);
+    WITH_STATS(STATS_OPENDIR, rewrite_ll_opendir(req, ino, fi));
+}
+
+static void control_readdir(fuse_req_t req, size_t size, off_t offset, int plus) {
+    const char *names[5] = { ".", ".." };
+    struct fuse_entry_param e;
+    char *buf = calloc(1, size), *p = buf;
+    size_t rem = size, entsize;
+    int n = 2;
+
+    if(buf == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+    if(collect_stats()) {
+        names[n++] = STATS_FILE;
+        names[n++] = STATS_RULES_FILE;
+    }
+    if(reloadable())
+        names[n++] = STATS_RELOAD_FILE;
+    for(off_t i = offset; i < n; i++) {
+        memset(&e, 0, sizeof(e));
+        e.attr.st_mode = i < 2 ? S_IFDIR : S_IFREG;
+        if(plus)
+            entsize = fuse_add_direntry_plus(req, p, rem, names[i], &e, i + 1);
+        else
+            entsize = fuse_add_direntry(req, p, rem, names[i], &e.attr, i + 1);
+        if(entsize > rem)
+            break;
+        p += entsize;
+        rem -= entsize;
+    }
+    fuse_reply_buf(req, buf, size - rem);
+    free(buf);
+}
+
+static void stats_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                             struct fuse_file_info *fi) {
+    if(fi->fh == CONTROL_DIR_FH) {
+        control_readdir(req, size, offset, 0);
+        return;
+    }
+    WITH_STATS(STATS_READDIR, rewrite_ll_readdir(req, ino, size, offset, fi));
+}
+
+static void stats_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                 struct fuse_file_info *fi) {
+    if(fi->fh == CONTROL_DIR_FH) {
+        control_readdir(req, size, offset, 1);
+        return;
+    }
+    WITH_STATS(STATS_READDIR, rewrite_ll_readdirplus(req, ino, size, offset, fi));
+}
+
+static void stats_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if(fi->fh == CONTROL_DIR_FH) {
+        reply_err(req, 0);
+        return;
+    }
+    WITH_STATS(STATS_RELEASEDIR, rewrite_ll_releasedir(req, ino, fi));
+}
+
+static void stats_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                              struct fuse_file_info *fi) {
+    NOT_CONTROL(ino);
+    WITH_STATS(STATS_FSYNCDIR, rewrite_ll_fsyncdir(req, ino, datasync, fi));
+}
+
+static void stats_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    if(is_control(ino))
+        ino = FUSE_ROOT_ID;
+    WITH_STATS(STATS_STATFS, rewrite_ll_statfs(req, ino));
+}
+
+static void stats_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                               off_t offset, off_t length, struct fuse_file_info *fi) {
+    WITH_STATS(STATS_FALLOCATE, rewrite_ll_fallocate(req, ino, mode, offset, length, fi));
+}
+
+static void stats_ll_flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int op) {
+    WITH_STATS(STATS_FLOCK, rewrite_ll_flock(req, ino, fi, op));
+}
+
+static void stats_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                                     struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+                                     off_t off_out, struct fuse_file_info *fi_out,
+                                     size_t len, int flags) {
+    NOT_CONTROL(ino_out);
+    WITH_STATS(STATS_COPY_FILE_RANGE,
+               rewrite_ll_copy_file_range(req, ino_in, off_in, fi_in, ino_out, off_out,
+                                          fi_out, len, flags));
+}
+
+static void stats_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                           struct fuse_file_info *fi) {
+    WITH_STATS(STATS_LSEEK, rewrite_ll_lseek(req, ino, off, whence, fi));
+}
+
+#ifdef HAVE_SETXATTR
+static void stats_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                              const char *value, size_t size, int flags) {
+    NOT_CONTROL(ino);
+    WITH_STATS(STATS_XATTR, rewrite_ll_setxattr(req, ino, name, value, size, flags));
+}
+
+static void stats_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    if(is_control(ino)) {
+        reply_err(req, ENODATA);
+        return;
+    }
+    WITH_STATS(STATS_XATTR, rewrite_ll_getxattr(req, ino, name, size));
+}
+
+static void stats_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    if(is_control(ino)) {
+        if(size)
+            fuse_reply_buf(req, NULL, 0);
+        else
+            fuse_reply_xattr(req, 0);
+        return;
+    }
+    WITH_STATS(STATS_XATTR, rewrite_ll_listxattr(req, ino, size));
+}
+
+static void stats_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    NOT_CONTROL(ino);
+    WITH_STATS(STATS_XATTR, rewrite_ll_removexattr(req, ino, name));
+}
+#endif /* HAVE_SETXATTR */
+
+static struct fuse_lowlevel_ops rewrite_ll_stats_oper = {
+    .init            = rewrite_ll_init,
+    .destroy         = rewrite_ll_destroy,
+    .lookup          = stats_ll_lookup,
+    .forget          = stats_ll_forget,
+    .forget_multi    = stats_ll_forget_multi,
+    .getattr         = stats_ll_getattr,
+    .setattr         = stats_ll_setattr,
+    .readlink        = stats_ll_readlink,
+    .mknod           = stats_ll_mknod,
+    .mkdir           = stats_ll_mkdir,
+    .symlink         = stats_ll_symlink,
+    .link            = stats_ll_link,
+    .unlink          = stats_ll_unlink,
+    .rmdir           = stats_ll_rmdir,
+    .rename          = stats_ll_rename,
+    .open            = stats_ll_open,
+    .create          = stats_ll_create,
+    .read            = stats_ll_read,
+    .write_buf       = stats_ll_write_buf,
+    .flush           = stats_ll_flush,
+    .release         = stats_ll_release,
+    .fsync           = stats_ll_fsync,
+    .opendir         = stats_ll_opendir,
+    .readdir         = stats_ll_readdir,
+    .readdirplus     = stats_ll_readdirplus,
+    .releasedir      = stats_ll_releasedir,
+    .fsyncdir        = stats_ll_fsyncdir,
+    .statfs          = stats_ll_statfs,
+    .fallocate       = stats_ll_fallocate,
+    .flock           = stats_ll_flock,
+    .copy_file_range = stats_ll_copy_file_range,
+    .lseek           = stats_ll_lseek,
+#ifdef HAVE_SETXATTR
+    .setxattr        = stats_ll_setxattr,
+    .getxattr        = stats_ll_getxattr,
+    .listxattr       = stats_ll_listxattr,
+    .removexattr     = stats_ll_removexattr,
+#endif
+};
+
+int rewrite_ll_main(struct fuse_args *args) {
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int ret = 1;
+
+    if(fuse_parse_cmdline(args, &opts) != 0)
+        return 1;
+
+    root.fd = dup(orig_fd());
+    if(root.fd == -1) {
+        perror("dup");
+        goto out;
+    }
+
+    se = fuse_session_new(args, control_files() ? &rewrite_ll_stats_oper : &rewrite_ll_oper,
+                          sizeof(rewrite_ll_oper), NULL);
+    if(se == NULL)
+        goto out;
+    session = se;
+    if(fuse_set_signal_handlers(se) != 0)
+        goto out_destroy;
+    if(fuse_session_mount(se, opts.mountpoint) != 0)
+        goto out_signals;
+
+    fuse_daemonize(opts.foreground);
+
+    if(opts.singlethread)
+        ret = fuse_session_loop(se);
+    else
+        ret = fuse_session_loop_mt(se, opts.clone_fd);
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_destroy:
+    fuse_session_destroy(se);
+out:
+    free(opts.mountpoint);
+    return ret ? 1 : 0;
+}
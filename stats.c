@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/* Bucket b counts latencies in [2^b, 2^(b+1)) ns */
+#define STATS_BUCKETS 40
+
+#define ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static const char *op_names[STATS_NOPS] = {
+    "lookup", "getattr", "setattr", "access", "readlink", "mknod", "mkdir",
+    "unlink", "rmdir", "symlink", "rename", "link", "open", "create", "read",
+    "write", "flush", "release", "fsync", "opendir", "readdir", "releasedir",
+    "fsyncdir", "statfs", "xattr", "fallocate", "flock", "copy_file_range",
+    "lseek", "forget",
+};
+
+struct op_counters {
+    unsigned long count;
+    unsigned long errors;
+    unsigned long rewrite_ns;
+    unsigned long syscall_ns;
+    unsigned long hist[STATS_BUCKETS];
+};
+
+/* Only written by its thread. When the thread exits, it is kept in the list
+ * to be reused by another one. */
+struct thread_stats {
+    struct thread_stats *next;
+    int in_use;
+    struct op_counters ops[STATS_NOPS];
+};
+
+static int enabled;
+static long start_time;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *threads;
+static pthread_key_t thread_key;
+static __thread struct thread_stats *thread_stats;
+/* Time spent in rewrite() by the current operation */
+static __thread long rewrite_ns;
+
+static pthread_t dumper;
+static void (*dump_rules)(FILE *out);
+static int dumper_running;
+static int stopping;
+
+static void release_thread_stats(void *data) {
+    struct thread_stats *ts = data;
+
+    pthread_mutex_lock(&threads_lock);
+    ts->in_use = 0;
+    pthread_mutex_unlock(&threads_lock);
+}
+
+static struct thread_stats *get_thread_stats() {
+    struct thread_stats *ts;
+
+    if(thread_stats)
+        return thread_stats;
+
+    pthread_mutex_lock(&threads_lock);
+    for(ts = threads; ts && ts->in_use; ts = ts->next);
+    if(ts == NULL) {
+        ts = calloc(1, sizeof(struct thread_stats));
+        if(ts != NULL) {
+            ts->next = threads;
+            threads = ts;
+        }
+    }
+    if(ts != NULL)
+        ts->in_use = 1;
+    pthread_mutex_unlock(&threads_lock);
+
+    if(ts != NULL)
+        pthread_setspecific(thread_key, ts);
+    thread_stats = ts;
+    return ts;
+}
+
+void stats_setup() {
+    sigset_t set;
+
+    pthread_key_create(&thread_key, release_thread_stats);
+    start_time = stats_now();
+    enabled = 1;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+const char *stats_op_name(enum stats_op op) {
+    return op < STATS_NOPS ? op_names[op] : "unknown";
+}
+
+int stats_enabled() {
+    return enabled;
+}
+
+long stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void stats_begin(struct stats_timer *timer) {
+    timer->start = stats_now();
+    timer->rewrite = rewrite_ns;
+}
+
+void stats_end(struct stats_timer *timer, enum stats_op op, int failed) {
+    struct thread_stats *ts = get_thread_stats();
+    struct op_counters *c;
+    long total = stats_now() - timer->start;
+    long rewrite = rewrite_ns - timer->rewrite;
+    int bucket = 0;
+
+    if(ts == NULL)
+        return;
+
+    c = &ts->ops[op];
+    while(bucket < STATS_BUCKETS - 1 && (total >> (bucket + 1)) > 0)
+        bucket++;
+
+    ADD(c->count, 1);
+    if(failed)
+        ADD(c->errors, 1);
+    ADD(c->rewrite_ns, rewrite);
+    ADD(c->syscall_ns, total - rewrite);
+    ADD(c->hist[bucket], 1);
+
+    if(trace_enabled())
+        trace_op(op, failed, timer->start, total, rewrite);
+}
+
+void stats_rewrite(long ns) {
+    rewrite_ns += ns;
+}
+
+void stats_print(FILE *out) {
+    struct op_counters sum;
+    struct thread_stats *ts;
+
+    fprintf(out, "uptime_s=%ld\n", (stats_now() - start_time) / 1000000000L);
+    for(int op = 0; op < STATS_NOPS; op++) {
+        memset(&sum, 0, sizeof(sum));
+        pthread_mutex_lock(&threads_lock);
+        for(ts = threads; ts; ts = ts->next) {
+            struct op_counters *c = &ts->ops[op];
+            sum.count += LOAD(c->count);
+            sum.errors += LOAD(c->errors);
+            sum.rewrite_ns += LOAD(c->rewrite_ns);
+            sum.syscall_ns += LOAD(c->syscall_ns);
+            for(int b = 0; b < STATS_BUCKETS; b++)
+                sum.hist[b] += LOAD(c->hist[b]);
+        }
+        pthread_mutex_unlock(&threads_lock);
+
+        if(sum.count == 0)
+            continue;
+        fprintf(out, "%s count=%lu errors=%lu rewrite_ns=%lu syscall_ns=%lu latency_log2_ns=",
+                op_names[op], sum.count, sum.errors, sum.rewrite_ns, sum.syscall_ns);
+        for(int b = 0, first = 1; b < STATS_BUCKETS; b++) {
+            if(sum.hist[b] == 0)
+                continue;
+            fprintf(out, "%s%d:%lu", first ? "" : ",", b, sum.hist[b]);
+            first = 0;
+        }
+        fprintf(out, "\n");
+    }
+}
+
+int stats_open_file(void (*print)(FILE *out)) {
+    int fd = memfd_create("rewritefs-stats", MFD_CLOEXEC);
+    FILE *out;
+
+    if(fd == -1)
+        return -1;
+    out = fdopen(dup(fd), "w");
+    if(out == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    print(out);
+    fclose(out);
+    lseek(fd, 0, SEEK_SET);
+
+    return fd;
+}
+
+static void *dump_thread(void *arg) {
+    sigset_t set;
+    int sig;
+
+    (void)arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while(sigwait(&set, &sig) == 0 && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        stats_print(stderr);
+        dump_rules(stderr);
+    }
+
+    return NULL;
+}
+
+void stats_start_dumper(void (*print_rules)(FILE *out)) {
+    if(!enabled)
+        return;
+    dump_rules = print_rules;
+    if(pthread_create(&dumper, NULL, dump_thread, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    dumper_running = 1;
+}
+
+void stats_stop() {
+    if(!dumper_running)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_kill(dumper, SIGUSR1);
+    pthread_join(dumper, NULL);
+    dumper_running = 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Per-operation statistics.
+ *
+ * Every thread accumulates into its own counters, so recording an operation
+ * takes no lock. A snapshot sums the counters of all threads.
+ */
+
+/* Virtual directory of the statistics file, at the root of the mount point */
+#define STATS_DIR  ".rewritefs"
+#define STATS_FILE "stats"
+#define STATS_RULES_FILE "rules"
+#define STATS_RELOAD_FILE "reload"
+
+enum stats_op {
+    STATS_LOOKUP,
+    STATS_GETATTR,
+    STATS_SETATTR,
+    STATS_ACCESS,
+    STATS_READLINK,
+    STATS_MKNOD,
+    STATS_MKDIR,
+    STATS_UNLINK,
+    STATS_RMDIR,
+    STATS_SYMLINK,
+    STATS_RENAME,
+    STATS_LINK,
+    STATS_OPEN,
+    STATS_CREATE,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_FLUSH,
+    STATS_RELEASE,
+    STATS_FSYNC,
+    STATS_OPENDIR,
+    STATS_READDIR,
+    STATS_RELEASEDIR,
+    STATS_FSYNCDIR,
+    STATS_STATFS,
+    STATS_XATTR,
+    STATS_FALLOCATE,
+    STATS_FLOCK,
+    STATS_COPY_FILE_RANGE,
+    STATS_LSEEK,
+    STATS_FORGET,
+    STATS_NOPS
+};
+
+struct stats_timer {
+    long start;
+    long rewrite;
+};
+
+/* Enable statistics, and block SIGUSR1 so that it can be waited for by
+ * the dump thread. Must be called before any thread is created. */
+void stats_setup();
+int stats_enabled();
+const char *stats_op_name(enum stats_op op);
+/* Dump statistics to stderr on SIGUSR1, followed by the rule statistics
+ * printed by print_rules */
+void stats_start_dumper(void (*print_rules)(FILE *out));
+void stats_stop();
+
+long stats_now();
+void stats_begin(struct stats_timer *timer);
+/* Record an operation started with stats_begin() */
+void stats_end(struct stats_timer *timer, enum stats_op op, int failed);
+/* Account time spent rewriting paths by the current operation */
+void stats_rewrite(long ns);
+
+void stats_print(FILE *out);
+
+/* Snapshot of the output of print (stats_print() or rule_stats_print()), in
+ * a file opened for reading. Return -1 and set errno on failure. */
+int stats_open_file(void (*print)(FILE *out));
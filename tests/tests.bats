@@ -219,6 +219,35 @@ EOF
     [ "$output" = "egg" ]
 }
 
+@test "Test named and multi-digit groups" {
+    cat > "$CFGFILE" << EOF
+m:^test2-(?<a>[^-]+)-(?<b>[^-]+)$: tmp/\\g{b}-\\g{a}
+m:^test3-(a)(b)(c)(d)(e)(f)(g)(h)(i)(j)(k): tmp/\\g{11}\\1
+EOF
+
+    mount_rewritefs
+
+    echo hello > "$TESTDIR/test2-x-y"
+    [ -f "$TESTDIR/tmp/y-x" ]
+
+    echo hello > "$TESTDIR/test3-abcdefghijk"
+    [ -f "$TESTDIR/tmp/ka" ]
+
+    # Empty matches, up to the end of the path
+    echo "m/a*/g -" > "$CFGFILE"
+    run sh -c "echo bcd | '$BATS_TEST_DIRNAME/../rewritefs-resolve' -c '$CFGFILE'"
+    [ "$status" = 0 ]
+    [ "$output" = "-b-c-d-" ]
+}
+
+@test "Test unknown groups" {
+    for tpl in '\2' '\g{2}' '\g{name}' ; do
+        echo "m:^(a): $tpl" > "$CFGFILE"
+        run sh -c "echo a | '$BATS_TEST_DIRNAME/../rewritefs-resolve' -c '$CFGFILE'"
+        [ "$status" != 0 ]
+    done
+}
+
 @test "Test autocreate option" {
     cat > "$CFGFILE" << EOF
 m:^tmp/(.+)-(.+)-(.+)-(.+): tmp/\\1/\\2/\\3/\\4
@@ -235,6 +264,25 @@ EOF
     run cat "$TESTDIR/tmp/a/b/c/d"
     [ "$status" = 0 ]
     [ "$output" = "hello" ]
+
+    # Looking a path up doesn't create its parents
+    run stat "$TESTDIR/tmp/e-f-g-h"
+    [ "$status" != 0 ]
+    [ ! -e "$TESTDIR/tmp/e" ]
+
+    # Directories removed through the mount point are created again
+    rm -r "$TESTDIR/tmp/a/b"
+    echo world > "$TESTDIR/tmp/a-b-c-e"
+    run cat "$TESTDIR/tmp/a/b/c/e"
+    [ "$status" = 0 ]
+    [ "$output" = "world" ]
+
+    # So are those removed in the source directory
+    rm -r "$BATS_TEST_DIRNAME/source/tmp/a/b"
+    echo again > "$TESTDIR/tmp/a-b-c-f"
+    run cat "$TESTDIR/tmp/a/b/c/f"
+    [ "$status" = 0 ]
+    [ "$output" = "again" ]
 }
 
 @test "Test regexp g flag" {
@@ -248,3 +296,462 @@ EOF
     [ "$status" = 0 ]
     [ "$output" = "bar" ]
 }
+
+@test "Test rewrite cache" {
+    cat > "$CFGFILE" << EOF
+m:^test1: egg
+EOF
+
+    for opts in cache_size=1 cache_size=0 ; do
+        mount_rewritefs $opts
+
+        for i in 1 2 ; do
+            run cat "$TESTDIR/test1"
+            [ "$status" = 0 ]
+            [ "$output" = "egg" ]
+
+            run cat "$TESTDIR/foo/bar"
+            [ "$status" = 0 ]
+            [ "$output" = "bar" ]
+        done
+
+        fusermount3 -u "$TESTDIR"
+    done
+}
+
+@test "Test rule order with literal prefixes" {
+    cat > "$CFGFILE" << EOF
+m:^(?!egg)fo(?=o/bar$): .
+m:^foo: egg
+m:^(te|eg)st: foo/bar
+EOF
+
+    mount_rewritefs
+
+    run cat "$TESTDIR/foo/bar"
+    [ "$status" = 0 ]
+    [ "$output" = "bar" ]
+
+    run cat "$TESTDIR/foo"
+    [ "$status" = 0 ]
+    [ "$output" = "egg" ]
+
+    run cat "$TESTDIR/test"
+    [ "$status" = 0 ]
+    [ "$output" = "bar" ]
+}
+
+@test "Test exact, prefix and glob rules" {
+    cat > "$CFGFILE" << EOF
+e:test1: egg
+p:test2/: foo
+m:^test3: egg
+e:test3: foo/bar
+g:t?st4*: foo
+EOF
+
+    mount_rewritefs
+
+    run cat "$TESTDIR/test1"
+    [ "$status" = 0 ]
+    [ "$output" = "egg" ]
+
+    run cat "$TESTDIR/test1/bar"
+    [ "$status" != 0 ]
+
+    run cat "$TESTDIR/test2/bar"
+    [ "$status" = 0 ]
+    [ "$output" = "bar" ]
+
+    run cat "$TESTDIR/test3"
+    [ "$status" = 0 ]
+    [ "$output" = "egg" ]
+
+    run cat "$TESTDIR/tast4x/bar"
+    [ "$status" = 0 ]
+    [ "$output" = "bar" ]
+}
+
+@test "Test lowlevel option" {
+    cat > "$CFGFILE" << EOF
+m:^test1: egg
+m:^test2(?=/|$): foo
+EOF
+
+    mount_rewritefs lowlevel
+
+    run cat "$TESTDIR/test1"
+    [ "$status" = 0 ]
+    [ "$output" = "egg" ]
+
+    run cat "$TESTDIR/test2/bar"
+    [ "$status" = 0 ]
+    [ "$output" = "bar" ]
+
+    mkdir "$TESTDIR/tmp/a"
+    echo hello > "$TESTDIR/tmp/a/b"
+    mv "$TESTDIR/tmp/a" "$TESTDIR/tmp/c"
+    run cat "$TESTDIR/tmp/c/b"
+    [ "$status" = 0 ]
+    [ "$output" = "hello" ]
+    [ ! -e "$TESTDIR/tmp/a/b" ]
+}
+
+@test "Test passthrough option" {
+    cat > "$CFGFILE" << EOF
+m:^test1: egg
+m:^test2(?=/|$): tmp
+EOF
+
+    mount_rewritefs passthrough
+
+    run cat "$TESTDIR/test1"
+    [ "$status" = 0 ]
+    [ "$output" = "egg" ]
+
+    echo hello > "$TESTDIR/test2/a"
+    echo world >> "$TESTDIR/test2/a"
+    run cat "$TESTDIR/tmp/a"
+    [ "$status" = 0 ]
+    [ "$output" = "hello
+world" ]
+}
+
+@test "Test io_uring option" {
+    cat > "$CFGFILE" << EOF
+m:^test1: egg
+m:^test2(?=/|$): tmp
+EOF
+
+    mount_rewritefs io_uring
+
+    run cat "$TESTDIR/test1"
+    [ "$status" = 0 ]
+    [ "$output" = "egg" ]
+
+    echo hello > "$TESTDIR/test2/a"
+    echo world >> "$TESTDIR/test2/a"
+    run cat "$TESTDIR/tmp/a"
+    [ "$status" = 0 ]
+    [ "$output" = "hello
+world" ]
+
+    run stat -c "%s" "$TESTDIR/test2/a"
+    [ "$status" = 0 ]
+    [ "$output" = "12" ]
+
+    truncate -s 5 "$TESTDIR/test2/a"
+    run cat "$TESTDIR/tmp/a"
+    [ "$output" = "hello" ]
+}
+
+@test "Test dir_cache option" {
+    cat > "$CFGFILE" << EOF
+m:^test2(?=/|$): tmp
+EOF
+
+    mount_rewritefs dir_cache=16
+
+    run cat "$TESTDIR/foo/bar"
+    [ "$status" = 0 ]
+    [ "$output" = "bar" ]
+
+    mkdir -p "$TESTDIR/test2/a/b"
+    echo hello > "$TESTDIR/test2/a/b/c"
+    run cat "$TESTDIR/tmp/a/b/c"
+    [ "$output" = "hello" ]
+
+    # Renaming a directory drops the open directories under it
+    mv "$TESTDIR/test2/a" "$TESTDIR/test2/d"
+    run cat "$TESTDIR/test2/a/b/c"
+    [ "$status" != 0 ]
+    run cat "$TESTDIR/test2/d/b/c"
+    [ "$output" = "hello" ]
+
+    rm -r "$TESTDIR/test2/d/b"
+    mkdir "$TESTDIR/test2/d/b"
+    run cat "$TESTDIR/test2/d/b/c"
+    [ "$status" != 0 ]
+}
+
+@test "Test negative_cache option" {
+    cat > "$CFGFILE" << EOF
+m:^test2(?=/|$): tmp
+EOF
+
+    mount_rewritefs negative_cache=16
+
+    run stat "$TESTDIR/test2/a/b"
+    [ "$status" != 0 ]
+    run stat "$TESTDIR/test2/a/b"
+    [ "$status" != 0 ]
+
+    # Created through rewritefs
+    mkdir "$TESTDIR/test2/a"
+    echo hello > "$TESTDIR/test2/a/b"
+    run cat "$TESTDIR/test2/a/b"
+    [ "$output" = "hello" ]
+
+    # Created directly in the source directory
+    run stat "$TESTDIR/test2/c"
+    [ "$status" != 0 ]
+    echo world > "$BATS_TEST_DIRNAME/source/tmp/c"
+    sleep 0.1
+    run cat "$TESTDIR/test2/c"
+    [ "$output" = "world" ]
+
+    # Symbolic links to a directory, through rewritefs and directly
+    mkdir "$BATS_TEST_DIRNAME/source/tmp/d"
+    echo link > "$BATS_TEST_DIRNAME/source/tmp/d/f"
+    run stat "$TESTDIR/test2/e/f"
+    [ "$status" != 0 ]
+    ln -s d "$TESTDIR/test2/e"
+    run cat "$TESTDIR/test2/e/f"
+    [ "$output" = "link" ]
+
+    run stat "$TESTDIR/test2/g/f"
+    [ "$status" != 0 ]
+    ln -s d "$BATS_TEST_DIRNAME/source/tmp/g"
+    sleep 0.1
+    run cat "$TESTDIR/test2/g/f"
+    [ "$output" = "link" ]
+}
+
+@test "Test page_cache and writeback_cache options" {
+    cat > "$CFGFILE" << EOF
+m:^test2(?=/|$): tmp
+EOF
+
+    for opts in "page_cache=16" "writeback_cache" "writeback_cache,lowlevel" ; do
+        mount_rewritefs "$opts"
+
+        echo hello > "$TESTDIR/test2/a"
+        echo world >> "$TESTDIR/test2/a"
+        run cat "$TESTDIR/test2/a"
+        [ "$output" = "$(printf 'hello\nworld')" ]
+        [ "$(cat "$BATS_TEST_DIRNAME/source/tmp/a")" = "$output" ]
+
+        # Changed directly in the source directory while closed
+        sleep 0.1
+        echo changed > "$BATS_TEST_DIRNAME/source/tmp/a"
+        run cat "$TESTDIR/test2/a"
+        [ "$output" = "changed" ]
+
+        rm "$TESTDIR/test2/a"
+        fusermount3 -u "$TESTDIR"
+    done
+}
+
+@test "Test kernel cache invalidation" {
+    cat > "$CFGFILE" << EOF
+m:^test1: tmp/real
+EOF
+
+    for opts in "" ",lowlevel" ; do
+        mount_rewritefs "entry_timeout=60,attr_timeout=60,negative_timeout=60$opts"
+
+        run cat "$TESTDIR/test1"
+        [ "$status" != 0 ]
+
+        # Invalidations are sent asynchronously
+        echo hello > "$TESTDIR/tmp/real"
+        sleep 1
+        run cat "$TESTDIR/test1"
+        [ "$status" = 0 ]
+        [ "$output" = "hello" ]
+
+        echo hello world > "$TESTDIR/test1"
+        sleep 1
+        run stat -c "%s" "$TESTDIR/tmp/real"
+        [ "$status" = 0 ]
+        [ "$output" = "12" ]
+
+        rm "$TESTDIR/test1"
+        sleep 1
+        [ ! -e "$TESTDIR/tmp/real" ]
+
+        fusermount3 -u "$TESTDIR"
+    done
+}
+
+@test "Test attributes in directory listings" {
+    cat > "$CFGFILE" << EOF
+m:^egg$: foo
+EOF
+
+    for opts in "" "lowlevel" ; do
+        mount_rewritefs "entry_timeout=60,attr_timeout=60,$opts"
+
+        run sh -c "ls -l '$TESTDIR' | grep ' egg$'"
+        [ "$status" = 0 ]
+        [ "${output:0:1}" = "d" ]
+
+        run ls -ld "$TESTDIR/foo/bar"
+        [ "$status" = 0 ]
+        [ "${output:0:1}" = "-" ]
+
+        fusermount3 -u "$TESTDIR"
+    done
+}
+
+@test "Test stats option" {
+    cat > "$CFGFILE" << EOF
+m:^egg$: foo
+EOF
+
+    for opts in "" "lowlevel" ; do
+        mount_rewritefs "stats,$opts"
+
+        ls "$TESTDIR/egg" > /dev/null
+        run cat "$TESTDIR/.rewritefs/stats"
+        [ "$status" = 0 ]
+        [[ "$output" == uptime_s=* ]]
+        echo "$output" | grep -q "^getattr count=[1-9]"
+
+        run cat "$TESTDIR/.rewritefs/rules"
+        [ "$status" = 0 ]
+        [[ "$output" == "rule evals="[1-9]*" matches="[1-9]*" ^egg$" ]]
+
+        fusermount3 -u "$TESTDIR"
+    done
+}
+
+@test "Test trace option" {
+    cat > "$CFGFILE" << EOF
+- /^ls /
+m:^egg$: foo
+- //
+m:^egg$: bar
+EOF
+
+    for opts in "" "lowlevel" ; do
+        mount_rewritefs "trace=$CFGFILE.trace,$opts"
+
+        ls "$TESTDIR/egg" > /dev/null
+        fusermount3 -u "$TESTDIR"
+
+        # The contexts match the command line of ls, not of rewritefs-replay
+        run "$BATS_TEST_DIRNAME/../rewritefs-replay" -o "config=$CFGFILE" "$CFGFILE.trace"
+        [ "$status" = 0 ]
+        echo "$output" | grep -q "^\(getattr\|lookup\)	[1-9][0-9]*	0	"
+
+        # Rewritten differently with another configuration
+        echo "m:^egg$: baz" > "$CFGFILE.new"
+        run "$BATS_TEST_DIRNAME/../rewritefs-replay" -o "config=$CFGFILE.new" "$CFGFILE.trace"
+        [ "$status" = 0 ]
+        echo "$output" | grep -q "^\(getattr\|lookup\)	[1-9][0-9]*	[1-9]"
+    done
+    rm -f "$CFGFILE.trace" "$CFGFILE.new"
+}
+
+@test "Test replaying a trace of the first format" {
+    echo "m:^egg$: foo" > "$CFGFILE"
+
+    # A getattr and an access of /egg, rewritten to foo
+    {
+        printf 'RWFSTRC1'
+        for op in '\x01' '\x03' ; do
+            printf '\x00\x00\x00\x00\x00\x00\x00\x00\xe8\x03\x00\x00\x00\x00\x00\x00'
+            printf '\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x04\x00\x03\x00'
+            printf "$op"'\x00\x00\x00\x00\x00\x00\x00/eggfoo'
+        done
+    } > "$CFGFILE.trace"
+
+    run "$BATS_TEST_DIRNAME/../rewritefs-replay" -o "config=$CFGFILE" "$CFGFILE.trace"
+    [ "$status" = 0 ]
+    echo "$output" | grep -q "^getattr	1	0	"
+    echo "$output" | grep -q "^access	1	0	"
+    rm -f "$CFGFILE.trace"
+}
+
+@test "Test rewritefs-resolve" {
+    cat > "$CFGFILE" << EOF
+- /^vim /
+m:^test1: vim
+- //
+m:^test1: egg
+EOF
+
+    run sh -c "printf 'test1\n/test1/bar\nfoo\n' | '$BATS_TEST_DIRNAME/../rewritefs-resolve' -c '$CFGFILE'"
+    [ "$status" = 0 ]
+    [ "$output" = "$(printf 'egg\negg/bar\nfoo')" ]
+
+    run sh -c "echo test1 | '$BATS_TEST_DIRNAME/../rewritefs-resolve' -c '$CFGFILE' -a 'vim foo' -t"
+    [ "$status" = 0 ]
+    [ "$output" = "$(printf 'test1\tvim')" ]
+}
+
+@test "Test configuration reload" {
+    cat > "$CFGFILE" << EOF
+m:^test1: foo
+EOF
+
+    # The control directory is opt-in
+    mount_rewritefs
+    [ ! -e "$TESTDIR/.rewritefs" ]
+    fusermount3 -u "$TESTDIR"
+
+    for opts in "" "lowlevel" ; do
+        mount_rewritefs "reload_file,$opts"
+
+        # Without stats, only the reload file is there
+        [ -f "$TESTDIR/.rewritefs/reload" ]
+        [ ! -e "$TESTDIR/.rewritefs/stats" ]
+
+        # test1 is the directory foo, then the file egg
+        run cat "$TESTDIR/test1/bar"
+        [ "$status" = 0 ]
+        [ "$output" = "bar" ]
+
+        cat > "$CFGFILE" << EOF
+m:^test1: egg
+EOF
+        echo > "$TESTDIR/.rewritefs/reload"
+        sleep 1
+        run cat "$TESTDIR/test1"
+        [ "$status" = 0 ]
+        [ "$output" = "egg" ]
+
+        # Errors keep the current rules
+        echo "m:^test1(: foo" > "$CFGFILE"
+        echo > "$TESTDIR/.rewritefs/reload"
+        sleep 1
+        run cat "$TESTDIR/test1"
+        [ "$status" = 0 ]
+        [ "$output" = "egg" ]
+
+        fusermount3 -u "$TESTDIR"
+        echo "m:^test1: foo" > "$CFGFILE"
+    done
+}
+
+@test "Test compiled_config option" {
+    cat > "$CFGFILE" << EOF
+m:^test1: egg
+m:^test2(?=/|$): foo
+EOF
+    rm -f "$CFGFILE.compiled"
+
+    for i in 1 2 ; do
+        mount_rewritefs "compiled_config=$CFGFILE.compiled"
+        [ -f "$CFGFILE.compiled" ]
+
+        run cat "$TESTDIR/test1"
+        [ "$status" = 0 ]
+        [ "$output" = "egg" ]
+        run cat "$TESTDIR/test2/bar"
+        [ "$status" = 0 ]
+        [ "$output" = "bar" ]
+
+        fusermount3 -u "$TESTDIR"
+    done
+
+    # A stale compiled configuration is ignored
+    echo "m:^test1: foo/bar" > "$CFGFILE"
+    mount_rewritefs "compiled_config=$CFGFILE.compiled"
+    run cat "$TESTDIR/test1"
+    [ "$status" = 0 ]
+    [ "$output" = "bar" ]
+    fusermount3 -u "$TESTDIR"
+    rm -f "$CFGFILE.compiled"
+}
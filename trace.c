@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "librewritefs.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACE_BUF_SIZE (256 * 1024)
+
+/* Only used by its thread. When the thread exits, it is written and kept in
+ * the list to be reused by another one. */
+struct trace_buf {
+    struct trace_buf *next;
+    int in_use;
+
+    /* First path rewritten by the current operation */
+    struct trace_record pending;
+    char path[PATH_MAX];
+    char rewritten[PATH_MAX];
+    char cmdline[PATH_MAX];
+
+    size_t len;
+    char data[TRACE_BUF_SIZE];
+};
+
+static int out_fd = -1;
+static long start_time;
+static int write_failed;
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *bufs;
+static pthread_key_t buf_key;
+static __thread struct trace_buf *trace_buf;
+
+static void flush(struct trace_buf *tb) {
+    size_t done = 0;
+    ssize_t res;
+
+    while(done < tb->len) {
+        res = write(out_fd, tb->data + done, tb->len - done);
+        if(res == -1 && errno == EINTR)
+            continue;
+        if(res <= 0) {
+            if(!__atomic_exchange_n(&write_failed, 1, __ATOMIC_RELAXED))
+                perror("writing trace");
+            break;
+        }
+        done += res;
+    }
+    tb->len = 0;
+}
+
+static void release_buf(void *data) {
+    struct trace_buf *tb = data;
+
+    flush(tb);
+    pthread_mutex_lock(&bufs_lock);
+    tb->in_use = 0;
+    pthread_mutex_unlock(&bufs_lock);
+}
+
+static struct trace_buf *get_trace_buf() {
+    struct trace_buf *tb;
+
+    if(trace_buf)
+        return trace_buf;
+
+    pthread_mutex_lock(&bufs_lock);
+    for(tb = bufs; tb && tb->in_use; tb = tb->next);
+    if(tb == NULL) {
+        tb = calloc(1, sizeof(struct trace_buf));
+        if(tb != NULL) {
+            tb->next = bufs;
+            bufs = tb;
+        }
+    }
+    if(tb != NULL)
+        tb->in_use = 1;
+    pthread_mutex_unlock(&bufs_lock);
+
+    if(tb != NULL)
+        pthread_setspecific(buf_key, tb);
+    trace_buf = tb;
+    return tb;
+}
+
+void trace_start(int fd) {
+    pthread_key_create(&buf_key, release_buf);
+    start_time = stats_now();
+    out_fd = fd;
+    if(write(fd, TRACE_MAGIC, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN)
+        perror("writing trace");
+}
+
+int trace_enabled() {
+    return out_fd != -1;
+}
+
+void trace_stop() {
+    struct trace_buf *tb;
+
+    if(out_fd == -1)
+        return;
+
+    pthread_mutex_lock(&bufs_lock);
+    for(tb = bufs; tb; tb = tb->next)
+        flush(tb);
+    pthread_mutex_unlock(&bufs_lock);
+    close(out_fd);
+    out_fd = -1;
+}
+
+static uint16_t copy_path(char *dst, const char *src) {
+    size_t len = strnlen(src, PATH_MAX);
+
+    memcpy(dst, src, len);
+    return len;
+}
+
+/* Command line of pid, with spaces between the arguments like for the
+ * contexts, truncated to PATH_MAX characters */
+static uint16_t read_cmdline(char *dst, pid_t pid) {
+    char path[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return 0;
+    len = read(fd, dst, PATH_MAX);
+    close(fd);
+    if(len <= 0)
+        return 0;
+    for(ssize_t i = 0; i < len; i++) {
+        if(dst[i] == '\0')
+            dst[i] = ' ';
+    }
+    return len;
+}
+
+void trace_rewrite(const char *path, const struct rewrite_caller *caller, int contexts, const char *res) {
+    struct trace_buf *tb = get_trace_buf();
+
+    if(tb == NULL || tb->pending.path_len > 0)
+        return;
+    if(caller != NULL) {
+        tb->pending.pid = caller->pid;
+        tb->pending.uid = caller->uid;
+        tb->pending.gid = caller->gid;
+        if(contexts)
+            tb->pending.cmdline_len = caller->cmdline ? copy_path(tb->cmdline, caller->cmdline)
+                                                      : read_cmdline(tb->cmdline, caller->pid);
+    }
+    tb->pending.path_len = copy_path(tb->path, path);
+    tb->pending.rewritten_len = res ? copy_path(tb->rewritten, res) : 0;
+}
+
+void trace_op(int op, int failed, long start, long total, long rewrite) {
+    struct trace_buf *tb = get_trace_buf();
+    struct trace_record *rec;
+
+    if(tb == NULL)
+        return;
+    if(tb->len + sizeof(struct trace_record) + tb->pending.path_len + tb->pending.rewritten_len +
+       tb->pending.cmdline_len > TRACE_BUF_SIZE)
+        flush(tb);
+
+    rec = &tb->pending;
+    rec->time_ns = start - start_time;
+    rec->total_ns = total > UINT32_MAX ? UINT32_MAX : total;
+    rec->rewrite_ns = rewrite > UINT32_MAX ? UINT32_MAX : rewrite;
+    rec->op = op;
+    rec->failed = failed;
+    memcpy(tb->data + tb->len, rec, sizeof(struct trace_record));
+    tb->len += sizeof(struct trace_record);
+    memcpy(tb->data + tb->len, tb->path, rec->path_len);
+    tb->len += rec->path_len;
+    memcpy(tb->data + tb->len, tb->rewritten, rec->rewritten_len);
+    tb->len += rec->rewritten_len;
+    memcpy(tb->data + tb->len, tb->cmdline, rec->cmdline_len);
+    tb->len += rec->cmdline_len;
+
+    memset(rec, 0, sizeof(struct trace_record));
+}
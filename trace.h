@@ -0,0 +1,53 @@
+/*
+ * Operation trace.
+ *
+ * With -o trace=FILE, every operation is recorded with its caller (and its
+ * command line when the contexts used it), the first path it rewrote and how
+ * long rewriting and the whole operation took. Each thread appends its
+ * records to its own buffer, written to the file when it is full and when
+ * rewritefs stops, so that recording takes no lock.
+ * rewritefs-replay plays a trace back.
+ *
+ * The file starts with TRACE_MAGIC, followed by the records in native byte
+ * order, ordered by thread rather than by time.
+ */
+
+#include <stdint.h>
+
+struct rewrite_caller;
+
+#define TRACE_MAGIC "RWFSTRC2"
+#define TRACE_MAGIC_V1 "RWFSTRC1" /* op and failed where cmdline_len is */
+#define TRACE_MAGIC_LEN 8
+
+/* Followed by the virtual path, the rewritten path and the command line of
+ * the caller, without null characters. path_len is 0 for operations on open
+ * files. */
+struct trace_record {
+    uint64_t time_ns; /* start of the operation, since the trace started */
+    uint32_t total_ns;
+    uint32_t rewrite_ns;
+    int32_t pid;
+    uint32_t uid;
+    uint32_t gid;
+    uint16_t path_len;
+    uint16_t rewritten_len;
+    uint16_t cmdline_len;
+    uint8_t op; /* enum stats_op */
+    uint8_t failed;
+    uint8_t reserved[4];
+};
+
+/* Record operations into fd, which must be open for appending. Operations
+ * are timed by the statistics, which must be set up too. */
+void trace_start(int fd);
+int trace_enabled();
+/* Write the records left and close the file */
+void trace_stop();
+
+/* path was rewritten to res by the current operation, for caller if not
+ * NULL. If contexts is set, the command line of caller is recorded, as
+ * matched by the contexts. */
+void trace_rewrite(const char *path, const struct rewrite_caller *caller, int contexts, const char *res);
+/* Record the current operation, timed by stats_begin() and stats_end() */
+void trace_op(int op, int failed, long start, long total, long rewrite);
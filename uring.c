@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+#define URING_ENTRIES 256
+/* Fixed file slots, for the files opened by chains of linked operations */
+#define URING_SLOTS 64
+/* Longest chain of linked operations */
+#define MAX_LINKED 3
+
+struct uring_wait {
+    sem_t done;
+    int remaining;
+};
+
+/* Target of the user_data of a submission */
+struct uring_op {
+    int res;
+    struct uring_wait *wait;
+};
+
+static struct {
+    int fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned cq_entries;
+    unsigned char supported[IORING_OP_LAST];
+
+    pthread_mutex_t lock;
+    unsigned pending;   /* queued but not submitted yet, protected by lock */
+    int submitting;     /* a thread is submitting, protected by lock */
+    unsigned inflight;  /* not completed yet, atomic */
+    int slots[URING_SLOTS]; /* free fixed file slots, protected by lock */
+    int nslots;
+
+    pthread_t reaper;
+} ring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int enabled;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+/* Completions are dispatched to their waiting threads by a single thread */
+static void *reap_thread(void *arg) {
+    unsigned head, tail;
+    int stop = 0;
+
+    (void)arg;
+    while(!stop) {
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail) {
+            if(uring_enter(0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+                perror("io_uring_enter");
+                abort();
+            }
+            continue;
+        }
+
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            struct uring_op *op = (struct uring_op *)(uintptr_t)cqe->user_data;
+            struct uring_wait *wait;
+
+            __atomic_sub_fetch(&ring.inflight, 1, __ATOMIC_RELAXED);
+            if(op == NULL) {
+                stop = 1;
+                continue;
+            }
+            /* The waiter may return as soon as it is posted */
+            wait = op->wait;
+            op->res = cqe->res;
+            if(__atomic_sub_fetch(&wait->remaining, 1, __ATOMIC_ACQ_REL) == 0)
+                sem_post(&wait->done);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/* Submit everything queued, including what other threads queue meanwhile.
+ * Called with ring.lock held, which is released during the system call. */
+static void submit_pending() {
+    int res;
+
+    ring.submitting = 1;
+    while(ring.pending > 0) {
+        unsigned count = ring.pending;
+        ring.pending = 0;
+        pthread_mutex_unlock(&ring.lock);
+        res = uring_enter(count, 0, 0);
+        pthread_mutex_lock(&ring.lock);
+        if(res == -1) {
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("io_uring_enter");
+                abort();
+            }
+            res = 0;
+        }
+        ring.pending += count - res;
+    }
+    ring.submitting = 0;
+}
+
+/* Queue n operations, their completions going to ops (NULL for none).
+ * Return -1 if the rings are full. */
+static int queue(struct io_uring_sqe *sqes, struct uring_op *ops, int n) {
+    unsigned tail, index;
+
+    pthread_mutex_lock(&ring.lock);
+    tail = *ring.sq_tail;
+    if(tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) + n > ring.sq_entries ||
+       __atomic_load_n(&ring.inflight, __ATOMIC_RELAXED) + n > ring.cq_entries) {
+        pthread_mutex_unlock(&ring.lock);
+        return -1;
+    }
+
+    for(int i = 0; i < n; i++) {
+        index = (tail + i) & *ring.sq_mask;
+        ring.sqes[index] = sqes[i];
+        ring.sqes[index].user_data = ops ? (uintptr_t)&ops[i] : 0;
+        ring.sq_array[index] = index;
+    }
+    __atomic_add_fetch(&ring.inflight, n, __ATOMIC_RELAXED);
+    __atomic_store_n(ring.sq_tail, tail + n, __ATOMIC_RELEASE);
+    ring.pending += n;
+
+    /* Whoever is already submitting will pick them up */
+    if(!ring.submitting)
+        submit_pending();
+    pthread_mutex_unlock(&ring.lock);
+
+    return 0;
+}
+
+/* Run n operations, linked by their flags, and store their results in res.
+ * Return -1 if they could not be queued. */
+static int run(struct io_uring_sqe *sqes, int *res, int n) {
+    struct uring_op ops[MAX_LINKED];
+    struct uring_wait wait;
+
+    wait.remaining = n;
+    sem_init(&wait.done, 0, 0);
+    for(int i = 0; i < n; i++)
+        ops[i].wait = &wait;
+
+    if(queue(sqes, ops, n) == -1) {
+        sem_destroy(&wait.done);
+        return -1;
+    }
+    while(sem_wait(&wait.done) == -1 && errno == EINTR);
+    sem_destroy(&wait.done);
+
+    for(int i = 0; i < n; i++)
+        res[i] = ops[i].res;
+    return 0;
+}
+
+/* Whether the operation can go through io_uring */
+static int prep(struct io_uring_sqe *sqe, int opcode, int fd) {
+    if(!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) || !ring.supported[opcode])
+        return 0;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    return 1;
+}
+
+static int result(int res) {
+    if(res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+static void probe() {
+    struct io_uring_probe *probe;
+
+    probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if(probe == NULL)
+        return;
+    if(uring_register(IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        for(int i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++) {
+            if(probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+                ring.supported[probe->ops[i].op] = 1;
+        }
+    }
+    free(probe);
+
+#ifdef IORING_FILE_INDEX_ALLOC
+    struct io_uring_rsrc_register files = {
+        .nr = URING_SLOTS,
+        .flags = IORING_RSRC_REGISTER_SPARSE,
+    };
+    if(uring_register(IORING_REGISTER_FILES2, &files, sizeof(files)) == 0) {
+        for(int i = 0; i < URING_SLOTS; i++)
+            ring.slots[ring.nslots++] = i;
+    }
+#endif
+}
+
+int uring_start() {
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    int err;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(ring.fd == -1)
+        return -1;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        err = ENOSYS;
+        goto fail;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring.rings = mmap(NULL, ring.rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQ_RING);
+    if(ring.rings == MAP_FAILED) {
+        err = errno;
+        goto fail;
+    }
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED) {
+        err = errno;
+        munmap(ring.rings, ring.rings_size);
+        goto fail;
+    }
+
+    ring.sq_head = (unsigned *)((char *)ring.rings + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.rings + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.rings + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((char *)ring.rings + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_head = (unsigned *)((char *)ring.rings + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.rings + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.rings + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.rings + p.cq_off.cqes);
+    ring.cq_entries = p.cq_entries;
+
+    probe();
+
+    err = pthread_create(&ring.reaper, NULL, reap_thread, NULL);
+    if(err != 0) {
+        munmap(ring.sqes, ring.sqes_size);
+        munmap(ring.rings, ring.rings_size);
+        goto fail;
+    }
+
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    close(ring.fd);
+    ring.fd = -1;
+    errno = err;
+    return -1;
+}
+
+void uring_stop() {
+    struct io_uring_sqe sqe;
+
+    if(!enabled)
+        return;
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+
+    /* Wake the reaper up with a completion for no one */
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    while(queue(&sqe, NULL, 1) == -1)
+        usleep(1000);
+    pthread_join(ring.reaper, NULL);
+
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.rings, ring.rings_size);
+    close(ring.fd);
+    ring.fd = -1;
+    ring.nslots = 0;
+}
+
+int uring_enabled() {
+    return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t size, off_t offset) {
+    struct io_uring_sqe sqe;
+    int res;
+
+    if(!prep(&sqe, IORING_OP_READ, fd))
+        return pread(fd, buf, size, offset);
+    sqe.addr = (uintptr_t)buf;
+    sqe.len = size;
+    sqe.off = offset;
+    if(run(&sqe, &res, 1) == -1)
+        return pread(fd, buf, size, offset);
+    return result(res);
+}
+
+ssize_t uring_pwrite(int fd, const void *buf, size_t size, off_t offset) {
+    struct io_uring_sqe sqe;
+    int res;
+
+    if(!prep(&sqe, IORING_OP_WRITE, fd))
+        return pwrite(fd, buf, size, offset);
+    sqe.addr = (uintptr_t)buf;
+    sqe.len = size;
+    sqe.off = offset;
+    if(run(&sqe, &res, 1) == -1)
+        return pwrite(fd, buf, size, offset);
+    return result(res);
+}
+
+static int sync_fsync(int fd, int datasync) {
+#ifdef HAVE_FDATASYNC
+    if(datasync)
+        return fdatasync(fd);
+#else
+    (void)datasync;
+#endif
+    return fsync(fd);
+}
+
+int uring_fsync(int fd, int datasync) {
+    struct io_uring_sqe sqe;
+    int res;
+
+    if(!prep(&sqe, IORING_OP_FSYNC, fd))
+        return sync_fsync(fd, datasync);
+#ifdef HAVE_FDATASYNC
+    if(datasync)
+        sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+#endif
+    if(run(&sqe, &res, 1) == -1)
+        return sync_fsync(fd, datasync);
+    return result(res);
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+int uring_fstatat(int dirfd, const char *path, struct stat *st, int flags) {
+    struct io_uring_sqe sqe;
+    struct statx stx;
+    int res;
+
+    if(!prep(&sqe, IORING_OP_STATX, dirfd))
+        return fstatat(dirfd, path, st, flags);
+    sqe.addr = (uintptr_t)path;
+    sqe.len = STATX_BASIC_STATS;
+    sqe.off = (uintptr_t)&stx;
+    sqe.statx_flags = flags;
+    if(run(&sqe, &res, 1) == -1)
+        return fstatat(dirfd, path, st, flags);
+    if(result(res) == -1)
+        return -1;
+    statx_to_stat(&stx, st);
+    return 0;
+}
+
+int uring_openat(int dirfd, const char *path, int flags) {
+    struct io_uring_sqe sqe;
+    int res;
+
+    if(!prep(&sqe, IORING_OP_OPENAT, dirfd))
+        return openat(dirfd, path, flags);
+    sqe.addr = (uintptr_t)path;
+    sqe.open_flags = flags;
+    if(run(&sqe, &res, 1) == -1)
+        return openat(dirfd, path, flags);
+    return result(res);
+}
+
+#ifdef HAVE_SETXATTR
+/*
+ * Open path into a fixed file slot, run op on it and close it, as one chain
+ * of linked operations. If the opening fails, the rest of the chain is
+ * cancelled; otherwise the file is closed whatever op returns.
+ */
+static int run_on_path(struct io_uring_sqe *op, int dirfd, const char *path, int *res) {
+#ifdef IORING_FILE_INDEX_ALLOC
+    struct io_uring_sqe sqes[3];
+    int results[3], slot, ret;
+
+    if(!ring.supported[IORING_OP_CLOSE] || !prep(&sqes[0], IORING_OP_OPENAT, dirfd))
+        return -1;
+
+    pthread_mutex_lock(&ring.lock);
+    slot = ring.nslots > 0 ? ring.slots[--ring.nslots] : -1;
+    pthread_mutex_unlock(&ring.lock);
+    if(slot == -1)
+        return -1;
+
+    sqes[0].addr = (uintptr_t)path;
+    sqes[0].open_flags = O_RDONLY;
+    sqes[0].file_index = slot + 1;
+    sqes[0].flags = IOSQE_IO_LINK;
+    sqes[1] = *op;
+    sqes[1].fd = slot;
+    sqes[1].flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    memset(&sqes[2], 0, sizeof(sqes[2]));
+    sqes[2].opcode = IORING_OP_CLOSE;
+    sqes[2].file_index = slot + 1;
+
+    ret = run(sqes, results, 3);
+
+    pthread_mutex_lock(&ring.lock);
+    ring.slots[ring.nslots++] = slot;
+    pthread_mutex_unlock(&ring.lock);
+
+    if(ret == 0)
+        *res = results[0] < 0 ? results[0] : results[1];
+    return ret;
+#else
+    (void)op; (void)dirfd; (void)path; (void)res;
+    return -1;
+#endif
+}
+
+int uring_setxattrat(int dirfd, const char *path, const char *name,
+                     const void *value, size_t size, int flags) {
+    struct io_uring_sqe sqe;
+    int fd, res;
+
+    if(prep(&sqe, IORING_OP_FSETXATTR, -1)) {
+        sqe.addr = (uintptr_t)name;
+        sqe.addr2 = (uintptr_t)value;
+        sqe.len = size;
+        sqe.xattr_flags = flags;
+        if(run_on_path(&sqe, dirfd, path, &res) == 0)
+            return result(res);
+    }
+
+    fd = openat(dirfd, path, O_RDONLY);
+    if(fd == -1)
+        return -1;
+    res = fsetxattr(fd, name, value, size, flags);
+    if(res == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return res;
+}
+
+ssize_t uring_getxattrat(int dirfd, const char *path, const char *name,
+                         void *value, size_t size) {
+    struct io_uring_sqe sqe;
+    ssize_t res;
+    int fd, ures;
+
+    if(prep(&sqe, IORING_OP_FGETXATTR, -1)) {
+        sqe.addr = (uintptr_t)name;
+        sqe.addr2 = (uintptr_t)value;
+        sqe.len = size;
+        if(run_on_path(&sqe, dirfd, path, &ures) == 0)
+            return result(ures);
+    }
+
+    fd = openat(dirfd, path, O_RDONLY);
+    if(fd == -1)
+        return -1;
+    res = fgetxattr(fd, name, value, size);
+    if(res == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return res;
+}
+#endif /* HAVE_SETXATTR */
@@ -0,0 +1,34 @@
+/*
+ * Optional io_uring execution of the system calls on the source directory.
+ *
+ * Each function behaves like its synchronous counterpart: it returns the
+ * result, or -1 and sets errno. Callers block until their operation is
+ * complete, but the operations of concurrent callers are submitted to the
+ * kernel together. Operations that need an intermediate file descriptor are
+ * submitted as one chain of linked requests.
+ *
+ * Until uring_start() succeeds, or when the kernel doesn't support an
+ * operation, the synchronous system call is made instead. Operations that
+ * create files must stay synchronous, since they depend on the credentials
+ * of the calling thread, which may not be the one that submits them.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Return -1 and set errno if io_uring is not available */
+int uring_start();
+void uring_stop();
+int uring_enabled();
+
+ssize_t uring_pread(int fd, void *buf, size_t size, off_t offset);
+ssize_t uring_pwrite(int fd, const void *buf, size_t size, off_t offset);
+int uring_fsync(int fd, int datasync);
+int uring_fstatat(int dirfd, const char *path, struct stat *st, int flags);
+/* Without O_CREAT */
+int uring_openat(int dirfd, const char *path, int flags);
+/* Open path, apply fsetxattr() or fgetxattr() to it, and close it */
+int uring_setxattrat(int dirfd, const char *path, const char *name,
+                     const void *value, size_t size, int flags);
+ssize_t uring_getxattrat(int dirfd, const char *path, const char *name,
+                         void *value, size_t size);
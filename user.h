@@ -0,0 +1,13 @@
+#include <errno.h>
+#include <sys/fsuid.h>
+
+/* Run expr with the filesystem UID/GID of the given user. Unlike seteuid(),
+ * setfsuid() and setfsgid() only change the credentials of the calling
+ * thread, so no lock is needed. */
+#define AS_USER(uid, gid, expr) { \
+    int _fsgid = setfsgid(gid); int _fsuid = setfsuid(uid); \
+    expr; \
+    int _errno = errno; \
+    setfsuid(_fsuid); setfsgid(_fsgid); \
+    errno = _errno; \
+}